@@ -0,0 +1,161 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Baked atlas file : a header, the sprite table (datalist text, see loader.bake), then the pages (RGBA8),
+// one after another at ATLAS_ALIGN, the same layout as the layers of the atlas texture array.
+
+#define ATLAS_MAGIC "SATL"
+#define ATLAS_VERSION 1
+#define ATLAS_ALIGN 4096
+
+struct atlas_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t texture_size;
+	uint32_t page_n;
+	uint32_t meta_size;
+	uint32_t pixel_offset;
+};
+
+FILE * fopen_utf8(const char *filename, const char *mode);
+void * map_file_utf8(const char *filename, size_t *sz);
+void unmap_file(void *ptr, size_t sz);
+
+struct atlas_map {
+	void *ptr;
+	size_t sz;
+};
+
+static inline size_t
+page_size(uint32_t texture_size) {
+	return (size_t)texture_size * texture_size * 4;
+}
+
+// atlas.write(filename, meta, texture_size, page_n, pixels)
+static int
+latlas_write(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	size_t meta_size;
+	const char *meta = luaL_checklstring(L, 2, &meta_size);
+	int texture_size = luaL_checkinteger(L, 3);
+	int page_n = luaL_checkinteger(L, 4);
+	const void *pixels = lua_touserdata(L, 5);
+	if (pixels == NULL)
+		return luaL_error(L, "Need pixels");
+	if (texture_size <= 0 || texture_size > 0xffff || page_n <= 0)
+		return luaL_error(L, "Invalid atlas (%d * %d pages)", texture_size, page_n);
+	struct atlas_header h;
+	memcpy(h.magic, ATLAS_MAGIC, 4);
+	h.version = ATLAS_VERSION;
+	h.texture_size = texture_size;
+	h.page_n = page_n;
+	h.meta_size = (uint32_t)meta_size;
+	h.pixel_offset = (uint32_t)((sizeof(h) + meta_size + ATLAS_ALIGN - 1) / ATLAS_ALIGN * ATLAS_ALIGN);
+	FILE *f = fopen_utf8(filename, "wb");
+	if (f == NULL)
+		return luaL_error(L, "Can't write %s", filename);
+	static const char padding[ATLAS_ALIGN] = { 0 };
+	size_t pad = h.pixel_offset - sizeof(h) - meta_size;
+	size_t pixels_size = page_size(h.texture_size) * page_n;
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(meta, 1, meta_size, f) == meta_size
+		&& fwrite(padding, 1, pad, f) == pad
+		&& fwrite(pixels, 1, pixels_size, f) == pixels_size;
+	if (fclose(f) != 0 || !ok)
+		return luaL_error(L, "Write %s failed", filename);
+	return 0;
+}
+
+static int
+latlas_unmap(lua_State *L) {
+	struct atlas_map *m = (struct atlas_map *)lua_touserdata(L, 1);
+	if (m->ptr) {
+		unmap_file(m->ptr, m->sz);
+		m->ptr = NULL;
+	}
+	return 0;
+}
+
+static const struct atlas_header *
+check_header(lua_State *L) {
+	struct atlas_map *m = (struct atlas_map *)luaL_checkudata(L, 1, "SOLUNA_ATLAS");
+	if (m->ptr == NULL)
+		luaL_error(L, "Atlas is closed");
+	return (const struct atlas_header *)m->ptr;
+}
+
+static int
+latlas_meta(lua_State *L) {
+	const struct atlas_header *h = check_header(L);
+	lua_pushlstring(L, (const char *)(h + 1), h->meta_size);
+	return 1;
+}
+
+// returns the pixels (pages one after another), texture size and page number.
+// the pointer is valid until the atlas object is collected
+static int
+latlas_pages(lua_State *L) {
+	const struct atlas_header *h = check_header(L);
+	lua_pushlightuserdata(L, (void *)((const char *)h + h->pixel_offset));
+	lua_pushinteger(L, h->texture_size);
+	lua_pushinteger(L, h->page_n);
+	return 3;
+}
+
+// atlas.load(filename) maps the file, the pages are never copied
+static int
+latlas_load(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	struct atlas_map *m = (struct atlas_map *)lua_newuserdatauv(L, sizeof(*m), 0);
+	m->ptr = NULL;
+	m->sz = 0;
+	if (luaL_newmetatable(L, "SOLUNA_ATLAS")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", latlas_unmap },
+			{ "__close", latlas_unmap },
+			{ "meta", latlas_meta },
+			{ "pages", latlas_pages },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	size_t sz = 0;
+	void *ptr = map_file_utf8(filename, &sz);
+	if (ptr == NULL)
+		return luaL_error(L, "Can't open %s", filename);
+	m->ptr = ptr;
+	m->sz = sz;
+	const struct atlas_header *h = (const struct atlas_header *)ptr;
+	if (sz < sizeof(*h) || memcmp(h->magic, ATLAS_MAGIC, 4) != 0)
+		return luaL_error(L, "%s is not an atlas", filename);
+	if (h->version != ATLAS_VERSION)
+		return luaL_error(L, "%s : unsupported atlas version %d", filename, (int)h->version);
+	// page_size() of a larger texture_size may wrap around
+	if (h->texture_size == 0 || h->texture_size > 0xffff
+		|| h->pixel_offset < sizeof(*h) + h->meta_size
+		|| h->pixel_offset % ATLAS_ALIGN != 0
+		|| sz < h->pixel_offset
+		|| (sz - h->pixel_offset) / page_size(h->texture_size) < h->page_n)
+		return luaL_error(L, "%s is truncated", filename);
+	return 1;
+}
+
+int
+luaopen_soluna_atlas(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "write", latlas_write },
+		{ "load", latlas_load },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
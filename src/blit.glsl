@@ -0,0 +1,52 @@
+@vs vs
+layout(binding=0) uniform vs_params {
+	vec4 target;	// 2/width, -2/height (2/height if the origin is bottom left), y offset (1 or -1)
+	ivec4 info;	// first rect (in words), bytes per pixel
+};
+
+// rects : x << 16 | y, w << 16 | h, offset (in bytes), pitch (in bytes) ; pixels : rows of each rect
+layout(binding=0) readonly buffer pixels {
+	uint data[];
+};
+
+out vec2 pixel;	// in the rect
+flat out uvec3 src;	// offset, pitch, bytes per pixel
+
+void main() {
+	uint base = uint(info.x) + uint(gl_InstanceIndex) * 4u;
+	uint pos = data[base];
+	uint size = data[base + 1u];
+	vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+	vec2 local = corner * vec2(size >> 16, size & 0xffffu);
+	vec2 p = (vec2(pos >> 16, pos & 0xffffu) + local) * target.xy;
+	gl_Position = vec4(p.x - 1.0f, p.y + target.z, 0, 1);
+	// row 0 of the rect is at pos.y on both origins, so local (interpolated) is the source row
+	pixel = local;
+	src = uvec3(data[base + 2u], data[base + 3u], uint(info.y));
+}
+
+@end
+
+@fs fs
+layout(binding=0) readonly buffer pixels {
+	uint data[];
+};
+
+in vec2 pixel;
+flat in uvec3 src;
+out vec4 frag_color;
+
+void main() {
+	uvec2 p = uvec2(pixel);
+	uint addr = src.x + p.y * src.y + p.x * src.z;
+	uint word = data[addr >> 2];
+	if (src.z == 4u) {
+		frag_color = unpackUnorm4x8(word);
+	} else {
+		float v = float((word >> ((addr & 3u) * 8u)) & 0xffu) / 255.0;
+		frag_color = vec4(v, v, v, v);
+	}
+}
+@end
+
+@program blit vs fs
@@ -38,4 +38,35 @@ void main() {
 }
 @end
 
-@program colorquad vs fs
\ No newline at end of file
+@program colorquad vs fs
+
+@vs vs_sr
+// scale and rotation in instance data, without sr_lut
+layout(binding=0) uniform vs_params {
+	vec2 framesize;
+};
+
+mat2 sr_matrix(float scale, float rot) {
+	float c = cos(rot) * scale;
+	float s = sin(rot) * scale;
+	return mat2(c, -s, s, c);
+}
+
+in vec4 position;
+in vec2 sr;	// scale, rot
+in vec4 c;
+
+out vec4 color;
+
+void main() {
+	ivec2 u2 = ivec2(0 , position.z);
+	ivec2 v2 = ivec2(0 , position.w);
+	vec2 uv_offset = vec2(u2[gl_VertexIndex & 1] , v2[gl_VertexIndex >> 1]);
+	vec2 pos = (uv_offset * sr_matrix(sr.x, sr.y) + position.xy) * framesize;
+	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
+	color = c;
+}
+
+@end
+
+@program colorquad_sr vs_sr fs
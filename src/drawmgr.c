@@ -1,9 +1,19 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 
 #include "batch.h"
 #include "spritemgr.h"
+#include "material_util.h"
+#include "stats.h"
+#include "material_vtable.h"
+#include "render_bindings.h"
+
+#define DRAWMGR_MATERIAL 256
+#define DRAWMGR_TEXTURE 256
 
 struct draw_element {
 	struct draw_primitive * base;
@@ -12,11 +22,50 @@ struct draw_element {
 	int texture;
 };
 
+struct cull_rect {
+	float left;
+	float top;
+	float right;
+	float bottom;
+};
+
+struct sort_item {
+	uint64_t key;	// z << 32 | material << 16 | texture
+	uint32_t seq;
+	uint32_t size;
+	struct draw_primitive *p;
+};
+
+// layout of the render service's uniform (framesize, tex_size)
+struct frame_uniform {
+	float framesize[2];
+	float tex_size;
+};
+
+struct material_entry {
+	const struct material_vtable *vt;	// NULL : dispatch in lua
+	void *obj;
+};
+
 struct drawmgr {
 	struct sprite_bank *bank;
 	int cap;
 	int n;
 	int bank_n;
+	int cull;
+	int sort;
+	int culled;
+	int total;
+	int stream_n;
+	int stream_cap;
+	int sort_cap;
+	struct cull_rect viewport;
+	struct draw_primitive *stream;	// primitives after cull and sort
+	struct sort_item *sort_items;
+	struct material_entry material[DRAWMGR_MATERIAL];
+	sg_view texture[DRAWMGR_TEXTURE];
+	float texsize[DRAWMGR_TEXTURE];	// 0 : the tex_size of the uniform
+	struct frame_uniform *uniform;	// NULL : tex_size is not changed
 	struct draw_element data[1];
 };
 
@@ -51,9 +100,190 @@ ldrawmgr_reset(lua_State *L) {
 	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
 	d->n = 0;
 	d->bank_n = d->bank->n;
+	d->culled = 0;
+	d->total = 0;
+	d->stream_n = 0;
 	return 0;
 }
 
+static inline float
+sr_scale(uint32_t sr) {
+	uint32_t scale_fix = sr >> 12;
+	if (scale_fix == 0)
+		return 1.0f;
+	if (scale_fix >= 0xff000)
+		return (float)(scale_fix & 0xfff) / 4096.0f;
+	return (float)(scale_fix + 0x100) / 256.0f;
+}
+
+static inline float
+max_abs(float a, float b) {
+	a = fabsf(a);
+	b = fabsf(b);
+	return a > b ? a : b;
+}
+
+// returns 1 if the sprite is entirely outside the viewport
+static int
+cull_sprite(const struct cull_rect *view, struct draw_primitive *p, struct sprite_rect *r) {
+	float x = (float)p->x / 256.0f;
+	float y = (float)p->y / 256.0f;
+	float s = sr_scale(p->sr);
+	float x0 = (float)(0x8000 - (int)(r->off >> 16));
+	float y0 = (float)(0x8000 - (int)(r->off & 0xffff));
+	float x1 = x0 + (float)(r->u & 0xffff);
+	float y1 = y0 + (float)(r->v & 0xffff);
+	if ((p->sr & 0xfff) == 0) {
+		// no rotation, test the exact rect
+		return x + x1 * s < view->left
+			|| x + x0 * s > view->right
+			|| y + y1 * s < view->top
+			|| y + y0 * s > view->bottom;
+	}
+	// rotated, use a conservative radius (manhattan distance >= euclidean)
+	float radius = (max_abs(x0, x1) + max_abs(y0, y1)) * s;
+	return x + radius < view->left
+		|| x - radius > view->right
+		|| y + radius < view->top
+		|| y - radius > view->bottom;
+}
+
+static struct draw_primitive *
+cull_reserve(struct drawmgr *d, int n) {
+	int size = d->stream_n + n;
+	if (size <= d->stream_cap)
+		return d->stream;
+	int cap = d->stream_cap ? d->stream_cap : 1024;
+	while (cap < size)
+		cap = cap * 3 / 2;
+	struct draw_primitive *old = d->stream;
+	struct draw_primitive *stream = (struct draw_primitive *)realloc(old, cap * sizeof(*stream));
+	if (stream == NULL)
+		return NULL;
+	if (stream != old && old != NULL) {
+		// rebase the draw elements already in the stream
+		uintptr_t from = (uintptr_t)old;
+		uintptr_t to = from + d->stream_n * sizeof(*old);
+		int i;
+		for (i=0;i<d->n;i++) {
+			uintptr_t base = (uintptr_t)d->data[i].base;
+			if (base >= from && base < to) {
+				d->data[i].base = stream + (d->data[i].base - old);
+			}
+		}
+	}
+	d->stream = stream;
+	d->stream_cap = cap;
+	return stream;
+}
+
+static int
+sort_compar(const void *a, const void *b) {
+	const struct sort_item *ia = (const struct sort_item *)a;
+	const struct sort_item *ib = (const struct sort_item *)b;
+	if (ia->key != ib->key)
+		return ia->key < ib->key ? -1 : 1;
+	return (int)ia->seq - (int)ib->seq;
+}
+
+static struct sort_item *
+sort_reserve(lua_State *L, struct drawmgr *d, int n) {
+	if (n <= d->sort_cap)
+		return d->sort_items;
+	int cap = d->sort_cap ? d->sort_cap : 1024;
+	while (cap < n)
+		cap = cap * 3 / 2;
+	struct sort_item *items = (struct sort_item *)realloc(d->sort_items, cap * sizeof(*items));
+	if (items == NULL)
+		luaL_error(L, "drawmgr sort : Out of memory");
+	d->sort_items = items;
+	d->sort_cap = cap;
+	return items;
+}
+
+static inline uint64_t
+sort_key(uint32_t z, int material, int texture) {
+	return (uint64_t)z << 32 | (uint64_t)(material & 0xffff) << 16 | (uint64_t)(texture & 0xffff);
+}
+
+// Copy visible primitives into d->stream, only the default material (sprites) is culled.
+// When sort is enabled, primitives are ordered by (zkey, material, texture) ; zkey markers are removed.
+static struct draw_primitive *
+filter_stream(lua_State *L, struct drawmgr *d, struct draw_primitive *prim, int *prim_n) {
+	int n = *prim_n;
+	struct draw_primitive *stream = cull_reserve(d, n);
+	if (stream == NULL) {
+		luaL_error(L, "drawmgr cull : Out of memory");
+	}
+	struct draw_primitive *out = stream + d->stream_n;
+	struct sort_item *items = d->sort ? sort_reserve(L, d, n) : NULL;
+	struct sprite_rect * rect = d->bank->rect;
+	int rect_n = d->bank_n;
+	uint32_t z = 0x80000000;
+	int i;
+	int count = 0;
+	int item_n = 0;
+	int culled = 0;
+	int kept = 0;
+	for (i=0;i<n;) {
+		struct draw_primitive *p = &prim[i];
+		int sprite = p->sprite;
+		if (sprite <= 0) {
+			if (i + 1 >= n)
+				luaL_error(L, "Invalid batch stream");
+			i += 2;
+			if (sprite == -MATERIAL_ZKEY) {
+				z = (uint32_t)p->x ^ 0x80000000;
+				continue;
+			}
+			++kept;
+			if (items == NULL) {
+				out[count++] = p[0];
+				out[count++] = p[1];
+			} else {
+				struct draw_primitive_external * ext = (struct draw_primitive_external *)&p[1];
+				int texid = ext->sprite >= 0 && ext->sprite < rect_n ? sprite_texture(rect[ext->sprite].texid) : 0xffff;
+				struct sort_item *item = &items[item_n];
+				item->key = sort_key(z, -sprite, texid);
+				item->seq = item_n++;
+				item->size = 2;
+				item->p = p;
+			}
+		} else {
+			++i;
+			if (d->cull && sprite <= rect_n && cull_sprite(&d->viewport, p, &rect[sprite-1])) {
+				++culled;
+				continue;
+			}
+			++kept;
+			if (items == NULL) {
+				out[count++] = *p;
+			} else {
+				int texid = sprite <= rect_n ? sprite_texture(rect[sprite-1].texid) : 0xffff;
+				struct sort_item *item = &items[item_n];
+				item->key = sort_key(z, 0, texid);
+				item->seq = item_n++;
+				item->size = 1;
+				item->p = p;
+			}
+		}
+	}
+	if (items) {
+		qsort(items, item_n, sizeof(*items), sort_compar);
+		for (i=0;i<item_n;i++) {
+			out[count++] = items[i].p[0];
+			if (items[i].size == 2)
+				out[count++] = items[i].p[1];
+		}
+	}
+	d->culled += culled;
+	stats_add(STATS_CULLED, culled);
+	d->total += culled + kept;
+	d->stream_n += count;
+	*prim_n = count;
+	return out;
+}
+
 static int
 append_external_material(struct drawmgr * d, struct draw_primitive *base, int n, int matid, int texid) {
 	int i;
@@ -65,8 +295,11 @@ append_external_material(struct drawmgr * d, struct draw_primitive *base, int n,
 		}
 		struct draw_primitive_external * ext = (struct draw_primitive_external *)&base[i*2+1];
 		int sprite = ext->sprite;
-		if (sprite >= 0 && rect[sprite].texid != texid) {
-			break;
+		if (sprite >= 0) {
+			// an invalid id ends the element, ldrawmgr_append() raises the error
+			if (sprite >= d->bank_n || sprite_texture(rect[sprite].texid) != texid)
+				break;
+			sprite_touch(d->bank, sprite);
 		}
 	}
 	struct draw_element *e = &d->data[d->n++];
@@ -88,8 +321,9 @@ append_default_material(struct drawmgr * d, struct draw_primitive *base, int n,
 		if (sprite <= 0 || sprite > rect_n)
 			break;
 		--sprite;
-		if (texid != rect[sprite].texid)
+		if (texid != sprite_texture(rect[sprite].texid))
 			break;
+		sprite_touch(d->bank, sprite);
 	}
 	struct draw_element *e = &d->data[d->n++];
 	e->base = base;
@@ -99,17 +333,32 @@ append_default_material(struct drawmgr * d, struct draw_primitive *base, int n,
 	return i;
 }
 
+// drawmgr:append(ptr, n) or drawmgr:append(stream_string) ; keep the string alive until drawmgr:draw()
 static int
 ldrawmgr_append(lua_State *L) {
 	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
 	
-	struct draw_primitive *prim = (struct draw_primitive *)lua_touserdata(L, 2);
-	int prim_n = luaL_checkinteger(L, 3);
+	struct draw_primitive *prim;
+	int prim_n;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		size_t sz;
+		// the stream is read only
+		prim = (struct draw_primitive *)lua_tolstring(L, 2, &sz);
+		prim_n = (int)(sz / sizeof(*prim));
+	} else {
+		prim = (struct draw_primitive *)lua_touserdata(L, 2);
+		prim_n = luaL_checkinteger(L, 3);
+	}
+	if (d->cull || d->sort) {
+		prim = filter_stream(L, d, prim, &prim_n);
+	}
+	int from = d->n;
 	
 	struct sprite_rect * rect = d->bank->rect;
 	int rect_n = d->bank_n;
 
 	int i;
+	int missing = 0;
 	struct draw_primitive *end_ptr = &prim[prim_n];
 	for (i=0;i<prim_n;) {
 		struct draw_primitive *p = &prim[i];
@@ -117,6 +366,11 @@ ldrawmgr_append(lua_State *L) {
 		if (d->n >= d->cap) {
 			return luaL_error(L, "Too many draw");
 		}
+		if (index == -MATERIAL_ZKEY) {
+			// zkey is only used by sort
+			i += 2;
+			continue;
+		}
 		if (index <= 0) {
 			if (i == prim_n || index == 0) {
 				return luaL_error(L, "Invalid batch stream");
@@ -125,37 +379,293 @@ ldrawmgr_append(lua_State *L) {
 			int sprite = ext->sprite;
 			int texid = -1;
 			if (sprite >= 0) {
-				texid = rect[sprite].texid;
+				if (sprite >= rect_n)
+					return luaL_error(L, "Invalid sprite id %d", sprite);
+				if (!sprite_resident(sprite_touch(d->bank, sprite))) {
+					// skip it until bank:pack() places it in the atlas
+					++missing;
+					i += 2;
+					continue;
+				}
+				texid = sprite_texture(rect[sprite].texid);
 			}
 			i += append_external_material(d, p, (end_ptr - p)/2, index, texid) * 2;
 		} else {
 			--index;
 			if (index >= rect_n)
 				return luaL_error(L, "Invalid sprite id %d", index);
-			int texid = rect[index].texid;
+			if (!sprite_resident(sprite_touch(d->bank, index))) {
+				++missing;
+				++i;
+				continue;
+			}
+			int texid = sprite_texture(rect[index].texid);
 			i += append_default_material(d, p, end_ptr - p, texid);
 		}
 	}
+	int prim_count = 0;
+	for (i=from;i<d->n;i++) {
+		prim_count += d->data[i].n;
+	}
+	stats_add(STATS_PRIMITIVE, prim_count);
+	stats_add(STATS_DRAW_ELEMENT, d->n - from);
+	stats_add(STATS_SPRITE_MISS, missing);
 
 	return 0;
 }
 
+// drawmgr:viewport(width, height [, margin]) enables culling, drawmgr:viewport() disables it
+static int
+ldrawmgr_viewport(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	if (lua_isnoneornil(L, 2)) {
+		d->cull = 0;
+		return 0;
+	}
+	float width = luaL_checknumber(L, 2);
+	float height = luaL_checknumber(L, 3);
+	float margin = luaL_optnumber(L, 4, 0);
+	d->viewport.left = -margin;
+	d->viewport.top = -margin;
+	d->viewport.right = width + margin;
+	d->viewport.bottom = height + margin;
+	d->cull = 1;
+	return 0;
+}
+
+// drawmgr:sort(enable) reorders primitives by (zkey, material, texture) to merge draws
+static int
+ldrawmgr_sort(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	d->sort = lua_toboolean(L, 2);
+	return 0;
+}
+
+// drawmgr:frame() advances the frame clock of the sprite bank (the atlas evicts sprites untouched for a while),
+// call it once per frame after drawmgr:submit(). returns true (once) if some sprites drawn are waiting for bank:pack()
+static int
+ldrawmgr_frame(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	struct sprite_bank *b = d->bank;
+	++b->current_frame;
+	int request = !b->texture_ready || (b->retry && (int16_t)(b->current_frame - b->retry_frame) >= 0);
+	// sprite_touch() clears it again, in the same (render) service
+	b->texture_ready = 1;
+	if (request)
+		b->retry = 0;
+	lua_pushboolean(L, request);
+	return 1;
+}
+
+// returns culled primitives and total primitives since last reset
+static int
+ldrawmgr_culled(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	lua_pushinteger(L, d->culled);
+	lua_pushinteger(L, d->total);
+	return 2;
+}
+
+// drawmgr:material(id, obj) registers a material for drawmgr:submit() and drawmgr:draw().
+// obj is a C material (with a vtable in its metatable), or a table { submit = f(ptr, n), draw = f(ptr, n [, tex]) }
+static int
+ldrawmgr_material(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	int id = luaL_checkinteger(L, 2);
+	if (id < 0 || id >= DRAWMGR_MATERIAL)
+		return luaL_error(L, "Invalid material id %d", id);
+	struct material_entry *m = &d->material[id];
+	m->vt = NULL;
+	m->obj = NULL;
+	switch (lua_type(L, 3)) {
+	case LUA_TUSERDATA:
+		if (luaL_getmetafield(L, 3, MATERIAL_VTABLE) != LUA_TLIGHTUSERDATA)
+			return luaL_error(L, "Material %d has no vtable", id);
+		m->vt = (const struct material_vtable *)lua_touserdata(L, -1);
+		m->obj = lua_touserdata(L, 3);
+		lua_pop(L, 1);
+		break;
+	case LUA_TTABLE:
+	case LUA_TNIL:
+		break;
+	default:
+		return luaL_error(L, "Invalid material %s", luaL_typename(L, 3));
+	}
+	lua_settop(L, 3);
+	lua_getiuservalue(L, 1, 1);
+	lua_insert(L, 3);
+	lua_rawseti(L, 3, id);
+	return 0;
+}
+
+// drawmgr:texture(texid, view [, size, render_target]) sets the texture view passed to C materials.
+// A texture with size (square) is drawn with its own tex_size instead of the atlas one,
+// the v of a render target is flipped on GL
+static int
+ldrawmgr_texture(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	int texid = luaL_checkinteger(L, 2);
+	if (texid < 0 || texid >= DRAWMGR_TEXTURE)
+		return luaL_error(L, "Invalid texture id %d", texid);
+	d->texsize[texid] = 0;
+	if (lua_isnoneornil(L, 3)) {
+		d->texture[texid].id = SG_INVALID_ID;
+	} else {
+		struct soluna_render_view *v = (struct soluna_render_view *)luaL_checkudata(L, 3, "SOKOL_VIEW");
+		d->texture[texid] = v->view;
+		int size = luaL_optinteger(L, 4, 0);
+		if (size < 0)
+			return luaL_error(L, "Invalid texture size %d", size);
+		if (size > 0) {
+			float texsize = 1.0f / size;
+			if (lua_toboolean(L, 5) && origin_bottom_left())
+				texsize = -texsize;
+			d->texsize[texid] = texsize;
+		}
+	}
+	return 0;
+}
+
+// drawmgr:uniform(uniform) ; draw() sets its tex_size for the texture of each draw element
+static int
+ldrawmgr_uniform(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	d->uniform = (struct frame_uniform *)luaL_checkudata(L, 2, "SOKOL_UNIFORM");
+	lua_settop(L, 2);
+	lua_setiuservalue(L, 1, 2);
+	return 0;
+}
+
+static struct material_entry *
+get_material(lua_State *L, struct drawmgr *d, int id) {
+	if (id < 0 || id >= DRAWMGR_MATERIAL)
+		luaL_error(L, "Invalid material id %d", id);
+	return &d->material[id];
+}
+
+// materials table at index 2
+static void
+dispatch_lua(lua_State *L, struct draw_element *e, const char *method) {
+	if (lua_rawgeti(L, 2, e->material) != LUA_TTABLE)
+		luaL_error(L, "Material %d is not registered", e->material);
+	lua_getfield(L, -1, method);
+	lua_pushlightuserdata(L, e->base);
+	lua_pushinteger(L, e->n);
+	if (e->texture >= 0) {
+		lua_pushinteger(L, e->texture);
+		lua_call(L, 3, 0);
+	} else {
+		lua_call(L, 2, 0);
+	}
+	lua_pop(L, 1);
+}
+
+// submit all the draw elements to their materials
+static int
+ldrawmgr_submit(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	lua_settop(L, 1);
+	lua_getiuservalue(L, 1, 1);
+	int i;
+	for (i=0;i<d->n;i++) {
+		struct draw_element *e = &d->data[i];
+		struct material_entry *m = get_material(L, d, e->material);
+		if (m->vt) {
+			m->vt->submit(L, m->obj, e->base, e->n);
+		} else {
+			dispatch_lua(L, e, "submit");
+		}
+	}
+	return 0;
+}
+
+// draw all the draw elements, call it in a pass after drawmgr:submit()
+static int
+ldrawmgr_draw(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)luaL_checkudata(L, 1, "SOLUNA_DRAWMGR");
+	lua_settop(L, 1);
+	lua_getiuservalue(L, 1, 1);
+	int ex = sg_query_features().draw_base_instance;
+	float texsize = d->uniform ? d->uniform->tex_size : 0;
+	int i;
+	for (i=0;i<d->n;i++) {
+		struct draw_element *e = &d->data[i];
+		struct material_entry *m = get_material(L, d, e->material);
+		if (d->uniform) {
+			float t = 0;
+			if (e->texture >= 0 && e->texture < DRAWMGR_TEXTURE)
+				t = d->texsize[e->texture];
+			d->uniform->tex_size = t != 0 ? t : texsize;
+		}
+		if (m->vt) {
+			const sg_view *tex = NULL;
+			if (e->texture >= 0 && e->texture < DRAWMGR_TEXTURE && d->texture[e->texture].id != SG_INVALID_ID)
+				tex = &d->texture[e->texture];
+			m->vt->draw(m->obj, e->base, e->n, tex, ex);
+		} else {
+			dispatch_lua(L, e, "draw");
+		}
+	}
+	if (d->uniform)
+		d->uniform->tex_size = texsize;
+	return 0;
+}
+
+static int
+ldrawmgr_release(lua_State *L) {
+	struct drawmgr * d = (struct drawmgr *)lua_touserdata(L, 1);
+	free(d->stream);
+	d->stream = NULL;
+	free(d->sort_items);
+	d->sort_items = NULL;
+	d->sort_cap = 0;
+	d->stream_n = 0;
+	d->stream_cap = 0;
+	return 0;
+}
+
 static int
 ldrawmgr_new(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
 	void * bank = lua_touserdata(L, 1);
 	int cap = luaL_checkinteger(L, 2);
-	struct drawmgr * d = (struct drawmgr *)lua_newuserdatauv(L, sizeof(*d) + (cap-1)*sizeof(d->data[0]), 0);
+	struct drawmgr * d = (struct drawmgr *)lua_newuserdatauv(L, sizeof(*d) + (cap-1)*sizeof(d->data[0]), 2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	memset(d->material, 0, sizeof(d->material));
+	memset(d->texture, 0, sizeof(d->texture));
+	memset(d->texsize, 0, sizeof(d->texsize));
+	d->uniform = NULL;
 	d->bank = (struct sprite_bank *)bank;
 	d->cap = cap;
 	d->n = 0;
+	d->bank_n = 0;
+	d->cull = 0;
+	d->sort = 0;
+	d->sort_cap = 0;
+	d->sort_items = NULL;
+	d->culled = 0;
+	d->total = 0;
+	d->stream_n = 0;
+	d->stream_cap = 0;
+	d->stream = NULL;
 	if (luaL_newmetatable(L, "SOLUNA_DRAWMGR")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
 			{ "__len", ldrawmgr_len },
 			{ "__call", ldrawmgr_index },
+			{ "__gc", ldrawmgr_release },
 			{ "reset", ldrawmgr_reset },
 			{ "append", ldrawmgr_append },
+			{ "viewport", ldrawmgr_viewport },
+			{ "culled", ldrawmgr_culled },
+			{ "frame", ldrawmgr_frame },
+			{ "sort", ldrawmgr_sort },
+			{ "material", ldrawmgr_material },
+			{ "texture", ldrawmgr_texture },
+			{ "uniform", ldrawmgr_uniform },
+			{ "submit", ldrawmgr_submit },
+			{ "draw", ldrawmgr_draw },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
@@ -27,9 +27,20 @@ getF(lua_State *L) {
 static int
 lsubmit(lua_State *L){
 	struct font_manager *F = getF(L);
-	int dirty = font_manager_flush(F);
-	lua_pushboolean(L, dirty);
-	return 1;
+	static uint32_t rect[FONT_MANAGER_TEXSIZE / FONT_MANAGER_GLYPHSIZE * FONT_MANAGER_TEXSIZE / FONT_MANAGER_GLYPHSIZE];
+	int n = 0;
+	int dirty = font_manager_flush(F, rect, &n);
+	lua_pushboolean(L, dirty || n > 0);
+	if (n == 0)
+		return 1;
+	// the glyph slots to upload, u << 16 | v
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, rect[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 2;
 }
 
 static int
@@ -144,6 +155,7 @@ luaopen_font(lua_State *L) {
 		{ "submit",				lsubmit },
 		{ "cobj",				lcobj },
 		{ "texture_size",		NULL },
+		{ "glyph_size",			NULL },
 		{ "import_icon",		limport_icon },
 		{ NULL, 				NULL },
 	};
@@ -152,6 +164,8 @@ luaopen_font(lua_State *L) {
 
 	lua_pushinteger(L, FONT_MANAGER_TEXSIZE);
 	lua_setfield(L, -2, "texture_size");
+	lua_pushinteger(L, FONT_MANAGER_GLYPHSIZE);
+	lua_setfield(L, -2, "glyph_size");
 
 	return 1;
 }
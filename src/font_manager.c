@@ -1,6 +1,7 @@
 #include "font_manager.h"
 #include "mutex.h"
 #include "truetype.h"
+#include "stats.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -74,9 +75,12 @@ struct font_manager {
 	void *L;
 	int dpi_perinch;
 	int dirty;
+	int dirty_n;	// slots written since the last flush
 	int icon_n;
 	unsigned char *icon_data;
 	mutex_t mutex;
+	int16_t dirty_slot[FONT_MANAGER_SLOTS];
+	uint8_t slot_dirty[FONT_MANAGER_SLOTS];
 	uint8_t texture_buffer[FONT_MANAGER_TEXSIZE*FONT_MANAGER_TEXSIZE];
 };
 
@@ -260,6 +264,7 @@ font_manager_touch_unsafe(struct font_manager *F, int font, int codepoint, struc
 
 		return 1;
 	}
+	stats_add(STATS_FONT_MISS, 1);
 	int last_slot = F->priority[F->list_head].prev;
 	struct priority_list *last_node = &F->priority[last_slot];
 	
@@ -423,6 +428,11 @@ font_manager_update(struct font_manager *F, int fontid, int codepoint, struct fo
 	glyph->u = (slot % FONT_MANAGER_SLOTLINE) * FONT_MANAGER_GLYPHSIZE;
 	glyph->v = (slot / FONT_MANAGER_SLOTLINE) * FONT_MANAGER_GLYPHSIZE;
 
+	if (!F->slot_dirty[slot]) {
+		F->slot_dirty[slot] = 1;
+		F->dirty_slot[F->dirty_n++] = slot;
+	}
+
 	struct font_slot *s = &F->slots[slot];
 	s->codepoint_key = cp;
 	s->offset_x = glyph->offset_x;
@@ -518,12 +528,20 @@ font_manager_glyph(struct font_manager *F, int fontid, int codepoint, int size,
 }
 
 int
-font_manager_flush(struct font_manager *F) {
+font_manager_flush(struct font_manager *F, uint32_t *rect, int *rect_n) {
 	// todo : atomic inc
 	lock(F);
 	int dirty = F->dirty;
 	++F->version;
 	F->dirty = 0;
+	int i;
+	for (i=0;i<F->dirty_n;i++) {
+		int slot = F->dirty_slot[i];
+		F->slot_dirty[slot] = 0;
+		rect[i] = (slot % FONT_MANAGER_SLOTLINE) * FONT_MANAGER_GLYPHSIZE << 16 | (slot / FONT_MANAGER_SLOTLINE) * FONT_MANAGER_GLYPHSIZE;
+	}
+	*rect_n = F->dirty_n;
+	F->dirty_n = 0;
 	unlock(F);
 	return dirty;
 }
@@ -585,6 +603,8 @@ font_manager_init(struct font_manager *F, void *L) {
 	F->L = NULL;
 	F->dpi_perinch = 0;
 	F->dirty = 0;
+	F->dirty_n = 0;
+	memset(F->slot_dirty, 0, sizeof(F->slot_dirty));
 	F->icon_n = 0;
 	F->icon_data = NULL;
 // init priority list
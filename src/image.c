@@ -42,6 +42,7 @@ realloc_luastring(void *ptr, size_t sz) {
 #include "stb/stb_image_write.h"
 
 #include "luabuffer.h"
+#include "jobpool.h"
 
 static void *
 free_image(void *ud, void *ptr, size_t osize, size_t nsize) {
@@ -77,15 +78,9 @@ image_load(lua_State *L) {
 	return 3;
 };
 
-static int
-image_load_alpha(lua_State *L) {
-	int x, y;
-	stbi_uc * img = NULL;
-	int r = load_image(L, &x, &y, &img);
-	if (r)
-		return r;
+static void
+make_alpha(stbi_uc *ptr, int x, int y) {
 	int i, j;
-	stbi_uc * ptr = img;
 	for (i=0;i<y;i++) {
 		for (j=0;j<x;j++) {
 			ptr[3] = 255 - ptr[0];
@@ -95,12 +90,101 @@ image_load_alpha(lua_State *L) {
 			ptr += 4;
 		}
 	}
+}
+
+static int
+image_load_alpha(lua_State *L) {
+	int x, y;
+	stbi_uc * img = NULL;
+	int r = load_image(L, &x, &y, &img);
+	if (r)
+		return r;
+	make_alpha(img, x, y);
 	lua_pushexternalstring(L, (const char *)img, x * y * 4, free_image, NULL);
 	lua_pushinteger(L, x);
 	lua_pushinteger(L, y);
 	return 3;
 };
 
+struct decode_job {
+	const stbi_uc *buffer;
+	size_t sz;
+	int alpha;
+	int x;
+	int y;
+	stbi_uc *img;
+	const char *err;
+};
+
+static void
+decode_job(void *ud, int index) {
+	struct decode_job *job = (struct decode_job *)ud + index;
+	int c;
+	job->img = stbi_load_from_memory(job->buffer, job->sz, &job->x, &job->y, &c, 4);
+	if (job->img == NULL) {
+		// the failure reason of stb_image is thread local
+		job->err = stbi_failure_reason();
+		return;
+	}
+	if (job->alpha)
+		make_alpha(job->img, job->x, job->y);
+}
+
+// image.load_batch(contents [, alpha, threads]) decodes the png files in contents (strings) on threads,
+// alpha[i] == true loads contents[i] as image.load_alpha() does.
+// returns { [i] = { data = , w = , h = } or error message }
+static int
+image_load_batch(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int has_alpha = lua_istable(L, 2);
+	int threads = luaL_optinteger(L, 3, 1);
+	int n = (int)lua_rawlen(L, 1);
+	struct decode_job *job = (struct decode_job *)lua_newuserdatauv(L, sizeof(*job) * (n > 0 ? n : 1), 0);
+	int i;
+	for (i=0;i<n;i++) {
+		struct decode_job *j = &job[i];
+		memset(j, 0, sizeof(*j));
+		// contents are kept in the table during decoding
+		lua_rawgeti(L, 1, i+1);
+		j->buffer = (const stbi_uc *)luaL_checklstring(L, -1, &j->sz);
+		lua_pop(L, 1);
+		if (has_alpha) {
+			lua_rawgeti(L, 2, i+1);
+			j->alpha = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	if (threads > n)
+		threads = n;
+	struct jobpool *P = threads > 1 ? jobpool_new(threads) : NULL;
+	if (P) {
+		jobpool_run(P, decode_job, job, n);
+		jobpool_delete(P);
+	} else {
+		for (i=0;i<n;i++) {
+			decode_job(job, i);
+		}
+	}
+	lua_createtable(L, n, 0);
+	for (i=0;i<n;i++) {
+		struct decode_job *j = &job[i];
+		if (j->img == NULL) {
+			lua_pushstring(L, j->err ? j->err : "Unknown");
+		} else {
+			lua_createtable(L, 0, 3);
+			lua_pushexternalstring(L, (const char *)j->img, j->x * j->y * 4, free_image, NULL);
+			j->img = NULL;
+			lua_setfield(L, -2, "data");
+			lua_pushinteger(L, j->x);
+			lua_setfield(L, -2, "w");
+			lua_pushinteger(L, j->y);
+			lua_setfield(L, -2, "h");
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 static int
 image_info(lua_State *L) {
 	size_t sz;
@@ -506,6 +590,41 @@ canvas_blit(lua_State *L) {
 	return 0;
 }
 
+// image.clear(canvas [, x, y, w, h]) fills the rect with transparent pixels
+static int
+canvas_clear(lua_State *L) {
+	if (check_canvas(L, 1) == LUA_TSTRING)
+		return luaL_error(L, "canvas is readonly");
+	struct canvas * c = (struct canvas *)lua_touserdata(L, 1);
+	int x = luaL_optinteger(L, 2, 0);
+	int y = luaL_optinteger(L, 3, 0);
+	int w = luaL_optinteger(L, 4, c->width);
+	int h = luaL_optinteger(L, 5, c->height);
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > c->width) {
+		w = c->width - x;
+	}
+	if (y + h > c->height) {
+		h = c->height - y;
+	}
+	if (w <= 0 || h <= 0)
+		return 0;
+	int i;
+	uint8_t * ptr = (uint8_t *)c->buffer + y * c->stride + 4 * x;
+	for (i=0;i<h;i++) {
+		memset(ptr, 0, w * 4);
+		ptr += c->stride;
+	}
+	return 0;
+}
+
 static int
 image_makeindex(lua_State *L) {
 	if (lua_isnoneornil(L, 1)) {
@@ -534,12 +653,14 @@ luaopen_image(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "load", image_load },
 		{ "load_alpha", image_load_alpha },
+		{ "load_batch", image_load_batch },
 		{ "info", image_info },
 		{ "crop", image_crop },
 		{ "canvas", image_canvas },
 		{ "canvas_size", image_canvas_size },
 		{ "new", image_new },
 		{ "blit", canvas_blit },
+		{ "clear", canvas_clear },
 		{ "makeindex", image_makeindex },
 		{ NULL, NULL },
 	};
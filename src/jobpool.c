@@ -0,0 +1,361 @@
+#ifdef TEST_JOBPOOL_MAIN
+// clock_gettime of the benchmark, it must be defined before any system header
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "jobpool.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+typedef HANDLE thread_t;
+typedef SRWLOCK lock_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define lock_init(m) InitializeSRWLock(&(m))
+#define lock_destroy(m)
+#define lock_acquire(m) AcquireSRWLockExclusive(&(m))
+#define lock_release(m) ReleaseSRWLockExclusive(&(m))
+#define cond_init(c) InitializeConditionVariable(&(c))
+#define cond_destroy(c)
+#define cond_wait(c, m) SleepConditionVariableSRW(&(c), &(m), INFINITE, 0)
+#define cond_wakeall(c) WakeAllConditionVariable(&(c))
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t lock_t;
+typedef pthread_cond_t cond_t;
+
+#define lock_init(m) pthread_mutex_init(&(m), NULL)
+#define lock_destroy(m) pthread_mutex_destroy(&(m))
+#define lock_acquire(m) pthread_mutex_lock(&(m))
+#define lock_release(m) pthread_mutex_unlock(&(m))
+#define cond_init(c) pthread_cond_init(&(c), NULL)
+#define cond_destroy(c) pthread_cond_destroy(&(c))
+#define cond_wait(c, m) pthread_cond_wait(&(c), &(m))
+#define cond_wakeall(c) pthread_cond_broadcast(&(c))
+
+#endif
+
+struct jobpool {
+	int threads;	// workers + the calling thread
+	int quit;
+	int generation;
+	int active;	// workers still running jobs of this generation
+	jobpool_func func;
+	void *ud;
+	int n;
+	atomic_int next;
+	lock_t lock;
+	cond_t work;
+	cond_t done;
+	thread_t worker[JOBPOOL_MAX];
+};
+
+static void
+run_jobs(struct jobpool *P) {
+	for (;;) {
+		int index = atomic_fetch_add_explicit(&P->next, 1, memory_order_relaxed);
+		if (index >= P->n)
+			break;
+		P->func(P->ud, index);
+	}
+}
+
+static void
+worker_loop(struct jobpool *P) {
+	int generation = 0;
+	lock_acquire(P->lock);
+	for (;;) {
+		while (P->generation == generation && !P->quit)
+			cond_wait(P->work, P->lock);
+		if (P->quit)
+			break;
+		generation = P->generation;
+		lock_release(P->lock);
+		run_jobs(P);
+		lock_acquire(P->lock);
+		if (--P->active == 0)
+			cond_wakeall(P->done);
+	}
+	lock_release(P->lock);
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI
+worker_main(LPVOID ud) {
+	worker_loop((struct jobpool *)ud);
+	return 0;
+}
+
+static int
+thread_create(thread_t *t, struct jobpool *P) {
+	*t = CreateThread(NULL, 0, worker_main, P, 0, NULL);
+	return *t != NULL;
+}
+
+static void
+thread_join(thread_t t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+#else
+
+static void *
+worker_main(void *ud) {
+	worker_loop((struct jobpool *)ud);
+	return NULL;
+}
+
+static int
+thread_create(thread_t *t, struct jobpool *P) {
+	return pthread_create(t, NULL, worker_main, P) == 0;
+}
+
+static void
+thread_join(thread_t t) {
+	pthread_join(t, NULL);
+}
+
+#endif
+
+struct jobpool *
+jobpool_new(int threads) {
+	if (threads < 1)
+		threads = 1;
+	else if (threads > JOBPOOL_MAX)
+		threads = JOBPOOL_MAX;
+	struct jobpool *P = (struct jobpool *)malloc(sizeof(*P));
+	if (P == NULL)
+		return NULL;
+	P->quit = 0;
+	P->generation = 0;
+	P->active = 0;
+	P->func = NULL;
+	P->ud = NULL;
+	P->n = 0;
+	atomic_init(&P->next, 0);
+	lock_init(P->lock);
+	cond_init(P->work);
+	cond_init(P->done);
+	int i;
+	P->threads = 1;
+	for (i=1;i<threads;i++) {
+		if (!thread_create(&P->worker[i-1], P))
+			break;
+		++P->threads;
+	}
+	return P;
+}
+
+void
+jobpool_delete(struct jobpool *P) {
+	if (P == NULL)
+		return;
+	lock_acquire(P->lock);
+	P->quit = 1;
+	cond_wakeall(P->work);
+	lock_release(P->lock);
+	int i;
+	for (i=1;i<P->threads;i++) {
+		thread_join(P->worker[i-1]);
+	}
+	cond_destroy(P->work);
+	cond_destroy(P->done);
+	lock_destroy(P->lock);
+	free(P);
+}
+
+int
+jobpool_threads(struct jobpool *P) {
+	return P->threads;
+}
+
+void
+jobpool_run(struct jobpool *P, jobpool_func func, void *ud, int n) {
+	if (P->threads <= 1 || n <= 1) {
+		int i;
+		for (i=0;i<n;i++)
+			func(ud, i);
+		return;
+	}
+	lock_acquire(P->lock);
+	P->func = func;
+	P->ud = ud;
+	P->n = n;
+	atomic_store_explicit(&P->next, 0, memory_order_relaxed);
+	P->active = P->threads - 1;
+	++P->generation;
+	cond_wakeall(P->work);
+	lock_release(P->lock);
+
+	run_jobs(P);
+
+	lock_acquire(P->lock);
+	while (P->active > 0)
+		cond_wait(P->done, P->lock);
+	lock_release(P->lock);
+}
+
+#ifdef TEST_JOBPOOL_MAIN
+
+// gcc -std=c99 -Wall -O2 -DTEST_JOBPOOL_MAIN -o jobpool_test jobpool.c srbuffer.c -lpthread -lm
+// Encode like the default material (sprite rect lookup, fixed point to float, sr key into shards), 1 to 16 threads
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "srbuffer.h"
+
+#define INSTANCE 200000
+#define SPRITE 1024
+#define DISTINCT 4096
+
+struct rect {
+	uint32_t off;
+	uint32_t u;
+	uint32_t v;
+};
+
+struct prim {
+	int32_t x;
+	int32_t y;
+	uint32_t sr;
+	int sprite;
+};
+
+struct inst {
+	float x, y;
+	float sr_index;
+	uint32_t off, u, v;
+};
+
+struct job {
+	struct prim *prim;
+	struct inst *out;
+	struct rect *rect;
+	struct sr_shard *shard;
+	int n;
+	int jobs;
+};
+
+static double
+bench_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+range(struct job *J, int index, int *from, int *to) {
+	*from = (int)((int64_t)J->n * index / J->jobs);
+	*to = (int)((int64_t)J->n * (index + 1) / J->jobs);
+}
+
+static void
+encode(void *ud, int index) {
+	struct job *J = (struct job *)ud;
+	struct sr_shard *S = &J->shard[index];
+	int from, to, i;
+	range(J, index, &from, &to);
+	for (i=from;i<to;i++) {
+		struct prim *p = &J->prim[i];
+		struct inst *o = &J->out[i];
+		struct rect *r = &J->rect[p->sprite - 1];
+		o->x = (float)p->x / 256.0f;
+		o->y = (float)p->y / 256.0f;
+		o->sr_index = (float)srshard_add(S, p->sr);
+		o->off = r->off;
+		o->u = r->u;
+		o->v = r->v;
+	}
+}
+
+static void
+remap(void *ud, int index) {
+	struct job *J = (struct job *)ud;
+	const int *m = J->shard[index].remap;
+	int from, to, i;
+	range(J, index, &from, &to);
+	for (i=from;i<to;i++) {
+		J->out[i].sr_index = (float)m[(int)J->out[i].sr_index];
+	}
+}
+
+int
+main() {
+	struct prim *prim = (struct prim *)malloc(INSTANCE * sizeof(*prim));
+	struct inst *out = (struct inst *)malloc(INSTANCE * sizeof(*out));
+	struct inst *serial = (struct inst *)malloc(INSTANCE * sizeof(*serial));
+	struct rect *rect = (struct rect *)malloc(SPRITE * sizeof(*rect));
+	struct sr_shard shard[JOBPOOL_MAX];
+	struct sr_buffer *SR = (struct sr_buffer *)malloc(srbuffer_size(0x10000));
+	int i, t;
+	for (i=0;i<SPRITE;i++) {
+		rect[i].off = i;
+		rect[i].u = i * 3;
+		rect[i].v = i * 7;
+	}
+	uint32_t seed = 1;
+	for (i=0;i<INSTANCE;i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t k = (seed >> 8) % DISTINCT;
+		prim[i].x = (int32_t)(seed % 1024) << 8;
+		prim[i].y = (int32_t)((seed >> 10) % 768) << 8;
+		prim[i].sr = (k / 64 + 1) << 12 | (k % 64);
+		prim[i].sprite = (int)(seed >> 16) % SPRITE + 1;
+	}
+	for (i=0;i<JOBPOOL_MAX;i++)
+		srshard_init(&shard[i]);
+	const int frames = 32;
+	for (t=1;t<=JOBPOOL_MAX;t*=2) {
+		struct jobpool *P = jobpool_new(t);
+		assert(P);
+		struct job J = { prim, out, rect, shard, INSTANCE, t };
+		double total = 0;
+		int frame;
+		for (frame=0;frame<frames;frame++) {
+			srbuffer_init(SR, 0x10000);
+			double ti = bench_time();
+			for (i=0;i<t;i++) {
+				int ok = srshard_reserve(&shard[i], INSTANCE / t + 1);
+				assert(ok);
+			}
+			jobpool_run(P, encode, &J, t);
+			for (i=0;i<t;i++) {
+				int ok = srshard_merge(&shard[i], SR);
+				assert(ok);
+			}
+			jobpool_run(P, remap, &J, t);
+			total += bench_time() - ti;
+			srbuffer_release(SR);
+		}
+		if (t == 1) {
+			memcpy(serial, out, INSTANCE * sizeof(*out));
+		} else {
+			// the same output as one thread
+			assert(memcmp(serial, out, INSTANCE * sizeof(*out)) == 0);
+		}
+		printf("%2d threads : %.3f ms per frame (%d instances)\n", t, total * 1000 / frames, INSTANCE);
+		jobpool_delete(P);
+	}
+	for (i=0;i<JOBPOOL_MAX;i++)
+		srshard_release(&shard[i]);
+	free(SR);
+	free(rect);
+	free(serial);
+	free(out);
+	free(prim);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef soluna_jobpool_h
+#define soluna_jobpool_h
+
+// A small pool of worker threads. jobpool_run() calls func(ud, 0 .. n-1) on the workers
+// and the calling thread, and returns when all the jobs are done.
+
+#define JOBPOOL_MAX 16
+
+struct jobpool;
+
+typedef void (*jobpool_func)(void *ud, int index);
+
+struct jobpool * jobpool_new(int threads);
+void jobpool_delete(struct jobpool *P);
+int jobpool_threads(struct jobpool *P);
+void jobpool_run(struct jobpool *P, jobpool_func func, void *ud, int n);
+
+#endif
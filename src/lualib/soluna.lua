@@ -69,6 +69,32 @@ function soluna.load_sprites(filename)
 	return sprites
 end
 
+-- Bake the sprites of a bundle (.dl) into an atlas file for shipping builds,
+-- soluna.load_sprites "xxx.atlas" maps it and uploads the pages, skipping decode, crop and pack.
+-- Load baked atlases before any bundle of png, and raise setting atlas_page to hold all the baked pages.
+function soluna.bake_sprites(filename, output)
+	local loader = ltask.uniqueservice "loader"
+	return ltask.call(loader, "bake", filename, output)
+end
+
+-- A cached layer : primitives recorded by batch:record() are rendered into an offscreen texture,
+-- and drawn by batch:add(layer.sprite, x, y) as one sprite until the next update or dirty.
+function soluna.cache_layer(width, height)
+	local render = ltask.uniqueservice "render"
+	local slot, sprite = ltask.call(render, "layer_new", width, height)
+	local layer = { sprite = sprite }
+	function layer:update(segment)
+		ltask.call(render, "layer_update", slot, segment:data())
+	end
+	function layer:dirty()
+		ltask.send(render, "layer_dirty", slot)
+	end
+	function layer:release()
+		ltask.send(render, "layer_release", slot)
+	end
+	return layer
+end
+
 local function version()
 	local api, hash = app.version()
 	return string.format("%03x", api) .. hash:sub(1, 7)
@@ -2,7 +2,7 @@ local image = require "soluna.image"
 local file = require "soluna.file"
 local datalist = require "soluna.datalist"
 
-global type, tonumber, error, assert, ipairs, print
+global type, tonumber, error, assert, ipairs, print, rawget
 
 local M = {}
 
@@ -92,7 +92,43 @@ local function crop(item, filecache)
 	end
 end
 
-function M.load(filecache, filename)
+-- decode the images not in filecache yet on threads, before cropping
+local function preload(filecache, items, threads)
+	local names = {}
+	local contents = {}
+	local alpha = {}
+	for _, item in ipairs(items) do
+		local filename = item.filename
+		if not names[filename] and rawget(filecache, filename) == nil and not filecache.__missing[filename] then
+			local content = file.load(filename)
+			if content then
+				local n = #contents + 1
+				names[filename] = n
+				names[n] = filename
+				contents[n] = content
+				alpha[n] = filename:find "%.alpha%." ~= nil
+			else
+				-- loadimage reports it
+				names[filename] = true
+			end
+		end
+	end
+	if #contents == 0 then
+		return
+	end
+	local r = image.load_batch(contents, alpha, threads)
+	for i, c in ipairs(r) do
+		local filename = names[i]
+		if type(c) == "table" then
+			filecache[filename] = c
+		else
+			filecache.__missing[filename] = true
+			print("Invalid image : " .. filename .. "(" .. c .. ")")
+		end
+	end
+end
+
+function M.load(filecache, filename, threads)
 	local path = filename:match "(.*[/\\])[^/\\]+$"
 	local v = load_bundle(filename)
 	for idx, item in ipairs(v) do
@@ -100,6 +136,11 @@ function M.load(filecache, filename)
 		if path then
 			item.filename = path .. fname
 		end
+	end
+	if threads and threads > 1 then
+		preload(filecache, v, threads)
+	end
+	for _, item in ipairs(v) do
 		crop(item, filecache)
 	end
 	return v
@@ -13,6 +13,7 @@ int luaopen_render(lua_State *L);
 int luaopen_spritemgr(lua_State *L);
 int luaopen_datalist(lua_State *L);
 int luaopen_soluna_file(lua_State *L);
+int luaopen_soluna_atlas(lua_State *L);
 int luaopen_font_truetype(lua_State *L);
 int luaopen_font_manager(lua_State *L);
 int luaopen_font(lua_State *L);
@@ -21,6 +22,9 @@ int luaopen_material_default(lua_State *L);
 int luaopen_material_text(lua_State *L);
 int luaopen_material_quad(lua_State *L);
 int luaopen_material_mask(lua_State *L);
+int luaopen_material_tilemap(lua_State *L);
+int luaopen_material_particle(lua_State *L);
+int luaopen_material_mesh(lua_State *L);
 int luaopen_soluna_app(lua_State *L);
 int luaopen_font_system(lua_State *L);
 int luaopen_gamepad_device(lua_State *L);
@@ -31,6 +35,7 @@ int luaopen_image_sdf(lua_State *L);
 int luaopen_layout_yoga(lua_State *L);
 int luaopen_url(lua_State *L);
 int luaopen_skynet_crypt(lua_State *L);
+int luaopen_soluna_stats(lua_State *L);
 
 void soluna_embed(lua_State* L) {
     static const luaL_Reg modules[] = {
@@ -49,8 +54,12 @@ void soluna_embed(lua_State* L) {
 		{ "soluna.material.text", luaopen_material_text },
 		{ "soluna.material.quad", luaopen_material_quad },
 		{ "soluna.material.mask", luaopen_material_mask },
+		{ "soluna.material.tilemap", luaopen_material_tilemap },
+		{ "soluna.material.particle", luaopen_material_particle },
+		{ "soluna.material.mesh", luaopen_material_mesh },
 		{ "soluna.datalist", luaopen_datalist },
 		{ "soluna.file", luaopen_soluna_file },
+		{ "soluna.atlas", luaopen_soluna_atlas },
 		{ "soluna.font", luaopen_font },
 		{ "soluna.font.truetype", luaopen_font_truetype },
 		{ "soluna.font.manager", luaopen_font_manager },
@@ -63,6 +72,7 @@ void soluna_embed(lua_State* L) {
 		{ "soluna.layout.yoga", luaopen_layout_yoga },
 		{ "soluna.url", luaopen_url },
 		{ "soluna.crypt", luaopen_skynet_crypt },
+		{ "soluna.stats", luaopen_soluna_stats },
 //		{ "luaforward", luaopen_luaforward },
 		{ NULL, NULL },
     };
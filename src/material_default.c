@@ -6,12 +6,17 @@
 #include "sokol/sokol_gfx.h"
 #include "texquad.glsl.h"
 #include "srbuffer.h"
+#include "staging.h"
 #include "batch.h"
 #include "spritemgr.h"
 #include "material_util.h"
+#include "stats.h"
 #include "render_bindings.h"
+#include "sprite_submit.h"
+#include "material_vtable.h"
+#include "jobpool.h"
 
-#define BATCHN 4096
+#define PARALLEL_MIN 4096	// at least instances per job for parallel encode
 
 struct inst_object {
 	float x, y;
@@ -19,25 +24,69 @@ struct inst_object {
 	uint32_t offset;
 	uint32_t u;
 	uint32_t v;
+	uint32_t page;	// layer of the atlas texture array
 };
 
-struct buffer_data {
-	struct inst_object inst[BATCHN];
+// instance sr mode : scale and rotation in instance data, bypass srbuffer
+struct inst_sr_object {
+	float x, y;
+	float scale, rot;
+	uint32_t offset;
+	uint32_t u;
+	uint32_t v;
+	uint32_t page;	// layer of the atlas texture array
 };
 
 struct material_default {
 	sg_pipeline pip;
-	sg_buffer inst;
+	sg_pipeline pip_sr;
+	int sr_mode;
+	struct staging *staging;
+	int lane;
 	struct soluna_render_bindings *bind;
 	vs_params_t *uniform;
 	struct sr_buffer *srbuffer;
 	struct sprite_bank *bank;
+	struct jobpool *pool;	// NULL : encode in the calling thread
+	struct sr_shard shard[JOBPOOL_MAX];
 };
 
+// everything but sr_index
+static inline void
+encode_inst(struct inst_object *inst, struct draw_primitive *p, struct sprite_rect *rect) {
+	inst->x = (float)p->x / 256.0f;
+	inst->y = (float)p->y / 256.0f;
+	
+	int index = p->sprite - 1;
+	assert(index >= 0);
+	struct sprite_rect *r = &rect[index];
+	inst->offset = r->off;
+	inst->u = r->u;
+	inst->v = r->v;
+	inst->page = sprite_page(r->texid);
+}
+
+static inline void
+encode_inst_sr(struct inst_sr_object *inst, struct draw_primitive *p, struct sprite_rect *rect) {
+	inst->x = (float)p->x / 256.0f;
+	inst->y = (float)p->y / 256.0f;
+	sprite_sr_decode(p->sr, &inst->scale, &inst->rot);
+	
+	int index = p->sprite - 1;
+	assert(index >= 0);
+	struct sprite_rect *r = &rect[index];
+	inst->offset = r->off;
+	inst->u = r->u;
+	inst->v = r->v;
+	inst->page = sprite_page(r->texid);
+}
+
 static void
 submit(lua_State *L, struct material_default *m, struct draw_primitive *prim, int n) {
 	struct sprite_rect *rect = m->bank->rect;
-	struct buffer_data tmp;
+	struct inst_object *out = (struct inst_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
 	int i;
 	for (i=0;i<n;i++) {
 		struct draw_primitive *p = &prim[i];
@@ -45,21 +94,126 @@ submit(lua_State *L, struct material_default *m, struct draw_primitive *prim, in
 		// calc scale/rot index
 		int sr_index = srbuffer_add(m->srbuffer, p->sr);
 		if (sr_index < 0) {
-			// todo: support multiply srbuffer
-			luaL_error(L, "sr buffer is full");
+			luaL_error(L, "sr buffer : Out of memory");
 		}
-		tmp.inst[i].x = (float)p->x / 256.0f;
-		tmp.inst[i].y = (float)p->y / 256.0f;
-		tmp.inst[i].sr_index = (float)sr_index;
-		
-		int index = p->sprite - 1;
-		assert(index >= 0);
-		struct sprite_rect *r = &rect[index];
-		tmp.inst[i].offset = r->off;
-		tmp.inst[i].u = r->u;
-		tmp.inst[i].v = r->v;
+		encode_inst(&out[i], p, rect);
+		out[i].sr_index = (float)sr_index;
+	}
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+static void
+submit_sr(lua_State *L, struct material_default *m, struct draw_primitive *prim, int n) {
+	struct sprite_rect *rect = m->bank->rect;
+	struct inst_sr_object *out = (struct inst_sr_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
+	int i;
+	for (i=0;i<n;i++) {
+		encode_inst_sr(&out[i], &prim[i], rect);
 	}
-	sg_append_buffer(m->inst, &(sg_range) { tmp.inst , n * sizeof(tmp.inst[0]) });
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+struct encode_job {
+	struct material_default *m;
+	struct draw_primitive *prim;
+	void *out;
+	int n;
+	int jobs;
+};
+
+static inline void
+job_range(struct encode_job *job, int index, int *from, int *to) {
+	*from = (int)((int64_t)job->n * index / job->jobs);
+	*to = (int)((int64_t)job->n * (index + 1) / job->jobs);
+}
+
+// runs in worker threads, sr keys go to the shard of the job (local index in sr_index)
+static void
+encode_job(void *ud, int index) {
+	struct encode_job *job = (struct encode_job *)ud;
+	struct material_default *m = job->m;
+	struct sprite_rect *rect = m->bank->rect;
+	int from, to, i;
+	job_range(job, index, &from, &to);
+	if (m->sr_mode) {
+		struct inst_sr_object *out = (struct inst_sr_object *)job->out;
+		for (i=from;i<to;i++) {
+			encode_inst_sr(&out[i], &job->prim[i], rect);
+		}
+	} else {
+		struct inst_object *out = (struct inst_object *)job->out;
+		struct sr_shard *shard = &m->shard[index];
+		for (i=from;i<to;i++) {
+			struct draw_primitive *p = &job->prim[i];
+			encode_inst(&out[i], p, rect);
+			out[i].sr_index = (float)srshard_add(shard, p->sr);
+		}
+	}
+}
+
+// local index -> srbuffer index, after the shards are merged
+static void
+remap_job(void *ud, int index) {
+	struct encode_job *job = (struct encode_job *)ud;
+	struct inst_object *out = (struct inst_object *)job->out;
+	const int *remap = job->m->shard[index].remap;
+	int from, to, i;
+	job_range(job, index, &from, &to);
+	for (i=from;i<to;i++) {
+		out[i].sr_index = (float)remap[(int)out[i].sr_index];
+	}
+}
+
+// returns 0 if the draw element is too small to split
+static int
+submit_parallel(lua_State *L, struct material_default *m, struct draw_primitive *prim, int n) {
+	if (m->pool == NULL)
+		return 0;
+	int jobs = n / PARALLEL_MIN;
+	int threads = jobpool_threads(m->pool);
+	if (jobs > threads)
+		jobs = threads;
+	if (jobs <= 1)
+		return 0;
+	size_t stride = m->sr_mode ? sizeof(struct inst_sr_object) : sizeof(struct inst_object);
+	void *out = staging_reserve(m->staging, m->lane, n * stride);
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
+	struct encode_job job = { m, prim, out, n, jobs };
+	int i;
+	if (!m->sr_mode) {
+		for (i=0;i<jobs;i++) {
+			if (!srshard_reserve(&m->shard[i], n / jobs + 1))
+				luaL_error(L, "sr shard : Out of memory");
+		}
+	}
+	jobpool_run(m->pool, encode_job, &job, jobs);
+	if (!m->sr_mode) {
+		// merge in job order, srbuffer gets the same keys in the same order as a serial submit
+		for (i=0;i<jobs;i++) {
+			if (!srshard_merge(&m->shard[i], m->srbuffer))
+				luaL_error(L, "sr buffer : Out of memory");
+		}
+		jobpool_run(m->pool, remap_job, &job, jobs);
+	}
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * stride);
+	return 1;
+}
+
+static void
+material_default_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_default *m = (struct material_default *)m_;
+	if (submit_parallel(L, m, prim, prim_n))
+		return;
+	if (m->sr_mode)
+		submit_sr(L, m, prim, prim_n);
+	else
+		submit(L, m, prim, prim_n);
 }
 
 static int
@@ -67,37 +221,41 @@ lmaterial_default_submit(lua_State *L) {
 	struct material_default *m = (struct material_default *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_DEFAULT");
 	struct draw_primitive *prim = lua_touserdata(L, 2);
 	int prim_n = luaL_checkinteger(L, 3);
-	int i;
-	for (i=0;i<prim_n;i+=BATCHN) {
-		int n = (prim_n - i) % BATCHN;
-		submit(L, m, prim, n);
-		prim += BATCHN;
-	}
+	material_default_submit(L, m, prim, prim_n);
 	return 0;
 }
 
-static inline int
-lmaterial_default_draw_(lua_State *L, int ex) {
-	struct material_default *m = (struct material_default *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_DEFAULT");
-//	struct draw_primitive *prim = lua_touserdata(L, 2);
-	int prim_n = luaL_checkinteger(L, 3);
-//	int tex_id = luaL_checkinteger(L, 4);
+static void
+material_default_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_default *m = (struct material_default *)m_;
+	if (texture)
+		m->bind->bindings.views[1] = *texture;
 
-	sg_apply_pipeline(m->pip);
+	sg_apply_pipeline(m->sr_mode ? m->pip_sr : m->pip);
 	sg_apply_uniforms(UB_vs_params, &(sg_range){ m->uniform, sizeof(vs_params_t) });
 	
 	if (ex) {
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw_ex(0, 4, prim_n, 0, m->bind->base);
 	} else {
-		size_t base = m->bind->base * sizeof(struct inst_object);
+		size_t stride = m->sr_mode ? sizeof(struct inst_sr_object) : sizeof(struct inst_object);
+		size_t base = m->bind->base * stride;
 		m->bind->bindings.vertex_buffer_offsets[0] += base;
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw(0, 4, prim_n);
 		m->bind->bindings.vertex_buffer_offsets[0] -= base;
 	}
 	m->bind->base += prim_n;
+	stats_add(STATS_DRAW_CALL, 1);
+}
 
+static inline int
+lmaterial_default_draw_(lua_State *L, int ex) {
+	struct material_default *m = (struct material_default *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_DEFAULT");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+//	int tex_id = luaL_checkinteger(L, 4);
+	material_default_draw(m, prim, prim_n, NULL, ex);
 	return 0;
 }
 
@@ -126,6 +284,7 @@ init_pipeline(struct material_default *p) {
 					[ATTR_texquad_offset].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_texquad_u].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_texquad_v].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_texquad_page].format = SG_VERTEXFORMAT_UINT,
 				}
         },
 		.colors[0].blend = (sg_blend_state) {
@@ -142,14 +301,66 @@ init_pipeline(struct material_default *p) {
   if (sg_query_pipeline_state(p->pip) != SG_RESOURCESTATE_VALID) {
     fprintf(stderr, "failed to create pipeline for default material\n");
   }
+
+	sg_shader shd_sr = sg_make_shader(texquad_sr_shader_desc(sg_query_backend()));
+	p->pip_sr = sg_make_pipeline(&(sg_pipeline_desc) {
+		.layout = {
+			.buffers[0].step_func = SG_VERTEXSTEP_PER_INSTANCE,
+			.attrs = {
+					[ATTR_texquad_sr_position].format = SG_VERTEXFORMAT_FLOAT4,
+					[ATTR_texquad_sr_offset].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_texquad_sr_u].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_texquad_sr_v].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_texquad_sr_page].format = SG_VERTEXFORMAT_UINT,
+				}
+        },
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+        .shader = shd_sr,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+        .label = "default-sr-pipeline"
+    });
+  if (sg_query_pipeline_state(p->pip_sr) != SG_RESOURCESTATE_VALID) {
+    fprintf(stderr, "failed to create instance sr pipeline for default material\n");
+  }
+}
+
+static int
+lmaterial_default_sr_mode(lua_State *L) {
+	struct material_default *m = (struct material_default *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_DEFAULT");
+	static const char * mode[] = { "lut", "instance", NULL };
+	m->sr_mode = luaL_checkoption(L, 2, NULL, mode);
+	return 0;
+}
+
+static int
+lmaterial_default_release(lua_State *L) {
+	struct material_default *m = (struct material_default *)lua_touserdata(L, 1);
+	int i;
+	for (i=0;i<JOBPOOL_MAX;i++) {
+		srshard_release(&m->shard[i]);
+	}
+	return 0;
 }
 
 static int
 lnew_material_default(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
-	struct material_default *m = (struct material_default *)lua_newuserdatauv(L, sizeof(*m), 4);
+	struct material_default *m = (struct material_default *)lua_newuserdatauv(L, sizeof(*m), 5);
 	init_pipeline(m);
-	ref_object(L, &m->inst, 1, "inst_buffer", "SOKOL_BUFFER", 0);
+	m->sr_mode = 0;
+	m->pool = NULL;
+	int i;
+	for (i=0;i<JOBPOOL_MAX;i++) {
+		srshard_init(&m->shard[i]);
+	}
+	ref_object(L, &m->staging, 1, "staging", "SOLUNA_STAGING", 1);
+	m->lane = ref_lane(L, "lane");
 	ref_object(L, &m->bind, 2, "bindings", "SOKOL_BINDINGS", 1);
 	ref_object(L, &m->uniform, 3, "uniform", "SOKOL_UNIFORM", 1);
 	ref_object(L, &m->srbuffer, 4, "sr_buffer", "SOLUNA_SRBUFFER", 1);
@@ -158,15 +369,30 @@ lnew_material_default(lua_State *L) {
 	}
 	m->bank = lua_touserdata(L, -1);
 	lua_pop(L, 1);
+	// optional job pool for parallel encode
+	if (lua_getfield(L, 1, "jobpool") == LUA_TUSERDATA) {
+		struct jobpool **pool = (struct jobpool **)luaL_checkudata(L, -1, "SOLUNA_JOBPOOL");
+		m->pool = *pool;
+		lua_setiuservalue(L, -2, 5);
+	} else {
+		lua_pop(L, 1);
+	}
 	
 	if (luaL_newmetatable(L, "SOLUNA_MATERIAL_DEFAULT")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
+			{ "__gc", lmaterial_default_release },
 			{ "submit", lmaterial_default_submit },
 			{ "draw", DRAWFUNC(lmaterial_default_draw) },
+			{ "sr_mode", lmaterial_default_sr_mode },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_default_submit,
+			material_default_draw,
+		};
+		material_set_vtable(L, &vt);
 
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
@@ -181,11 +407,14 @@ luaopen_material_default(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "new", lnew_material_default },
 		{ "instance_size", NULL },
+		{ "instance_sr_size", NULL },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
 	
 	lua_pushinteger(L, sizeof(struct inst_object));
 	lua_setfield(L, -2, "instance_size");
+	lua_pushinteger(L, sizeof(struct inst_sr_object));
+	lua_setfield(L, -2, "instance_sr_size");
 	return 1;
 }
@@ -6,12 +6,14 @@
 #include "sokol/sokol_gfx.h"
 #include "maskquad.glsl.h"
 #include "srbuffer.h"
+#include "staging.h"
 #include "batch.h"
 #include "spritemgr.h"
 #include "material_util.h"
+#include "stats.h"
 #include "render_bindings.h"
-
-#define BATCHN 4096
+#include "sprite_submit.h"
+#include "material_vtable.h"
 
 struct color {
 	unsigned char channel[4];
@@ -24,6 +26,18 @@ struct inst_object {
 	uint32_t offset;
 	uint32_t u;
 	uint32_t v;
+	uint32_t page;	// layer of the atlas texture array
+};
+
+// instance sr mode : scale and rotation in instance data, bypass srbuffer
+struct inst_sr_object {
+	float x, y;
+	float scale, rot;
+	struct color maskcolor;
+	uint32_t offset;
+	uint32_t u;
+	uint32_t v;
+	uint32_t page;	// layer of the atlas texture array
 };
 
 struct mask {
@@ -31,13 +45,12 @@ struct mask {
 	struct color c;
 };
 
-struct buffer_data {
-	struct inst_object inst[BATCHN];
-};
-
 struct material_mask {
 	sg_pipeline pip;
-	sg_buffer inst;
+	sg_pipeline pip_sr;
+	int sr_mode;
+	struct staging *staging;
+	int lane;
 	struct soluna_render_bindings *bind;
 	vs_params_t *uniform;
 	struct sr_buffer *srbuffer;
@@ -47,7 +60,9 @@ struct material_mask {
 static void
 submit(lua_State *L, struct material_mask *m, struct draw_primitive *prim, int n) {
 	struct sprite_rect *rect = m->bank->rect;
-	struct buffer_data tmp;
+	struct inst_object *out = (struct inst_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
 	int i;
 	for (i=0;i<n;i++) {
 		struct draw_primitive *p = &prim[i*2];
@@ -58,22 +73,62 @@ submit(lua_State *L, struct material_mask *m, struct draw_primitive *prim, int n
 		// calc scale/rot index
 		int sr_index = srbuffer_add(m->srbuffer, p->sr);
 		if (sr_index < 0) {
-			// todo: support multiply srbuffer
-			luaL_error(L, "sr buffer is full");
+			luaL_error(L, "sr buffer : Out of memory");
 		}
-		tmp.inst[i].x = (float)p->x / 256.0f;
-		tmp.inst[i].y = (float)p->y / 256.0f;
-		tmp.inst[i].sr_index = (float)sr_index;
-		tmp.inst[i].maskcolor = mask->c;
+		out[i].x = (float)p->x / 256.0f;
+		out[i].y = (float)p->y / 256.0f;
+		out[i].sr_index = (float)sr_index;
+		out[i].maskcolor = mask->c;
 		
 		int index = mask->header.sprite;
 		assert(index >= 0);
 		struct sprite_rect *r = &rect[index];
-		tmp.inst[i].offset = r->off;
-		tmp.inst[i].u = r->u;
-		tmp.inst[i].v = r->v;
+		out[i].offset = r->off;
+		out[i].u = r->u;
+		out[i].v = r->v;
+		out[i].page = sprite_page(r->texid);
 	}
-	sg_append_buffer(m->inst, &(sg_range) { tmp.inst , n * sizeof(tmp.inst[0]) });
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+static void
+submit_sr(lua_State *L, struct material_mask *m, struct draw_primitive *prim, int n) {
+	struct sprite_rect *rect = m->bank->rect;
+	struct inst_sr_object *out = (struct inst_sr_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
+	int i;
+	for (i=0;i<n;i++) {
+		struct draw_primitive *p = &prim[i*2];
+		assert(p->sprite == -MATERIAL_MASK);
+		
+		struct mask * mask = (struct mask *)&prim[i*2+1];
+		struct inst_sr_object *inst = &out[i];
+		inst->x = (float)p->x / 256.0f;
+		inst->y = (float)p->y / 256.0f;
+		sprite_sr_decode(p->sr, &inst->scale, &inst->rot);
+		inst->maskcolor = mask->c;
+		
+		int index = mask->header.sprite;
+		assert(index >= 0);
+		struct sprite_rect *r = &rect[index];
+		inst->offset = r->off;
+		inst->u = r->u;
+		inst->v = r->v;
+		inst->page = sprite_page(r->texid);
+	}
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+static void
+material_mask_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_mask *m = (struct material_mask *)m_;
+	if (m->sr_mode)
+		submit_sr(L, m, prim, prim_n);
+	else
+		submit(L, m, prim, prim_n);
 }
 
 static int
@@ -81,30 +136,25 @@ lmaterial_mask_submit(lua_State *L) {
 	struct material_mask *m = (struct material_mask *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MASK");
 	struct draw_primitive *prim = lua_touserdata(L, 2);
 	int prim_n = luaL_checkinteger(L, 3);
-	int i;
-	for (i=0;i<prim_n;i+=BATCHN) {
-		int n = (prim_n - i) % BATCHN;
-		submit(L, m, prim, n);
-		prim += BATCHN;
-	}
+	material_mask_submit(L, m, prim, prim_n);
 	return 0;
 }
 
-static inline int
-lmaterial_mask_draw_(lua_State *L, int ex) {
-	struct material_mask *m = (struct material_mask *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MASK");
-//	struct draw_primitive *prim = lua_touserdata(L, 2);
-	int prim_n = luaL_checkinteger(L, 3);
-//	int tex_id = luaL_checkinteger(L, 4);
+static void
+material_mask_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_mask *m = (struct material_mask *)m_;
+	if (texture)
+		m->bind->bindings.views[1] = *texture;
 
-	sg_apply_pipeline(m->pip);
+	sg_apply_pipeline(m->sr_mode ? m->pip_sr : m->pip);
 	sg_apply_uniforms(UB_vs_params, &(sg_range){ m->uniform, sizeof(vs_params_t) });
 	
 	if (ex) {
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw_ex(0, 4, prim_n, 0, m->bind->base);
 	} else {
-		size_t base = m->bind->base * sizeof(struct inst_object);
+		size_t stride = m->sr_mode ? sizeof(struct inst_sr_object) : sizeof(struct inst_object);
+		size_t base = m->bind->base * stride;
 		m->bind->bindings.vertex_buffer_offsets[0] += base;
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw(0, 4, prim_n);
@@ -112,7 +162,16 @@ lmaterial_mask_draw_(lua_State *L, int ex) {
 	}
 
 	m->bind->base += prim_n;
+	stats_add(STATS_DRAW_CALL, 1);
+}
 
+static inline int
+lmaterial_mask_draw_(lua_State *L, int ex) {
+	struct material_mask *m = (struct material_mask *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MASK");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+//	int tex_id = luaL_checkinteger(L, 4);
+	material_mask_draw(m, prim, prim_n, NULL, ex);
 	return 0;
 }
 
@@ -142,6 +201,7 @@ init_pipeline(struct material_mask *p) {
 					[ATTR_maskquad_offset].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_maskquad_u].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_maskquad_v].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_maskquad_page].format = SG_VERTEXFORMAT_UINT,
 				}
         },
 		.colors[0].blend = (sg_blend_state) {
@@ -158,6 +218,42 @@ init_pipeline(struct material_mask *p) {
   if (sg_query_pipeline_state(p->pip) != SG_RESOURCESTATE_VALID) {
     fprintf(stderr, "Failed to create pipeline for mask material!\n");
   }
+
+	sg_shader shd_sr = sg_make_shader(maskquad_sr_shader_desc(sg_query_backend()));
+	p->pip_sr = sg_make_pipeline(&(sg_pipeline_desc) {
+		.layout = {
+			.buffers[0].step_func = SG_VERTEXSTEP_PER_INSTANCE,
+			.attrs = {
+					[ATTR_maskquad_sr_position].format = SG_VERTEXFORMAT_FLOAT4,
+					[ATTR_maskquad_sr_color].format = SG_VERTEXFORMAT_UBYTE4N,
+					[ATTR_maskquad_sr_offset].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_maskquad_sr_u].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_maskquad_sr_v].format = SG_VERTEXFORMAT_UINT,
+					[ATTR_maskquad_sr_page].format = SG_VERTEXFORMAT_UINT,
+				}
+        },
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+        .shader = shd_sr,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+        .label = "mask-sr-pipeline"
+    });
+  if (sg_query_pipeline_state(p->pip_sr) != SG_RESOURCESTATE_VALID) {
+    fprintf(stderr, "Failed to create instance sr pipeline for mask material!\n");
+  }
+}
+
+static int
+lmaterial_mask_sr_mode(lua_State *L) {
+	struct material_mask *m = (struct material_mask *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MASK");
+	static const char * mode[] = { "lut", "instance", NULL };
+	m->sr_mode = luaL_checkoption(L, 2, NULL, mode);
+	return 0;
 }
 
 static int
@@ -165,7 +261,9 @@ lnew_material_mask(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	struct material_mask *m = (struct material_mask *)lua_newuserdatauv(L, sizeof(*m), 4);
 	init_pipeline(m);
-	ref_object(L, &m->inst, 1, "inst_buffer", "SOKOL_BUFFER", 0);
+	m->sr_mode = 0;
+	ref_object(L, &m->staging, 1, "staging", "SOLUNA_STAGING", 1);
+	m->lane = ref_lane(L, "lane");
 	ref_object(L, &m->bind, 2, "bindings", "SOKOL_BINDINGS", 1);
 	ref_object(L, &m->uniform, 3, "uniform", "SOKOL_UNIFORM", 1);
 	ref_object(L, &m->srbuffer, 4, "sr_buffer", "SOLUNA_SRBUFFER", 1);
@@ -180,9 +278,15 @@ lnew_material_mask(lua_State *L) {
 			{ "__index", NULL },
 			{ "submit", lmaterial_mask_submit },
 			{ "draw", DRAWFUNC(lmaterial_mask_draw) },
+			{ "sr_mode", lmaterial_mask_sr_mode },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_mask_submit,
+			material_mask_draw,
+		};
+		material_set_vtable(L, &vt);
 
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
@@ -225,11 +329,14 @@ luaopen_material_mask(lua_State *L) {
 		{ "mask", lmask },
 		{ "new", lnew_material_mask },
 		{ "instance_size", NULL },
+		{ "instance_sr_size", NULL },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
 	
 	lua_pushinteger(L, sizeof(struct inst_object));
 	lua_setfield(L, -2, "instance_size");
+	lua_pushinteger(L, sizeof(struct inst_sr_object));
+	lua_setfield(L, -2, "instance_sr_size");
 	return 1;
 }
@@ -0,0 +1,461 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "sokol/sokol_gfx.h"
+#include "mesh.glsl.h"
+#include "staging.h"
+#include "batch.h"
+#include "spritemgr.h"
+#include "material_util.h"
+#include "stats.h"
+#include "render_bindings.h"
+#include "sprite_submit.h"
+#include "material_vtable.h"
+#include "snapshot.h"
+
+#define MESH_MAXVERTEX 0x10000
+#define MESH_SHAPE_MAX 0x10000
+
+struct color {
+	unsigned char channel[4];
+};
+
+struct mesh_vertex {
+	float x, y;
+	float u, v;	// 0-1 in the sprite rect
+	struct color c;
+};
+
+// Vertices and indices read by the render service, immutable (see snapshot.h)
+struct shape_snapshot {
+	struct snapshot head;
+	int vertex_n;
+	int index_n;
+	struct mesh_vertex *vertex;
+	uint16_t *index;
+	// vertex_n * struct mesh_vertex, index_n * uint16_t follow
+};
+
+// userdata SOLUNA_MESH_SHAPE, shape:vertex() changes its own vertices (copy on write),
+// shape:primitive() publishes them when they are changed
+struct mesh_shape {
+	uint32_t serial;
+	int slot;
+	int dirty;
+	int vertex_n;
+	int index_n;
+	struct mesh_vertex *vertex;
+	uint16_t *index;
+	// vertex_n * struct mesh_vertex, index_n * uint16_t follow
+};
+
+struct mesh {
+	struct draw_primitive_external header;	// sprite id (base 0) for texture
+	uint32_t slot;
+	uint32_t serial;
+	int index_n;	// never changes, draw() counts the indices without the snapshot
+};
+
+static struct snapshot_slot g_shape[MESH_SHAPE_MAX];
+static atomic_int g_shape_next;
+
+// vertex in the vertex lane
+struct out_vertex {
+	float x, y;
+	float u, v, page;	// page : layer of the atlas texture array
+	struct color c;
+};
+
+struct material_mesh {
+	sg_pipeline pip;
+	struct staging *staging;
+	int lane;	// vertices
+	int index_lane;
+	struct soluna_render_bindings *bind;
+	vs_params_t *uniform;
+	struct sprite_bank *bank;
+};
+
+// release it after use, NULL if the shape is collected
+static inline struct shape_snapshot *
+acquire_shape(struct mesh *t) {
+	return (struct shape_snapshot *)snapshot_acquire(g_shape, MESH_SHAPE_MAX, t->slot, t->serial);
+}
+
+// transform the vertices on cpu, indices are rebased to the vertex lane of this frame
+static void
+material_mesh_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_mesh *m = (struct material_mesh *)m_;
+	struct sprite_rect *rect = m->bank->rect;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		struct draw_primitive *p = &prim[i*2];
+		assert(p->sprite == -MATERIAL_MESH);
+		struct mesh *mesh = (struct mesh *)&prim[i*2+1];
+		struct shape_snapshot *shape = acquire_shape(mesh);
+		int in = mesh->index_n;
+		int vn = shape ? shape->vertex_n : 1;
+		uint32_t base = (uint32_t)(m->staging->lane[m->lane].n / sizeof(struct out_vertex));
+		struct out_vertex *out = (struct out_vertex *)staging_reserve(m->staging, m->lane, vn * sizeof(*out));
+		uint32_t *index = (uint32_t *)staging_reserve(m->staging, m->index_lane, in * sizeof(*index));
+		if (out == NULL || index == NULL) {
+			snapshot_release(shape ? &shape->head : NULL);
+			luaL_error(L, "staging : Out of memory");
+		}
+		int j;
+		if (shape == NULL) {
+			// the shape is collected, keep the index count of draw() with degenerate triangles
+			memset(out, 0, sizeof(*out));
+			for (j=0;j<in;j++) {
+				index[j] = base;
+			}
+			staging_commit(m->staging, m->lane, sizeof(*out));
+			staging_commit(m->staging, m->index_lane, in * sizeof(*index));
+			continue;
+		}
+		float x = (float)p->x / 256.0f;
+		float y = (float)p->y / 256.0f;
+		float scale, rot;
+		sprite_sr_decode(p->sr, &scale, &rot);
+		float cs = cosf(rot) * scale;
+		float sn = sinf(rot) * scale;
+		struct sprite_rect *r = &rect[mesh->header.sprite];
+		float u0 = (float)(r->u >> 16);
+		float v0 = (float)(r->v >> 16);
+		float uw = (float)(r->u & 0xffff);
+		float vh = (float)(r->v & 0xffff);
+		float page = (float)sprite_page(r->texid);
+		for (j=0;j<vn;j++) {
+			const struct mesh_vertex *v = &shape->vertex[j];
+			out[j].x = v->x * cs - v->y * sn + x;
+			out[j].y = v->x * sn + v->y * cs + y;
+			out[j].u = u0 + v->u * uw;
+			out[j].v = v0 + v->v * vh;
+			out[j].page = page;
+			out[j].c = v->c;
+		}
+		for (j=0;j<in;j++) {
+			index[j] = base + shape->index[j];
+		}
+		snapshot_release(&shape->head);
+		staging_commit(m->staging, m->lane, vn * sizeof(*out));
+		staging_commit(m->staging, m->index_lane, in * sizeof(*index));
+		stats_add(STATS_INSTANCE, vn);
+	}
+}
+
+static int
+lmaterial_mesh_submit(lua_State *L) {
+	struct material_mesh *m = (struct material_mesh *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MESH");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	material_mesh_submit(L, m, prim, prim_n);
+	return 0;
+}
+
+// the meshes of a draw element share the texture, draw them in one indexed draw
+static void
+material_mesh_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_mesh *m = (struct material_mesh *)m_;
+	(void)ex;
+	int count = 0;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		count += ((struct mesh *)&prim[i*2+1])->index_n;
+	}
+	if (count == 0 || texture == NULL) {
+		m->bind->base += count;
+		return;
+	}
+	sg_apply_pipeline(m->pip);
+	sg_apply_uniforms(UB_vs_params, &(sg_range){ m->uniform, sizeof(vs_params_t) });
+	m->bind->bindings.views[0] = *texture;
+	sg_apply_bindings(&m->bind->bindings);
+	sg_draw(m->bind->base, count, 1);
+	m->bind->base += count;
+	stats_add(STATS_DRAW_CALL, 1);
+}
+
+static int
+lmaterial_mesh_draw(lua_State *L) {
+	struct material_mesh *m = (struct material_mesh *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_MESH");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	const sg_view *texture = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		struct soluna_render_view *v = (struct soluna_render_view *)luaL_checkudata(L, 4, "SOKOL_VIEW");
+		texture = &v->view;
+	}
+	material_mesh_draw(m, prim, prim_n, texture, 0);
+	return 0;
+}
+
+static void
+init_pipeline(struct material_mesh *m) {
+	sg_shader shd = sg_make_shader(mesh_shader_desc(sg_query_backend()));
+	if (sg_query_shader_state(shd) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "Failed to create shader for mesh material!\n");
+	}
+
+	m->pip = sg_make_pipeline(&(sg_pipeline_desc) {
+		.layout = {
+			.attrs = {
+				[ATTR_mesh_position].format = SG_VERTEXFORMAT_FLOAT2,
+				[ATTR_mesh_texcoord].format = SG_VERTEXFORMAT_FLOAT3,
+				[ATTR_mesh_color].format = SG_VERTEXFORMAT_UBYTE4N,
+			}
+		},
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+		.shader = shd,
+		.index_type = SG_INDEXTYPE_UINT32,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLES,
+		.label = "mesh-pipeline"
+	});
+	if (sg_query_pipeline_state(m->pip) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "failed to create pipeline for mesh\n");
+	}
+}
+
+static int
+lnew_material_mesh(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	struct material_mesh *m = (struct material_mesh *)lua_newuserdatauv(L, sizeof(*m), 3);
+	ref_object(L, &m->staging, 1, "staging", "SOLUNA_STAGING", 1);
+	m->lane = ref_lane(L, "lane");
+	m->index_lane = ref_lane(L, "index_lane");
+	ref_object(L, &m->bind, 2, "bindings", "SOKOL_BINDINGS", 1);
+	ref_object(L, &m->uniform, 3, "uniform", "SOKOL_UNIFORM", 1);
+	if (lua_getfield(L, 1, "sprite_bank") != LUA_TLIGHTUSERDATA) {
+		return luaL_error(L, "Missing .sprite_bank");
+	}
+	m->bank = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	init_pipeline(m);
+
+	if (luaL_newmetatable(L, "SOLUNA_MATERIAL_MESH")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "submit", lmaterial_mesh_submit },
+			{ "draw", lmaterial_mesh_draw },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_mesh_submit,
+			material_mesh_draw,
+		};
+		material_set_vtable(L, &vt);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static inline struct mesh_shape *
+check_shape(lua_State *L) {
+	return (struct mesh_shape *)luaL_checkudata(L, 1, "SOLUNA_MESH_SHAPE");
+}
+
+static void
+set_vertex(lua_State *L, struct mesh_vertex *v, int index) {
+	v->x = (float)luaL_checknumber(L, index);
+	v->y = (float)luaL_checknumber(L, index + 1);
+	v->u = (float)luaL_optnumber(L, index + 2, 0);
+	v->v = (float)luaL_optnumber(L, index + 3, 0);
+	uint32_t color = luaL_optinteger(L, index + 4, 0xffffffff);
+	if (!(color & 0xff000000))
+		color |= 0xff000000;
+	v->c.channel[0] = (color >> 16) & 0xff;
+	v->c.channel[1] = (color >> 8) & 0xff;
+	v->c.channel[2] = color & 0xff;
+	v->c.channel[3] = (color >> 24) & 0xff;
+}
+
+// shape:vertex(i, x, y [, u, v, color]) ; i is base 0, for deformation
+static int
+lshape_vertex(lua_State *L) {
+	struct mesh_shape *shape = check_shape(L);
+	int i = luaL_checkinteger(L, 2);
+	if (i < 0 || i >= shape->vertex_n)
+		return luaL_error(L, "Invalid vertex %d", i);
+	struct mesh_vertex *v = &shape->vertex[i];
+	if (lua_gettop(L) <= 2) {
+		lua_pushnumber(L, v->x);
+		lua_pushnumber(L, v->y);
+		lua_pushnumber(L, v->u);
+		lua_pushnumber(L, v->v);
+		return 4;
+	}
+	// the published snapshot is not changed, the next primitive() publishes a new one
+	shape->dirty = 1;
+	if (lua_isnoneornil(L, 5)) {
+		// keep uv and color
+		v->x = (float)luaL_checknumber(L, 3);
+		v->y = (float)luaL_checknumber(L, 4);
+	} else {
+		set_vertex(L, v, 3);
+	}
+	return 0;
+}
+
+struct mesh_primitive {
+	struct draw_primitive pos;
+	union {
+		struct draw_primitive dummy;
+		struct mesh m;
+	} u;
+};
+
+static int
+publish_shape(struct mesh_shape *shape) {
+	size_t vsz = shape->vertex_n * sizeof(struct mesh_vertex);
+	size_t isz = shape->index_n * sizeof(uint16_t);
+	struct shape_snapshot *snap = (struct shape_snapshot *)snapshot_new(sizeof(*snap) + vsz + isz);
+	if (snap == NULL)
+		return 0;
+	snap->vertex_n = shape->vertex_n;
+	snap->index_n = shape->index_n;
+	snap->vertex = (struct mesh_vertex *)(snap + 1);
+	snap->index = (uint16_t *)(snap->vertex + shape->vertex_n);
+	memcpy(snap->vertex, shape->vertex, vsz);
+	memcpy(snap->index, shape->index, isz);
+	snapshot_publish(&g_shape[shape->slot], &snap->head);
+	shape->dirty = 0;
+	return 1;
+}
+
+// shape:primitive(sprite) for batch:add(), uv of the vertices are in the rect of the sprite.
+// The shape is drawn as it is at the last primitive() call
+static int
+lshape_primitive(lua_State *L) {
+	struct mesh_shape *shape = check_shape(L);
+	int sprite = luaL_checkinteger(L, 2);
+	if (sprite <= 0)
+		return luaL_error(L, "Invalid sprite id %d", sprite);
+	if (shape->slot < 0)
+		return luaL_error(L, "Mesh shape is released");
+	if (shape->dirty && !publish_shape(shape))
+		return luaL_error(L, "mesh : Out of memory");
+	struct mesh_primitive prim;
+	memset(&prim, 0, sizeof(prim));
+	prim.pos.sprite = -MATERIAL_MESH;
+	prim.u.m.header.sprite = sprite - 1;
+	prim.u.m.slot = shape->slot;
+	prim.u.m.serial = shape->serial;
+	prim.u.m.index_n = shape->index_n;
+	lua_pushlstring(L, (const char *)&prim, sizeof(prim));
+	return 1;
+}
+
+static int
+lshape_release(lua_State *L) {
+	struct mesh_shape *shape = (struct mesh_shape *)lua_touserdata(L, 1);
+	if (shape->slot >= 0) {
+		snapshot_slot_free(&g_shape[shape->slot]);
+		shape->slot = -1;
+	}
+	return 0;
+}
+
+static int
+lshape_size(lua_State *L) {
+	struct mesh_shape *shape = check_shape(L);
+	lua_pushinteger(L, shape->vertex_n);
+	lua_pushinteger(L, shape->index_n / 3);
+	return 2;
+}
+
+// mesh.shape({ x, y, u, v, color, ... }, { i1, i2, i3, ... }) ; 5 numbers per vertex, indices are base 0
+static int
+lshape(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_Integer fields = luaL_len(L, 1);
+	lua_Integer in = luaL_len(L, 2);
+	if (fields % 5 != 0)
+		return luaL_error(L, "Vertices need 5 numbers each (x, y, u, v, color)");
+	lua_Integer vn = fields / 5;
+	if (vn <= 0 || vn > MESH_MAXVERTEX)
+		return luaL_error(L, "Invalid vertex number %d", (int)vn);
+	if (in <= 0 || in % 3 != 0)
+		return luaL_error(L, "Invalid index number %d", (int)in);
+	size_t sz = sizeof(struct mesh_shape) + vn * sizeof(struct mesh_vertex) + in * sizeof(uint16_t);
+	struct mesh_shape *shape = (struct mesh_shape *)lua_newuserdatauv(L, sz, 0);
+	shape->serial = 0;
+	shape->slot = -1;
+	shape->dirty = 1;
+	shape->vertex_n = (int)vn;
+	shape->index_n = (int)in;
+	shape->vertex = (struct mesh_vertex *)(shape + 1);
+	shape->index = (uint16_t *)(shape->vertex + vn);
+	int i, j;
+	for (i=0;i<vn;i++) {
+		for (j=0;j<5;j++) {
+			lua_geti(L, 1, i * 5 + j + 1);
+		}
+		set_vertex(L, &shape->vertex[i], -5);
+		lua_pop(L, 5);
+	}
+	for (i=0;i<in;i++) {
+		lua_geti(L, 2, i + 1);
+		lua_Integer index = luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+		if (index < 0 || index >= vn)
+			return luaL_error(L, "Invalid index %d", (int)index);
+		shape->index[i] = (uint16_t)index;
+	}
+	if (luaL_newmetatable(L, "SOLUNA_MESH_SHAPE")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", lshape_release },
+			{ "vertex", lshape_vertex },
+			{ "size", lshape_size },
+			{ "primitive", lshape_primitive },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	static atomic_uint g_serial;
+	uint32_t serial;
+	do {
+		serial = atomic_fetch_add(&g_serial, 1) + 1;
+	} while (serial == 0);
+	shape->serial = serial;
+	shape->slot = snapshot_slot_alloc(g_shape, MESH_SHAPE_MAX, &g_shape_next, serial);
+	if (shape->slot < 0)
+		return luaL_error(L, "Too many mesh shapes (%d)", MESH_SHAPE_MAX);
+	return 1;
+}
+
+int
+luaopen_material_mesh(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "shape", lshape },
+		{ "new", lnew_material_mesh },
+		{ "vertex_size", NULL },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+
+	lua_pushinteger(L, sizeof(struct out_vertex));
+	lua_setfield(L, -2, "vertex_size");
+
+	return 1;
+}
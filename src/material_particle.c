@@ -0,0 +1,352 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "sokol/sokol_gfx.h"
+#include "particle.glsl.h"
+#include "batch.h"
+#include "spritemgr.h"
+#include "material_util.h"
+#include "stats.h"
+#include "render_bindings.h"
+#include "sprite_submit.h"
+#include "material_vtable.h"
+
+#define PARTICLE_EMITTER 1024
+#define PARTICLE_MAX 0xffff
+
+// Emitter parameters are shared by all the services : created in the service which adds the
+// primitives, read by the render service. They are immutable after particle.emitter() returns.
+// A collected emitter's slot may be reused while queued batches or recorded segments still refer to it,
+// so the primitive carries the generation of the slot, and draw() skips the stale ones.
+struct particle_emitter {
+	float lifetime;
+	float speed[2];
+	float angle[2];	// radian
+	float gravity[2];
+	float scale[2];	// at birth, at death
+	float spin;	// max rotation speed, radian per second
+	int loop;
+};
+
+static struct particle_emitter g_emitter[PARTICLE_EMITTER];
+static atomic_int g_emitter_used[PARTICLE_EMITTER];
+static atomic_uint g_emitter_gen[PARTICLE_EMITTER];	// odd while the parameters are written
+static atomic_int g_emitter_next;	// slots are reused round robin, as late as possible
+
+// payload slot in the batch stream
+struct particle {
+	struct draw_primitive_external header;	// sprite id (base 0)
+	float age;	// seconds since the emitter started
+	uint16_t emitter;
+	uint16_t seed;
+	uint16_t count;
+	uint16_t gen;	// generation of the emitter slot
+};
+
+// layout of the render service's uniform (framesize, tex_size)
+struct frame_uniform {
+	float framesize[2];
+	float tex_size;
+};
+
+struct material_particle {
+	sg_pipeline pip;
+	struct soluna_render_bindings *bind;
+	struct frame_uniform *uniform;
+	struct sprite_bank *bank;
+};
+
+// Nothing to encode, the particles are computed in the vertex shader
+static void
+material_particle_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	(void)L;
+	(void)m_;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		assert(prim[i*2].sprite == -MATERIAL_PARTICLE);
+		struct particle *p = (struct particle *)&prim[i*2+1];
+		stats_add(STATS_PARTICLE, p->count);
+	}
+}
+
+static int
+lmaterial_particle_submit(lua_State *L) {
+	struct material_particle *m = (struct material_particle *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_PARTICLE");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	material_particle_submit(L, m, prim, prim_n);
+	return 0;
+}
+
+// copy the parameters of the emitter, returns 0 if the slot is reused by another emitter
+static int
+read_emitter(int id, uint16_t gen, struct particle_emitter *e) {
+	unsigned g = atomic_load_explicit(&g_emitter_gen[id], memory_order_acquire);
+	if ((g & 1) || (uint16_t)g != gen)
+		return 0;
+	*e = g_emitter[id];
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&g_emitter_gen[id], memory_order_relaxed) == g;
+}
+
+// one draw call per emitter
+static void
+material_particle_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_particle *m = (struct material_particle *)m_;
+	if (prim_n <= 0 || texture == NULL)
+		return;
+	(void)ex;
+	sg_apply_pipeline(m->pip);
+	m->bind->bindings.views[1] = *texture;
+	sg_apply_bindings(&m->bind->bindings);
+	struct sprite_bank *bank = m->bank;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		struct draw_primitive *pos = &prim[i*2];
+		struct particle *p = (struct particle *)&prim[i*2+1];
+		if (p->count == 0 || p->header.sprite < 0 || p->header.sprite >= bank->n)
+			continue;
+		struct particle_emitter e_;
+		if (!read_emitter(p->emitter, p->gen, &e_))
+			continue;
+		const struct particle_emitter *e = &e_;
+		struct sprite_rect *r = &bank->rect[p->header.sprite];
+		float scale, rot;
+		sprite_sr_decode(pos->sr, &scale, &rot);
+		float cs = cosf(rot) * scale;
+		float sn = sinf(rot) * scale;
+		vs_params_t u = {
+			.frame = { m->uniform->framesize[0], m->uniform->framesize[1], m->uniform->tex_size, p->age },
+			.origin = { (float)pos->x / 256.0f, (float)pos->y / 256.0f, e->lifetime, (float)p->seed },
+			.velocity = { e->speed[0], e->speed[1], e->angle[0], e->angle[1] },
+			.force = { e->gravity[0], e->gravity[1], e->scale[0], e->scale[1] },
+			.sr = { cs, -sn, sn, cs },
+			.misc = { e->spin, (float)p->count, (float)e->loop, 0 },
+			.rect = { (int)r->off, (int)r->u, (int)r->v, sprite_page(r->texid) },
+		};
+		sg_apply_uniforms(UB_vs_params, &(sg_range){ &u, sizeof(u) });
+		sg_draw(0, 4, p->count);
+		stats_add(STATS_DRAW_CALL, 1);
+	}
+}
+
+static int
+lmaterial_particle_draw(lua_State *L) {
+	struct material_particle *m = (struct material_particle *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_PARTICLE");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	const sg_view *texture = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		struct soluna_render_view *v = (struct soluna_render_view *)luaL_checkudata(L, 4, "SOKOL_VIEW");
+		texture = &v->view;
+	}
+	material_particle_draw(m, prim, prim_n, texture, 0);
+	return 0;
+}
+
+static void
+init_pipeline(struct material_particle *m) {
+	sg_shader shd = sg_make_shader(particle_shader_desc(sg_query_backend()));
+	if (sg_query_shader_state(shd) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "Failed to create shader for particle material!\n");
+	}
+
+	m->pip = sg_make_pipeline(&(sg_pipeline_desc) {
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+		.shader = shd,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+		.label = "particle-pipeline"
+	});
+	if (sg_query_pipeline_state(m->pip) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "failed to create pipeline for particle\n");
+	}
+}
+
+static int
+lnew_material_particle(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	struct material_particle *m = (struct material_particle *)lua_newuserdatauv(L, sizeof(*m), 2);
+	ref_object(L, &m->bind, 1, "bindings", "SOKOL_BINDINGS", 1);
+	ref_object(L, &m->uniform, 2, "uniform", "SOKOL_UNIFORM", 1);
+	if (lua_getfield(L, 1, "sprite_bank") != LUA_TLIGHTUSERDATA) {
+		return luaL_error(L, "Missing .sprite_bank");
+	}
+	m->bank = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	init_pipeline(m);
+
+	if (luaL_newmetatable(L, "SOLUNA_MATERIAL_PARTICLE")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "submit", lmaterial_particle_submit },
+			{ "draw", lmaterial_particle_draw },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_particle_submit,
+			material_particle_draw,
+		};
+		material_set_vtable(L, &vt);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+struct particle_primitive {
+	struct draw_primitive pos;
+	union {
+		struct draw_primitive dummy;
+		struct particle p;
+	} u;
+};
+
+static inline int
+check_emitter(lua_State *L) {
+	int *id = (int *)luaL_checkudata(L, 1, "SOLUNA_PARTICLE_EMITTER");
+	return *id;
+}
+
+// emitter:primitive(sprite, count, age [, seed]) for batch:add() ; age is in seconds
+static int
+lemitter_primitive(lua_State *L) {
+	int id = check_emitter(L);
+	if (id < 0)
+		return luaL_error(L, "Emitter is released");
+	int sprite = luaL_checkinteger(L, 2);
+	int count = luaL_checkinteger(L, 3);
+	float age = (float)luaL_checknumber(L, 4);
+	int seed = luaL_optinteger(L, 5, 0);
+	if (sprite <= 0)
+		return luaL_error(L, "Invalid sprite id %d", sprite);
+	if (count < 0 || count > PARTICLE_MAX)
+		return luaL_error(L, "Invalid particle count %d", count);
+	struct particle_primitive prim;
+	memset(&prim, 0, sizeof(prim));
+	prim.pos.sprite = -MATERIAL_PARTICLE;
+	prim.u.p.header.sprite = sprite - 1;
+	prim.u.p.age = age;
+	prim.u.p.emitter = (uint16_t)id;
+	prim.u.p.seed = (uint16_t)seed;
+	prim.u.p.count = (uint16_t)count;
+	prim.u.p.gen = (uint16_t)atomic_load_explicit(&g_emitter_gen[id], memory_order_relaxed);
+	lua_pushlstring(L, (const char *)&prim, sizeof(prim));
+	return 1;
+}
+
+static int
+lemitter_release(lua_State *L) {
+	int *id = (int *)lua_touserdata(L, 1);
+	if (*id >= 0) {
+		atomic_store(&g_emitter_used[*id], 0);
+		*id = -1;
+	}
+	return 0;
+}
+
+static void
+get_range(lua_State *L, const char *key, float v[2], float def, float unit) {
+	int t = lua_getfield(L, 1, key);
+	if (t == LUA_TNIL) {
+		v[0] = v[1] = def;
+	} else if (t == LUA_TNUMBER) {
+		v[0] = v[1] = (float)lua_tonumber(L, -1) * unit;
+	} else if (t == LUA_TTABLE) {
+		lua_geti(L, -1, 1);
+		lua_geti(L, -2, 2);
+		v[0] = (float)luaL_checknumber(L, -2) * unit;
+		v[1] = (float)luaL_checknumber(L, -1) * unit;
+		lua_pop(L, 2);
+	} else {
+		luaL_error(L, "Invalid .%s", key);
+	}
+	lua_pop(L, 1);
+}
+
+static float
+get_number(lua_State *L, const char *key, float def) {
+	float v = def;
+	if (lua_getfield(L, 1, key) != LUA_TNIL)
+		v = (float)luaL_checknumber(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+// particle.emitter { lifetime = 1, speed = { min, max }, angle = { min, max } (degree),
+//	gravity = { x, y }, scale = { from, to }, spin = degree per second, loop = true }
+static int
+lemitter(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	const float degree = 3.1415927f / 180.0f;
+	struct particle_emitter e;
+	e.lifetime = get_number(L, "lifetime", 1.0f);
+	if (e.lifetime <= 0)
+		return luaL_error(L, "Invalid lifetime %f", e.lifetime);
+	get_range(L, "speed", e.speed, 0, 1.0f);
+	get_range(L, "angle", e.angle, 0, degree);
+	get_range(L, "gravity", e.gravity, 0, 1.0f);
+	get_range(L, "scale", e.scale, 1.0f, 1.0f);
+	e.spin = get_number(L, "spin", 0) * degree;
+	lua_getfield(L, 1, "loop");
+	e.loop = lua_isnil(L, -1) ? 1 : lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	int *id = (int *)lua_newuserdatauv(L, sizeof(int), 0);
+	*id = -1;
+	if (luaL_newmetatable(L, "SOLUNA_PARTICLE_EMITTER")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", lemitter_release },
+			{ "primitive", lemitter_primitive },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	int start = atomic_fetch_add(&g_emitter_next, 1);
+	int i;
+	for (i=0;i<PARTICLE_EMITTER;i++) {
+		int slot = (unsigned)(start + i) % PARTICLE_EMITTER;
+		int expected = 0;
+		if (atomic_compare_exchange_strong(&g_emitter_used[slot], &expected, 1)) {
+			atomic_store(&g_emitter_next, slot + 1);
+			// the generation is odd while writing, so the render service never reads half written parameters
+			atomic_fetch_add_explicit(&g_emitter_gen[slot], 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_release);
+			g_emitter[slot] = e;
+			atomic_fetch_add_explicit(&g_emitter_gen[slot], 1, memory_order_release);
+			*id = slot;
+			return 1;
+		}
+	}
+	return luaL_error(L, "Too many particle emitters (%d)", PARTICLE_EMITTER);
+}
+
+int
+luaopen_material_particle(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "emitter", lemitter },
+		{ "new", lnew_material_particle },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
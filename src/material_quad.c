@@ -6,12 +6,14 @@
 #include "sokol/sokol_gfx.h"
 #include "colorquad.glsl.h"
 #include "srbuffer.h"
+#include "staging.h"
 #include "batch.h"
 #include "spritemgr.h"
 #include "material_util.h"
+#include "stats.h"
 #include "render_bindings.h"
-
-#define BATCHN 4096
+#include "sprite_submit.h"
+#include "material_vtable.h"
 
 struct color {
 	unsigned char channel[4];
@@ -31,13 +33,20 @@ struct inst_object {
 	struct color c;
 };
 
-struct buffer_data {
-	struct inst_object inst[BATCHN];
+// instance sr mode : scale and rotation in instance data, bypass srbuffer
+struct inst_sr_object {
+	float x, y;
+	float w, h;
+	float scale, rot;
+	struct color c;
 };
 
 struct material_quad {
 	sg_pipeline pip;
-	sg_buffer inst;
+	sg_pipeline pip_sr;
+	int sr_mode;
+	struct staging *staging;
+	int lane;
 	struct soluna_render_bindings *bind;
 	vs_params_t *uniform;
 	struct sr_buffer *srbuffer;
@@ -45,7 +54,9 @@ struct material_quad {
 
 static void
 submit(lua_State *L, struct material_quad *m, struct draw_primitive *prim, int n) {
-	struct buffer_data tmp;
+	struct inst_object *out = (struct inst_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
 	int i;
 	for (i=0;i<n;i++) {
 		struct draw_primitive *p = &prim[i*2];
@@ -56,10 +67,9 @@ submit(lua_State *L, struct material_quad *m, struct draw_primitive *prim, int n
 		// calc scale/rot index
 		int sr_index = srbuffer_add(m->srbuffer, p->sr);
 		if (sr_index < 0) {
-			// todo: support multiply srbuffer
-			luaL_error(L, "sr buffer is full");
+			luaL_error(L, "sr buffer : Out of memory");
 		}
-		struct inst_object *inst = &tmp.inst[i];
+		struct inst_object *inst = &out[i];
 		inst->x = (float)p->x / 256.0f;
 		inst->y = (float)p->y / 256.0f;
 		inst->w = q->w;
@@ -67,7 +77,40 @@ submit(lua_State *L, struct material_quad *m, struct draw_primitive *prim, int n
 		inst->sr_index = sr_index;
 		inst->c = q->c;
 	}
-	sg_append_buffer(m->inst, &(sg_range) { tmp.inst , n * sizeof(tmp.inst[0]) });
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+static void
+submit_sr(lua_State *L, struct material_quad *m, struct draw_primitive *prim, int n) {
+	struct inst_sr_object *out = (struct inst_sr_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
+	int i;
+	for (i=0;i<n;i++) {
+		struct draw_primitive *p = &prim[i*2];
+		assert(p->sprite == -MATERIAL_QUAD);
+		
+		struct quad * q = (struct quad *)&prim[i*2+1];
+		struct inst_sr_object *inst = &out[i];
+		inst->x = (float)p->x / 256.0f;
+		inst->y = (float)p->y / 256.0f;
+		inst->w = q->w;
+		inst->h = q->h;
+		sprite_sr_decode(p->sr, &inst->scale, &inst->rot);
+		inst->c = q->c;
+	}
+	stats_add(STATS_INSTANCE, n);
+	staging_commit(m->staging, m->lane, n * sizeof(out[0]));
+}
+
+static void
+material_quad_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_quad *m = (struct material_quad *)m_;
+	if (m->sr_mode)
+		submit_sr(L, m, prim, prim_n);
+	else
+		submit(L, m, prim, prim_n);
 }
 
 static int
@@ -75,30 +118,24 @@ lmateraial_quad_submit(lua_State *L) {
 	struct material_quad *m = (struct material_quad *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_QUAD");
 	struct draw_primitive *prim = lua_touserdata(L, 2);
 	int prim_n = luaL_checkinteger(L, 3);
-	int i;
-	for (i=0;i<prim_n;i+=BATCHN) {
-		int n = (prim_n - i) % BATCHN;
-		submit(L, m, prim, n);
-		prim += BATCHN;
-	}
+	material_quad_submit(L, m, prim, prim_n);
 	return 0;
 }
 
-static inline int
-lmateraial_quad_draw_(lua_State *L, int ex) {
-	struct material_quad *m = (struct material_quad *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_QUAD");
-//	struct draw_primitive *prim = lua_touserdata(L, 2);
-	int prim_n = luaL_checkinteger(L, 3);
+static void
+material_quad_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_quad *m = (struct material_quad *)m_;
 	if (prim_n <= 0)
-		return 0;
+		return;
 	
-	sg_apply_pipeline(m->pip);
+	sg_apply_pipeline(m->sr_mode ? m->pip_sr : m->pip);
 	sg_apply_uniforms(UB_vs_params, &(sg_range){ m->uniform, sizeof(vs_params_t) });
 	if (ex) {
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw_ex(0, 4, prim_n, 0, m->bind->base);
 	} else {
-		size_t base = m->bind->base * sizeof(struct inst_object);
+		size_t stride = m->sr_mode ? sizeof(struct inst_sr_object) : sizeof(struct inst_object);
+		size_t base = m->bind->base * stride;
 		m->bind->bindings.vertex_buffer_offsets[0] += base;
 		sg_apply_bindings(&m->bind->bindings);
 		sg_draw(0, 4, prim_n);
@@ -106,7 +143,15 @@ lmateraial_quad_draw_(lua_State *L, int ex) {
 	}
 
 	m->bind->base += prim_n;
+	stats_add(STATS_DRAW_CALL, 1);
+}
 
+static inline int
+lmateraial_quad_draw_(lua_State *L, int ex) {
+	struct material_quad *m = (struct material_quad *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_QUAD");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	material_quad_draw(m, prim, prim_n, NULL, ex);
 	return 0;
 }
 
@@ -149,27 +194,68 @@ init_pipeline(struct material_quad *m) {
     });
   if (sg_query_pipeline_state(m->pip) != SG_RESOURCESTATE_VALID) {
     fprintf(stderr, "failed to create pipeline for colorquad\n");
+  }
+
+	sg_shader shd_sr = sg_make_shader(colorquad_sr_shader_desc(sg_query_backend()));
+	m->pip_sr = sg_make_pipeline(&(sg_pipeline_desc) {
+		.layout = {
+			.buffers[0].step_func = SG_VERTEXSTEP_PER_INSTANCE,
+			.attrs = {
+					[ATTR_colorquad_sr_position].format = SG_VERTEXFORMAT_FLOAT4,
+					[ATTR_colorquad_sr_sr].format = SG_VERTEXFORMAT_FLOAT2,
+					[ATTR_colorquad_sr_c].format = SG_VERTEXFORMAT_UBYTE4N,
+				}
+        },
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+        .shader = shd_sr,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+        .label = "colorquad-sr-pipeline"
+    });
+  if (sg_query_pipeline_state(m->pip_sr) != SG_RESOURCESTATE_VALID) {
+    fprintf(stderr, "failed to create instance sr pipeline for colorquad\n");
   }
 }
 
+static int
+lmateraial_quad_sr_mode(lua_State *L) {
+	struct material_quad *m = (struct material_quad *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_QUAD");
+	static const char * mode[] = { "lut", "instance", NULL };
+	m->sr_mode = luaL_checkoption(L, 2, NULL, mode);
+	return 0;
+}
+
 static int
 lnew_material_quad(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	struct material_quad *m = (struct material_quad *)lua_newuserdatauv(L, sizeof(*m), 4);
-	ref_object(L, &m->inst, 1, "inst_buffer", "SOKOL_BUFFER", 0);
+	ref_object(L, &m->staging, 1, "staging", "SOLUNA_STAGING", 1);
+	m->lane = ref_lane(L, "lane");
 	ref_object(L, &m->bind, 2, "bindings", "SOKOL_BINDINGS", 1);
 	ref_object(L, &m->uniform, 3, "uniform", "SOKOL_UNIFORM", 1);
 	ref_object(L, &m->srbuffer, 4, "sr_buffer", "SOLUNA_SRBUFFER", 1);
 	init_pipeline(m);
+	m->sr_mode = 0;
 
 	if (luaL_newmetatable(L, "SOLUNA_MATERIAL_QUAD")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
 			{ "submit", lmateraial_quad_submit },
 			{ "draw", DRAWFUNC(lmateraial_quad_draw) },
+			{ "sr_mode", lmateraial_quad_sr_mode },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_quad_submit,
+			material_quad_draw,
+		};
+		material_set_vtable(L, &vt);
 
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
@@ -214,12 +300,15 @@ luaopen_material_quad(lua_State *L) {
 		{ "quad", lquad },
 		{ "new", lnew_material_quad },
 		{ "instance_size", NULL },
+		{ "instance_sr_size", NULL },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
 
 	lua_pushinteger(L, sizeof(struct inst_object));
 	lua_setfield(L, -2, "instance_size");
+	lua_pushinteger(L, sizeof(struct inst_sr_object));
+	lua_setfield(L, -2, "instance_sr_size");
 	
 	return 1;
 }
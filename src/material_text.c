@@ -9,14 +9,15 @@
 #include "sokol/sokol_gfx.h"
 #include "sdftext.glsl.h"
 #include "srbuffer.h"
+#include "staging.h"
 #include "batch.h"
 #include "spritemgr.h"
 #include "font_manager.h"
 #include "sprite_submit.h"
 #include "material_util.h"
+#include "stats.h"
 #include "render_bindings.h"
-
-#define BATCHN 4096
+#include "material_vtable.h"
 
 struct text {
 	struct draw_primitive_external header;
@@ -26,21 +27,23 @@ struct text {
 	uint32_t color;
 };
 
+struct color {
+	unsigned char channel[4];
+};
+
 struct inst_object {
 	float x, y;
 	float sr_index;
+	struct color color;
     uint32_t offset;
     uint32_t u;
     uint32_t v;
 };
 
-struct buffer_data {
-	struct inst_object inst[BATCHN];
-};
-
 struct material_text {
 	sg_pipeline pip;
-	sg_buffer inst;
+	struct staging *staging;
+	int lane;
 	struct soluna_render_bindings *bind;
 	vs_params_t *uniform;
 	struct sr_buffer *srbuffer;
@@ -50,7 +53,9 @@ struct material_text {
 
 static void
 submit(lua_State *L, struct material_text *m, struct draw_primitive *prim, int n) {
-	struct buffer_data tmp;
+	struct inst_object *out = (struct inst_object *)staging_reserve(m->staging, m->lane, n * sizeof(*out));
+	if (out == NULL)
+		luaL_error(L, "staging : Out of memory");
 	int i;
 	int count = 0;
 	for (i=0;i<n;i++) {
@@ -61,27 +66,38 @@ submit(lua_State *L, struct material_text *m, struct draw_primitive *prim, int n
 		struct font_glyph g, og;
 		const char* err = font_manager_glyph(m->font, t->font, t->codepoint, t->size, &g, &og);
 		if (err == NULL) {
-			tmp.inst[count].offset = (-og.offset_x + 0x8000) << 16 | (-og.offset_y + 0x8000);
-			tmp.inst[count].u = og.u << 16 | FONT_MANAGER_GLYPHSIZE;
-			tmp.inst[count].v = og.v << 16 | FONT_MANAGER_GLYPHSIZE;
+			out[count].offset = (-og.offset_x + 0x8000) << 16 | (-og.offset_y + 0x8000);
+			out[count].u = og.u << 16 | FONT_MANAGER_GLYPHSIZE;
+			out[count].v = og.v << 16 | FONT_MANAGER_GLYPHSIZE;
 			
 			uint32_t scale_fix = og.w == 0 ? 0 : (g.w << 12) / og.w;
 			sprite_apply_scale(p, scale_fix);
 			// calc scale/rot index
 			int sr_index = srbuffer_add(m->srbuffer, p->sr);
 			if (sr_index < 0) {
-				// todo: support multiply srbuffer
-				luaL_error(L, "sr buffer is full");
+				luaL_error(L, "sr buffer : Out of memory");
 			}
-			tmp.inst[count].x = (float)p->x / 256.0f;
-			tmp.inst[count].y = (float)p->y / 256.0f;
-			tmp.inst[count].sr_index = (float)sr_index;
+			out[count].x = (float)p->x / 256.0f;
+			out[count].y = (float)p->y / 256.0f;
+			out[count].sr_index = (float)sr_index;
+			uint32_t color = t->color;
+			out[count].color.channel[0] = (color >> 16) & 0xff;
+			out[count].color.channel[1] = (color >> 8) & 0xff;
+			out[count].color.channel[2] = color & 0xff;
+			out[count].color.channel[3] = (color >> 24) & 0xff;
 			++count;
 		} else {
 			t->codepoint = -1;
 		}
 	}
-	sg_append_buffer(m->inst, &(sg_range) { tmp.inst , count * sizeof(tmp.inst[0]) });
+	stats_add(STATS_INSTANCE, count);
+	staging_commit(m->staging, m->lane, count * sizeof(out[0]));
+}
+
+static void
+material_text_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_text *m = (struct material_text *)m_;
+	submit(L, m, prim, prim_n);
 }
 
 static int
@@ -89,18 +105,12 @@ lmateraial_text_submit(lua_State *L) {
 	struct material_text *m = (struct material_text *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_TEXT");
 	struct draw_primitive *prim = lua_touserdata(L, 2);
 	int prim_n = luaL_checkinteger(L, 3);
-	int i;
-	for (i=0;i<prim_n;i+=BATCHN) {
-		int n = (prim_n - i) % BATCHN;
-		submit(L, m, prim, n);
-		prim += BATCHN;
-	}
+	material_text_submit(L, m, prim, prim_n);
 	return 0;
 }
 
 static inline void
-draw_text(struct material_text *m, uint32_t color, int count, int ex) {
-	m->fs_uniform.color = color;
+draw_text(struct material_text *m, int count, int ex) {
 	sg_apply_uniforms(UB_vs_params, &(sg_range){ m->uniform, sizeof(vs_params_t) });
 	sg_apply_uniforms(UB_fs_params, &(sg_range){ &m->fs_uniform, sizeof(fs_params_t) });
 	if (ex) {
@@ -115,42 +125,39 @@ draw_text(struct material_text *m, uint32_t color, int count, int ex) {
 	}
 
 	m->bind->base += count;
+	stats_add(STATS_DRAW_CALL, 1);
 }
 
-static inline int
-lmateraial_text_draw_(lua_State *L, int ex) {
-	struct material_text *m = (struct material_text *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_TEXT");
-	struct draw_primitive *prim = lua_touserdata(L, 2);
-	int prim_n = luaL_checkinteger(L, 3);
+static void
+material_text_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_text *m = (struct material_text *)m_;
 	if (prim_n <= 0)
-		return 0;
+		return;
 	
 	int i;
 	float texsize = m->uniform->texsize;
 	m->uniform->texsize = 1.0f / FONT_MANAGER_TEXSIZE;
 	sg_apply_pipeline(m->pip);
 	
-	int count = -1;
-	uint32_t color = 0;
+	// color is in instance data, one draw for all the glyphs found in submit
+	int count = 0;
 	for (i=0;i<prim_n;i++) {
 		struct text * t = (struct text *)&prim[i*2+1];
-		if (t->codepoint >= 0) {
-			if (count < 0) {
-				color = t->color;
-				count = 1;
-			} else if (t->color != color) {
-				draw_text(m, color, count, ex);
-				color = t->color;
-				count = 1;
-			} else {
-				++count;
-			}
-		}
+		if (t->codepoint >= 0)
+			++count;
 	}
-	draw_text(m, color, count, ex);
+	if (count > 0)
+		draw_text(m, count, ex);
 
 	m->uniform->texsize = texsize;
+}
 
+static inline int
+lmateraial_text_draw_(lua_State *L, int ex) {
+	struct material_text *m = (struct material_text *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_TEXT");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	material_text_draw(m, prim, prim_n, NULL, ex);
 	return 0;
 }
 
@@ -176,6 +183,7 @@ init_pipeline(struct material_text *m) {
 			.buffers[0].step_func = SG_VERTEXSTEP_PER_INSTANCE,
 			.attrs = {
 					[ATTR_texquad_position].format = SG_VERTEXFORMAT_FLOAT3,
+					[ATTR_texquad_color].format = SG_VERTEXFORMAT_UBYTE4N,
 					[ATTR_texquad_offset].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_texquad_u].format = SG_VERTEXFORMAT_UINT,
 					[ATTR_texquad_v].format = SG_VERTEXFORMAT_UINT,
@@ -201,7 +209,8 @@ static int
 lnew_material_text_normal(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	struct material_text *m = (struct material_text *)lua_newuserdatauv(L, sizeof(*m), 4);
-	ref_object(L, &m->inst, 1, "inst_buffer", "SOKOL_BUFFER", 0);
+	ref_object(L, &m->staging, 1, "staging", "SOLUNA_STAGING", 1);
+	m->lane = ref_lane(L, "lane");
 	ref_object(L, &m->bind, 2, "bindings", "SOKOL_BINDINGS", 1);
 	ref_object(L, &m->uniform, 3, "uniform", "SOKOL_UNIFORM", 1);
 	ref_object(L, &m->srbuffer, 4, "sr_buffer", "SOLUNA_SRBUFFER", 1);
@@ -216,7 +225,6 @@ lnew_material_text_normal(lua_State *L) {
   fs_params_t temp = {
       .edge_mask = font_manager_sdf_mask(m->font),
       .dist_multiplier = 1.0f,
-      .color = 0xff000000,
   };
   memcpy(&m->fs_uniform, &temp, sizeof(fs_params_t));
 
@@ -228,6 +236,11 @@ lnew_material_text_normal(lua_State *L) {
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_text_submit,
+			material_text_draw,
+		};
+		material_set_vtable(L, &vt);
 
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
@@ -0,0 +1,707 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "sokol/sokol_gfx.h"
+#include "tilemap.glsl.h"
+#include "batch.h"
+#include "spritemgr.h"
+#include "material_util.h"
+#include "stats.h"
+#include "render_bindings.h"
+#include "sprite_submit.h"
+#include "material_vtable.h"
+#include "snapshot.h"
+
+#define TILEMAP_CACHE 64
+#define TILEMAP_MAXSIZE 4096
+#define TILEMAP_LAYER_MAX 4096
+
+// A tile layer lives in the service which builds the map (userdata SOLUNA_TILEMAP_LAYER),
+// one primitive in the batch draws the whole layer.
+// The render service never reads the layer : layer:primitive() publishes a snapshot of the tiles (see snapshot.h)
+// when they are changed, a collected layer is not drawn.
+struct tile_snapshot {
+	struct snapshot head;
+	uint32_t version;
+	int width;
+	int height;
+	int tile_width;
+	int tile_height;
+	int tileset;	// sprite id (base 0) of a tile, selects the atlas texture ; -1 : empty layer
+	int32_t tile[1];
+};
+
+static struct snapshot_slot g_layer[TILEMAP_LAYER_MAX];
+static atomic_int g_layer_next;
+
+struct tilemap_layer {
+	uint32_t serial;	// unique id, key of the gpu cache
+	uint32_t version;	// bumps on every change
+	int slot;
+	int width;
+	int height;
+	int tile_width;
+	int tile_height;
+	int tileset;	// sprite id (base 0) of a tile, selects the atlas texture ; -1 : empty layer
+	int tileset_n;	// tiles using tileset
+	struct tile_snapshot *published;	// the snapshot in the slot, owned by the slot
+	int32_t tile[1];	// sprite id (base 1), 0 : empty
+};
+
+struct tilemap {
+	struct draw_primitive_external header;
+	uint32_t slot;
+	uint32_t serial;
+};
+
+// layout of the render service's uniform (framesize, tex_size)
+struct frame_uniform {
+	float framesize[2];
+	float tex_size;
+};
+
+struct tile_rect {
+	uint32_t off;
+	uint32_t u;
+	uint32_t v;
+	uint32_t page;	// layer of the atlas texture array
+};
+
+struct layer_cache {
+	uint32_t serial;	// 0 : unused
+	uint32_t version;
+	// the rects resolved are out of date only if a page used is evicted, or a missing tile is placed
+	uint32_t pack_version;
+	uint32_t evict_version;
+	uint64_t page_mask[ATLAS_PAGE_MAX / 64];	// atlas pages used
+	int missing;	// tiles not in the atlas yet when resolved
+	uint16_t frame;	// last frame used
+	int cap;	// tiles
+	// of the snapshot resolved, draw() reads them instead of the layer
+	int width;
+	int height;
+	int tile_width;
+	int tile_height;
+	int empty;
+	sg_buffer buffer;
+	sg_view view;
+};
+
+struct material_tilemap {
+	sg_pipeline pip;
+	struct soluna_render_bindings *bind;
+	struct frame_uniform *uniform;
+	struct sprite_bank *bank;
+	struct tile_rect *tmp;
+	int tmp_cap;
+	struct layer_cache cache[TILEMAP_CACHE];
+};
+
+static inline void
+release_snapshot(struct tile_snapshot *snap) {
+	snapshot_release(snap ? &snap->head : NULL);
+}
+
+// the current snapshot of the layer, NULL if the layer is collected. release it after use
+static inline struct tile_snapshot *
+acquire_snapshot(struct draw_primitive *payload) {
+	struct tilemap *t = (struct tilemap *)payload;
+	return (struct tile_snapshot *)snapshot_acquire(g_layer, TILEMAP_LAYER_MAX, t->slot, t->serial);
+}
+
+static inline uint32_t
+get_serial(struct draw_primitive *payload) {
+	return ((struct tilemap *)payload)->serial;
+}
+
+static struct layer_cache *
+find_cache(struct material_tilemap *m, uint32_t serial) {
+	int i;
+	for (i=0;i<TILEMAP_CACHE;i++) {
+		if (m->cache[i].serial == serial)
+			return &m->cache[i];
+	}
+	return NULL;
+}
+
+static void
+release_cache(struct layer_cache *c) {
+	if (c->cap > 0) {
+		sg_destroy_view(c->view);
+		sg_destroy_buffer(c->buffer);
+	}
+	memset(c, 0, sizeof(*c));
+}
+
+// an unused slot, or the least recently used one (not used in this frame). NULL if all are used in this frame
+static struct layer_cache *
+alloc_cache(struct material_tilemap *m) {
+	uint16_t current = m->bank->current_frame;
+	struct layer_cache *lru = NULL;
+	int i;
+	for (i=0;i<TILEMAP_CACHE;i++) {
+		struct layer_cache *c = &m->cache[i];
+		if (c->serial == 0)
+			return c;
+		if (c->frame != current && (lru == NULL || (uint16_t)(current - c->frame) > (uint16_t)(current - lru->frame)))
+			lru = c;
+	}
+	if (lru)
+		release_cache(lru);
+	return lru;
+}
+
+static int
+count_missing(struct sprite_bank *bank, struct tile_snapshot *layer) {
+	int n = layer->width * layer->height;
+	int missing = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		int sprite = layer->tile[i] - 1;
+		if (sprite >= 0 && sprite < bank->n && bank->rect[sprite].texid >= PENDING_TEXTUREID)
+			++missing;
+	}
+	return missing;
+}
+
+// the rects resolved are out of date : a page used by the layer is evicted, or a missing tile is placed
+static int
+layer_stale(struct sprite_bank *bank, struct layer_cache *c, struct tile_snapshot *layer) {
+	if (c->evict_version != bank->evict_version) {
+		int i;
+		for (i=0;i<ATLAS_PAGE_MAX;i++) {
+			if ((c->page_mask[i / 64] >> (i % 64) & 1) && (int32_t)(bank->page_evict[i] - c->evict_version) > 0)
+				return 1;
+		}
+		c->evict_version = bank->evict_version;
+	}
+	if (c->pack_version != bank->pack_version) {
+		c->pack_version = bank->pack_version;
+		// no page used is evicted, so the missing tiles can only decrease
+		if (c->missing > 0 && count_missing(bank, layer) < c->missing)
+			return 1;
+	}
+	return 0;
+}
+
+// returns -1 if out of memory
+static int
+resolve_layer(struct material_tilemap *m, struct layer_cache *c, struct tile_snapshot *layer) {
+	int n = layer->width * layer->height;
+	if (n > m->tmp_cap) {
+		struct tile_rect *tmp = (struct tile_rect *)realloc(m->tmp, n * sizeof(*tmp));
+		if (tmp == NULL)
+			return -1;
+		m->tmp = tmp;
+		m->tmp_cap = n;
+	}
+	struct sprite_bank *bank = m->bank;
+	struct tile_rect *out = m->tmp;
+	c->pack_version = bank->pack_version;
+	c->evict_version = bank->evict_version;
+	memset(c->page_mask, 0, sizeof(c->page_mask));
+	c->missing = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		int sprite = layer->tile[i] - 1;
+		if (sprite < 0 || sprite >= bank->n || bank->rect[sprite].texid >= PENDING_TEXTUREID) {
+			// empty, or not in the atlas yet
+			if (sprite >= 0 && sprite < bank->n)
+				++c->missing;
+			out[i].off = 0x80008000;
+			out[i].u = 0;
+			out[i].v = 0;
+			out[i].page = 0;
+		} else {
+			struct sprite_rect *r = &bank->rect[sprite];
+			out[i].off = r->off;
+			out[i].u = r->u;
+			out[i].v = r->v;
+			out[i].page = sprite_page(r->texid);
+			if (r->texid < ATLAS_PAGE_MAX)
+				c->page_mask[r->texid / 64] |= (uint64_t)1 << (r->texid % 64);
+		}
+	}
+	if (n > c->cap) {
+		if (c->cap > 0) {
+			sg_destroy_view(c->view);
+			sg_destroy_buffer(c->buffer);
+		}
+		c->buffer = sg_make_buffer(&(sg_buffer_desc) {
+			.size = n * sizeof(struct tile_rect),
+			.usage = {
+				.storage_buffer = true,
+				.dynamic_update = true,
+			},
+			.label = "tilemap-layer",
+		});
+		c->view = sg_make_view(&(sg_view_desc) {
+			.storage_buffer.buffer = c->buffer,
+			.label = "tilemap-layer",
+		});
+		c->cap = n;
+	}
+	sg_update_buffer(c->buffer, &(sg_range) { out, n * sizeof(struct tile_rect) });
+	stats_add(STATS_TILE_UPLOAD, n);
+	return 0;
+}
+
+// rows of the layer inside the viewport, only without rotation
+static void
+visible_rows(struct material_tilemap *m, int height, int tile_height, float y, float scale, float rot, int *from, int *to) {
+	*from = 0;
+	*to = height;
+	if (rot != 0)
+		return;
+	float row_h = tile_height * scale;
+	if (row_h <= 0)
+		return;
+	float view_h = -2.0f / m->uniform->framesize[1];
+	// one row margin for sprites larger than the tile
+	int r0 = (int)floorf((0 - y) / row_h) - 1;
+	int r1 = (int)ceilf((view_h - y) / row_h) + 1;
+	if (r0 > *from)
+		*from = r0;
+	if (r1 < *to)
+		*to = r1;
+}
+
+// stamp the tiles in the visible rows for the atlas residency, the ones not in the atlas are packed again
+static void
+touch_rows(struct sprite_bank *bank, struct tile_snapshot *layer, int from, int to) {
+	int i;
+	int n = to * layer->width;
+	for (i = from * layer->width; i < n; i++) {
+		int sprite = layer->tile[i] - 1;
+		if (sprite >= 0 && sprite < bank->n)
+			sprite_touch(bank, sprite);
+	}
+}
+
+// upload the layers changed since the last frame (or repacked in the atlas)
+static void
+material_tilemap_submit(lua_State *L, void *m_, struct draw_primitive *prim, int prim_n) {
+	struct material_tilemap *m = (struct material_tilemap *)m_;
+	struct sprite_bank *bank = m->bank;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		struct draw_primitive *p = &prim[i*2];
+		assert(p->sprite == -MATERIAL_TILEMAP);
+		uint32_t serial = get_serial(&prim[i*2+1]);
+		struct tile_snapshot *layer = acquire_snapshot(&prim[i*2+1]);
+		if (layer == NULL)
+			continue;
+		struct layer_cache *c = find_cache(m, serial);
+		if (layer->tileset < 0) {
+			if (c)
+				c->empty = 1;
+			release_snapshot(layer);
+			continue;
+		}
+		float scale, rot;
+		sprite_sr_decode(p->sr, &scale, &rot);
+		int from, to;
+		visible_rows(m, layer->height, layer->tile_height, (float)p->y / 256.0f, scale, rot, &from, &to);
+		if (from < to)
+			touch_rows(bank, layer, from, to);
+		if (c == NULL) {
+			c = alloc_cache(m);
+			if (c == NULL) {
+				release_snapshot(layer);
+				luaL_error(L, "Too many tilemap layers in a frame (%d)", TILEMAP_CACHE);
+			}
+			c->serial = serial;
+		} else if (c->version == layer->version && !layer_stale(bank, c, layer)) {
+			c->frame = bank->current_frame;
+			c->empty = 0;
+			release_snapshot(layer);
+			continue;
+		}
+		// the snapshot is immutable, its version always matches the tiles resolved
+		if (resolve_layer(m, c, layer) < 0) {
+			release_cache(c);
+			release_snapshot(layer);
+			luaL_error(L, "tilemap : Out of memory");
+		}
+		c->version = layer->version;
+		c->frame = bank->current_frame;
+		c->width = layer->width;
+		c->height = layer->height;
+		c->tile_width = layer->tile_width;
+		c->tile_height = layer->tile_height;
+		c->empty = 0;
+		release_snapshot(layer);
+	}
+}
+
+static int
+lmaterial_tilemap_submit(lua_State *L) {
+	struct material_tilemap *m = (struct material_tilemap *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_TILEMAP");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	material_tilemap_submit(L, m, prim, prim_n);
+	return 0;
+}
+
+static void
+material_tilemap_draw(void *m_, struct draw_primitive *prim, int prim_n, const sg_view *texture, int ex) {
+	struct material_tilemap *m = (struct material_tilemap *)m_;
+	if (prim_n <= 0 || texture == NULL)
+		return;
+	(void)ex;
+	sg_apply_pipeline(m->pip);
+	m->bind->bindings.views[1] = *texture;
+	int i;
+	for (i=0;i<prim_n;i++) {
+		struct draw_primitive *p = &prim[i*2];
+		struct layer_cache *c = find_cache(m, get_serial(&prim[i*2+1]));
+		if (c == NULL || c->cap == 0 || c->empty)
+			continue;
+		vs_params_t u;
+		float x = (float)p->x / 256.0f;
+		float y = (float)p->y / 256.0f;
+		float scale, rot;
+		sprite_sr_decode(p->sr, &scale, &rot);
+		int from, to;
+		visible_rows(m, c->height, c->tile_height, y, scale, rot, &from, &to);
+		if (from >= to)
+			continue;
+		u.frame[0] = m->uniform->framesize[0];
+		u.frame[1] = m->uniform->framesize[1];
+		u.frame[2] = m->uniform->tex_size;
+		u.frame[3] = 0;
+		u.origin[0] = x;
+		u.origin[1] = y;
+		u.origin[2] = (float)c->tile_width;
+		u.origin[3] = (float)c->tile_height;
+		float cs = cosf(rot) * scale;
+		float sn = sinf(rot) * scale;
+		u.sr[0] = cs;
+		u.sr[1] = -sn;
+		u.sr[2] = sn;
+		u.sr[3] = cs;
+		u.layer[0] = c->width;
+		u.layer[1] = from * c->width;
+		u.layer[2] = 0;
+		u.layer[3] = 0;
+		m->bind->bindings.views[0] = c->view;
+		sg_apply_bindings(&m->bind->bindings);
+		sg_apply_uniforms(UB_vs_params, &(sg_range){ &u, sizeof(u) });
+		sg_draw(0, 4, (to - from) * c->width);
+		stats_add(STATS_DRAW_CALL, 1);
+	}
+}
+
+static int
+lmaterial_tilemap_draw(lua_State *L) {
+	struct material_tilemap *m = (struct material_tilemap *)luaL_checkudata(L, 1, "SOLUNA_MATERIAL_TILEMAP");
+	struct draw_primitive *prim = lua_touserdata(L, 2);
+	int prim_n = luaL_checkinteger(L, 3);
+	const sg_view *texture = NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		struct soluna_render_view *v = (struct soluna_render_view *)luaL_checkudata(L, 4, "SOKOL_VIEW");
+		texture = &v->view;
+	}
+	material_tilemap_draw(m, prim, prim_n, texture, 0);
+	return 0;
+}
+
+static void
+init_pipeline(struct material_tilemap *m) {
+	sg_shader shd = sg_make_shader(tilemap_shader_desc(sg_query_backend()));
+	if (sg_query_shader_state(shd) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "Failed to create shader for tilemap material!\n");
+	}
+
+	m->pip = sg_make_pipeline(&(sg_pipeline_desc) {
+		.colors[0].blend = (sg_blend_state) {
+			.enabled = true,
+			.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+			.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+			.src_factor_alpha = SG_BLENDFACTOR_ONE,
+			.dst_factor_alpha = SG_BLENDFACTOR_ZERO
+		},
+		.shader = shd,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+		.label = "tilemap-pipeline"
+	});
+	if (sg_query_pipeline_state(m->pip) != SG_RESOURCESTATE_VALID) {
+		fprintf(stderr, "failed to create pipeline for tilemap\n");
+	}
+}
+
+static int
+lmaterial_tilemap_release(lua_State *L) {
+	struct material_tilemap *m = (struct material_tilemap *)lua_touserdata(L, 1);
+	int i;
+	for (i=0;i<TILEMAP_CACHE;i++) {
+		release_cache(&m->cache[i]);
+	}
+	free(m->tmp);
+	m->tmp = NULL;
+	m->tmp_cap = 0;
+	return 0;
+}
+
+static int
+lnew_material_tilemap(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	struct material_tilemap *m = (struct material_tilemap *)lua_newuserdatauv(L, sizeof(*m), 2);
+	memset(m, 0, sizeof(*m));
+	ref_object(L, &m->bind, 1, "bindings", "SOKOL_BINDINGS", 1);
+	ref_object(L, &m->uniform, 2, "uniform", "SOKOL_UNIFORM", 1);
+	if (lua_getfield(L, 1, "sprite_bank") != LUA_TLIGHTUSERDATA) {
+		return luaL_error(L, "Missing .sprite_bank");
+	}
+	m->bank = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	init_pipeline(m);
+
+	if (luaL_newmetatable(L, "SOLUNA_MATERIAL_TILEMAP")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", lmaterial_tilemap_release },
+			{ "submit", lmaterial_tilemap_submit },
+			{ "draw", lmaterial_tilemap_draw },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		static const struct material_vtable vt = {
+			material_tilemap_submit,
+			material_tilemap_draw,
+		};
+		material_set_vtable(L, &vt);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static inline struct tilemap_layer *
+check_layer(lua_State *L) {
+	return (struct tilemap_layer *)luaL_checkudata(L, 1, "SOLUNA_TILEMAP_LAYER");
+}
+
+static inline int
+tile_index(lua_State *L, struct tilemap_layer *layer) {
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	if (x < 0 || x >= layer->width || y < 0 || y >= layer->height)
+		return luaL_error(L, "Invalid tile (%d, %d)", x, y);
+	return y * layer->width + x;
+}
+
+static void
+set_tile(struct tilemap_layer *layer, int index, int sprite) {
+	int old = layer->tile[index];
+	if (old == sprite)
+		return;
+	layer->tile[index] = sprite;
+	++layer->version;
+	if (old > 0 && old - 1 == layer->tileset) {
+		if (--layer->tileset_n == 0)
+			layer->tileset = -1;
+	}
+	if (sprite > 0) {
+		if (layer->tileset < 0) {
+			layer->tileset = sprite - 1;
+			layer->tileset_n = 1;
+		} else if (sprite - 1 == layer->tileset) {
+			++layer->tileset_n;
+		}
+	}
+	if (layer->tileset < 0) {
+		// find another tile for the texture
+		int i, n = layer->width * layer->height;
+		for (i=0;i<n;i++) {
+			if (layer->tile[i] > 0) {
+				layer->tileset = layer->tile[i] - 1;
+				layer->tileset_n = 0;
+				int j;
+				for (j=i;j<n;j++) {
+					if (layer->tile[j] == layer->tile[i])
+						++layer->tileset_n;
+				}
+				break;
+			}
+		}
+	}
+}
+
+// layer:set(x, y, sprite) ; x, y are base 0, sprite is the sprite id (nil or 0 for empty)
+static int
+llayer_set(lua_State *L) {
+	struct tilemap_layer *layer = check_layer(L);
+	int index = tile_index(L, layer);
+	int sprite = luaL_optinteger(L, 4, 0);
+	if (sprite < 0)
+		return luaL_error(L, "Invalid sprite id %d", sprite);
+	set_tile(layer, index, sprite);
+	return 0;
+}
+
+static int
+llayer_get(lua_State *L) {
+	struct tilemap_layer *layer = check_layer(L);
+	int index = tile_index(L, layer);
+	int sprite = layer->tile[index];
+	if (sprite == 0)
+		return 0;
+	lua_pushinteger(L, sprite);
+	return 1;
+}
+
+// layer:fill(sprite)
+static int
+llayer_fill(lua_State *L) {
+	struct tilemap_layer *layer = check_layer(L);
+	int sprite = luaL_optinteger(L, 2, 0);
+	if (sprite < 0)
+		return luaL_error(L, "Invalid sprite id %d", sprite);
+	int i, n = layer->width * layer->height;
+	for (i=0;i<n;i++) {
+		layer->tile[i] = sprite;
+	}
+	layer->tileset = sprite - 1;
+	layer->tileset_n = sprite > 0 ? n : 0;
+	++layer->version;
+	return 0;
+}
+
+static int
+llayer_size(lua_State *L) {
+	struct tilemap_layer *layer = check_layer(L);
+	lua_pushinteger(L, layer->width);
+	lua_pushinteger(L, layer->height);
+	return 2;
+}
+
+struct tilemap_primitive {
+	struct draw_primitive pos;
+	union {
+		struct draw_primitive dummy;
+		struct tilemap t;
+	} u;
+};
+
+// copy the tiles into a new snapshot, and replace the one in the slot
+static int
+publish_layer(struct tilemap_layer *layer) {
+	size_t n = (size_t)layer->width * layer->height;
+	struct tile_snapshot *snap = (struct tile_snapshot *)snapshot_new(sizeof(*snap) + (n - 1) * sizeof(snap->tile[0]));
+	if (snap == NULL)
+		return 0;
+	snap->version = layer->version;
+	snap->width = layer->width;
+	snap->height = layer->height;
+	snap->tile_width = layer->tile_width;
+	snap->tile_height = layer->tile_height;
+	snap->tileset = layer->tileset;
+	memcpy(snap->tile, layer->tile, n * sizeof(snap->tile[0]));
+	snapshot_publish(&g_layer[layer->slot], &snap->head);
+	layer->published = snap;
+	return 1;
+}
+
+// layer:primitive() returns the primitive for batch:add(), all tiles should be in the same atlas texture.
+// The tiles are drawn as they are at the last primitive() call
+static int
+llayer_primitive(lua_State *L) {
+	struct tilemap_layer *layer = check_layer(L);
+	if (layer->slot < 0)
+		return luaL_error(L, "Tilemap layer is released");
+	if ((layer->published == NULL || layer->published->version != layer->version) && !publish_layer(layer))
+		return luaL_error(L, "tilemap : Out of memory");
+	struct tilemap_primitive prim;
+	memset(&prim, 0, sizeof(prim));
+	prim.pos.sprite = -MATERIAL_TILEMAP;
+	prim.u.t.header.sprite = layer->tileset;
+	prim.u.t.slot = layer->slot;
+	prim.u.t.serial = layer->serial;
+	lua_pushlstring(L, (const char *)&prim, sizeof(prim));
+	return 1;
+}
+
+static int
+llayer_release(lua_State *L) {
+	struct tilemap_layer *layer = (struct tilemap_layer *)lua_touserdata(L, 1);
+	if (layer->slot < 0)
+		return 0;
+	snapshot_slot_free(&g_layer[layer->slot]);
+	layer->slot = -1;
+	layer->published = NULL;
+	return 0;
+}
+
+// tilemap.layer(width, height, tile_width, tile_height)
+static int
+llayer(lua_State *L) {
+	int width = luaL_checkinteger(L, 1);
+	int height = luaL_checkinteger(L, 2);
+	int tile_width = luaL_checkinteger(L, 3);
+	int tile_height = luaL_optinteger(L, 4, tile_width);
+	if (width <= 0 || width > TILEMAP_MAXSIZE || height <= 0 || height > TILEMAP_MAXSIZE)
+		return luaL_error(L, "Invalid tilemap size (%d * %d)", width, height);
+	if (tile_width <= 0 || tile_height <= 0)
+		return luaL_error(L, "Invalid tile size (%d * %d)", tile_width, tile_height);
+	size_t n = (size_t)width * height;
+	struct tilemap_layer *layer = (struct tilemap_layer *)lua_newuserdatauv(L, sizeof(*layer) + (n - 1) * sizeof(layer->tile[0]), 0);
+	// layers are created in different services
+	static atomic_uint g_serial;
+	uint32_t s;
+	do {
+		s = atomic_fetch_add(&g_serial, 1) + 1;
+	} while (s == 0);
+	layer->serial = s;
+	layer->version = 0;
+	layer->width = width;
+	layer->height = height;
+	layer->tile_width = tile_width;
+	layer->tile_height = tile_height;
+	layer->tileset = -1;
+	layer->tileset_n = 0;
+	layer->slot = -1;
+	layer->published = NULL;
+	memset(layer->tile, 0, n * sizeof(layer->tile[0]));
+	if (luaL_newmetatable(L, "SOLUNA_TILEMAP_LAYER")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", llayer_release },
+			{ "set", llayer_set },
+			{ "get", llayer_get },
+			{ "fill", llayer_fill },
+			{ "size", llayer_size },
+			{ "primitive", llayer_primitive },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	layer->slot = snapshot_slot_alloc(g_layer, TILEMAP_LAYER_MAX, &g_layer_next, s);
+	if (layer->slot < 0)
+		return luaL_error(L, "Too many tilemap layers (%d)", TILEMAP_LAYER_MAX);
+	return 1;
+}
+
+int
+luaopen_material_tilemap(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "layer", llayer },
+		{ "new", lnew_material_tilemap },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
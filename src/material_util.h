@@ -4,9 +4,16 @@
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "staging.h"
+
 #define MATERIAL_TEXT_NORMAL 1
 #define MATERIAL_QUAD 2
 #define MATERIAL_MASK 3
+#define MATERIAL_TILEMAP 4
+#define MATERIAL_PARTICLE 5
+#define MATERIAL_MESH 6
+// pseudo material in batch stream, x is the z key for draw sort
+#define MATERIAL_ZKEY 0x7fff
 
 static inline void
 ref_object(lua_State *L, void *ptr, int uv_index, const char *key, const char *luatype, int direct) {
@@ -26,4 +33,16 @@ ref_object(lua_State *L, void *ptr, int uv_index, const char *key, const char *l
 	}
 }
 
+// staging lane of the material's instance buffer
+static inline int
+ref_lane(lua_State *L, const char *key) {
+	if (lua_getfield(L, 1, key) != LUA_TNUMBER)
+		luaL_error(L, "Invalid key .%s", key);
+	int lane = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (lane < 0 || lane >= STAGING_LANE)
+		luaL_error(L, "Invalid staging lane %d", lane);
+	return lane;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef soluna_material_vtable_h
+#define soluna_material_vtable_h
+
+#include <lua.h>
+
+#include "sokol/sokol_gfx.h"
+#include "batch.h"
+
+// The metatable of a C material stores a lightuserdata of struct material_vtable in this field,
+// drawmgr calls it directly instead of dispatching submit/draw in lua.
+#define MATERIAL_VTABLE "__material"
+
+struct material_vtable {
+	// raise lua error on failure
+	void (*submit)(lua_State *L, void *m, struct draw_primitive *prim, int n);
+	// texture is the view of the draw element's texture, NULL if it has none
+	void (*draw)(void *m, struct draw_primitive *prim, int n, const sg_view *texture, int ex);
+};
+
+static inline void
+material_set_vtable(lua_State *L, const struct material_vtable *vt) {
+	lua_pushlightuserdata(L, (void *)vt);
+	lua_setfield(L, -2, MATERIAL_VTABLE);
+}
+
+#endif
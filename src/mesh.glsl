@@ -0,0 +1,38 @@
+@vs vs
+layout(binding=0) uniform vs_params {
+	vec2 framesize;
+	float texsize;
+};
+
+in vec2 position;	// screen space, transformed on cpu
+in vec3 texcoord;	// atlas pixels, layer of the atlas
+in vec4 color;
+
+out vec3 uv;
+out vec4 vcolor;
+
+void main() {
+	vec2 pos = position * framesize;
+	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
+	vec2 st = texcoord.xy * abs(texsize);
+	// negative texsize : a render target on GL, flip v
+	uv = vec3(st.x, texsize < 0.0f ? 1.0f - st.y : st.y, texcoord.z);
+	vcolor = color;
+}
+
+@end
+
+@fs fs
+layout(binding=0) uniform texture2DArray tex;
+layout(binding=0) uniform sampler smp;
+
+in vec3 uv;
+in vec4 vcolor;
+out vec4 frag_color;
+
+void main() {
+	frag_color = texture(sampler2DArray(tex,smp), uv) * vcolor;
+}
+@end
+
+@program mesh vs fs
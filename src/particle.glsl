@@ -0,0 +1,85 @@
+@vs vs
+layout(binding=0) uniform vs_params {
+	vec4 frame;	// framesize.xy, texsize, age of the emitter
+	vec4 origin;	// x, y, lifetime, seed
+	vec4 velocity;	// speed min, speed max, angle min, angle max
+	vec4 force;	// gravity x, gravity y, scale from, scale to
+	vec4 sr;	// scale/rot matrix of the emitter
+	vec4 misc;	// spin, count, loop
+	ivec4 rect;	// offset, u, v, atlas layer of the sprite
+};
+
+out vec3 uv;	// z is the layer of the atlas
+out float alpha;
+
+uint hash(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+float rand(uint seed, uint i, uint channel) {
+	return float(hash(seed ^ hash(i * 4u + channel)) & 0xffffffu) * (1.0 / 16777216.0);
+}
+
+void main() {
+	uint i = uint(gl_InstanceIndex);
+	uint seed = uint(origin.w);
+	float lifetime = origin.z;
+	// particle i is born at i * lifetime / count, and respawns every lifetime when loop
+	float t = frame.w - float(i) * lifetime / misc.y;
+	if (misc.z != 0.0 && t >= 0.0)
+		t = mod(t, lifetime);
+	if (t < 0.0 || t >= lifetime) {
+		gl_Position = vec4(0, 0, 2, 1);	// not alive, clipped
+		uv = vec3(0);
+		alpha = 0.0;
+		return;
+	}
+	float speed = mix(velocity.x, velocity.y, rand(seed, i, 0u));
+	float angle = mix(velocity.z, velocity.w, rand(seed, i, 1u));
+	vec2 v = vec2(cos(angle), sin(angle)) * speed;
+	vec2 p = v * t + 0.5 * force.xy * t * t;
+	float life = t / lifetime;
+	float scale = mix(force.z, force.w, life);
+	float rot = misc.x * t * (rand(seed, i, 2u) * 2.0 - 1.0);
+	float c = cos(rot) * scale;
+	float s = sin(rot) * scale;
+
+	uint u = uint(rect.y);
+	uint vv = uint(rect.z);
+	uint offset = uint(rect.x);
+	ivec2 uv_base = ivec2(u >> 16, vv >> 16);
+	ivec2 u2 = ivec2(0 , u & 0xffffu);
+	ivec2 v2 = ivec2(0 , vv & 0xffffu);
+	ivec2 off = ivec2(offset >> 16 , offset & 0xffffu) - 0x8000;
+	vec2 uv_offset = vec2(u2[gl_VertexIndex & 1] , v2[gl_VertexIndex >> 1]);
+	vec2 local = (uv_offset - off) * mat2(c, -s, s, c) + p;
+	vec2 pos = (local * mat2(sr) + origin.xy) * frame.xy;
+	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
+	vec2 st = (uv_base + uv_offset) * abs(frame.z);
+	// negative texsize : a render target on GL, flip v
+	uv = vec3(st.x, frame.z < 0.0f ? 1.0f - st.y : st.y, rect.w);
+	alpha = 1.0 - life;
+}
+
+@end
+
+@fs fs
+layout(binding=1) uniform texture2DArray tex;
+layout(binding=0) uniform sampler smp;
+
+in vec3 uv;
+in float alpha;
+out vec4 frag_color;
+
+void main() {
+	vec4 c = texture(sampler2DArray(tex,smp), uv);
+	frag_color = vec4(c.rgb, c.a * alpha);
+}
+@end
+
+@program particle vs fs
@@ -8,9 +8,14 @@
 #include "sokol/sokol_app.h"
 #include "texquad.glsl.h"
 #include "srbuffer.h"
+#include "staging.h"
+#include "jobpool.h"
+#include "stats.h"
 #include "sprite_submit.h"
 #include "batch.h"
 #include "spritemgr.h"
+#include "render_bindings.h"
+#include "texture_upload.h"
 
 #define UNIFORM_MAX 4
 #define BINDINGNAME_MAX 32
@@ -23,6 +28,8 @@ struct buffer {
 struct image {
 	sg_image img;
 	int size;
+	int layers;
+	struct texture_upload *upload;	// NULL : update() replaces the whole image
 };
 
 struct sampler {
@@ -153,6 +160,16 @@ lbuffer_update(lua_State *L) {
 	return 0;
 }
 
+static int
+lbuffer_release(lua_State *L) {
+	struct buffer *p = (struct buffer *)luaL_checkudata(L, 1, "SOKOL_BUFFER");
+	if (p->handle.id != SG_INVALID_ID) {
+		sg_destroy_buffer(p->handle);
+		p->handle.id = SG_INVALID_ID;
+	}
+	return 0;
+}
+
 static int
 lbuffer_ref(lua_State *L) {
 	struct buffer *p = (struct buffer *)lua_touserdata(L, 1);
@@ -207,6 +224,7 @@ lbuffer(lua_State *L) {
 			{ "__call", lbuffer_ref },
 			{ "__tostring", lbuffer_tostring },
 			{ "update", lbuffer_update },
+			{ "release", lbuffer_release },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
@@ -219,9 +237,10 @@ lbuffer(lua_State *L) {
 	return 1;
 }
 
-// todo : offscreen pass
 struct pass {
 	sg_pass_action pass_action;
+	int offscreen;
+	sg_attachments attachments;
 };
 
 static int
@@ -240,6 +259,9 @@ read_color_action(lua_State *L, int index, sg_pass_action *action, int idx) {
 			action->colors[idx].load_action = SG_LOADACTION_LOAD;
 		} else if (strcmp(key, "dontcare") == 0 ) {
 			action->colors[idx].load_action = SG_LOADACTION_DONTCARE;
+		} else if (strcmp(key, "transparent") == 0 ) {
+			// clear to (0,0,0,0), for offscreen layers
+			action->colors[idx].load_action = SG_LOADACTION_CLEAR;
 		} else {
 			return luaL_error(L, "Invalid load action (%d) = %s", idx, key);
 		}
@@ -262,7 +284,12 @@ read_color_action(lua_State *L, int index, sg_pass_action *action, int idx) {
 static int
 lpass_begin(lua_State *L) {
 	struct pass * p = (struct pass *)luaL_checkudata(L, 1, "SOKOL_PASS");
-	sg_begin_pass(&(sg_pass) { .action = p->pass_action, .swapchain = sglue_swapchain() });
+	if (p->offscreen) {
+		sg_begin_pass(&(sg_pass) { .action = p->pass_action, .attachments = p->attachments });
+		stats_add(STATS_OFFSCREEN_PASS, 1);
+	} else {
+		sg_begin_pass(&(sg_pass) { .action = p->pass_action, .swapchain = sglue_swapchain() });
+	}
 	return 0;
 }
 
@@ -272,11 +299,23 @@ lpass_end(lua_State *L) {
 	return 0;
 }
 
+// render.pass { color0 = clear color or "load", target = attachment view } ; no target : swapchain
 static int
 lpass_new(lua_State *L) {
-	struct pass * p = lua_newuserdatauv(L, sizeof(*p), 0);
+	struct pass * p = lua_newuserdatauv(L, sizeof(*p), 1);
 	memset(p, 0, sizeof(*p));
 	luaL_checktype(L, 1, LUA_TTABLE);
+	if (lua_getfield(L, 1, "target") == LUA_TUSERDATA) {
+		struct soluna_render_view *v = (struct soluna_render_view *)luaL_checkudata(L, -1, "SOKOL_VIEW");
+		if (v->type != VIEW_TYPE_ATTACHMENT)
+			return luaL_error(L, "Pass target should be an attachment view");
+		p->offscreen = 1;
+		p->attachments.colors[0] = v->view;
+		// keep the view alive
+		lua_setiuservalue(L, -2, 1);
+	} else {
+		lua_pop(L, 1);
+	}
 	sg_pass_action *action = &p->pass_action;
 	// todo : store action
 	
@@ -327,10 +366,20 @@ lsubmit(lua_State *L) {
 static int
 limage_update(lua_State *L) {
 	struct image *p = (struct image *)luaL_checkudata(L, 1, "SOKOL_IMAGE");
-	// todo: support subimage
 	void *buffer = lua_touserdata(L, 2);
 	if (buffer == NULL)
 		return luaL_error(L, "Need data");
+	if (p->upload) {
+		// only the dirty rects, image:update(data [, first, n]) : data holds the layers [first, first + n)
+		int first = luaL_optinteger(L, 3, 0);
+		int n = luaL_optinteger(L, 4, p->layers - first);
+		if (first < 0 || n <= 0 || first + n > p->layers)
+			return luaL_error(L, "Invalid layers [%d, %d)", first, first + n);
+		size_t sz = texture_upload_commit(p->upload, buffer, first, n);
+		stats_add(STATS_TEXTURE_UPLOAD, (int)sz);
+		return 0;
+	}
+	stats_add(STATS_TEXTURE_UPLOAD, p->size);
 	sg_image_data data = {
 		.mip_levels[0].ptr = buffer,
 		.mip_levels[0].size = p->size,
@@ -360,10 +409,60 @@ limage_ref(lua_State *L) {
 	return 0;
 }
 
+static struct image *
+check_region_image(lua_State *L) {
+	struct image *p = (struct image *)luaL_checkudata(L, 1, "SOKOL_IMAGE");
+	if (p->upload == NULL)
+		luaL_error(L, "Image is not created with .region_update");
+	return p;
+}
+
+static int
+limage_dirty(lua_State *L) {
+	struct image *p = check_region_image(L);
+	int x = luaL_checkinteger(L, 2);
+	int y = luaL_checkinteger(L, 3);
+	int w = luaL_checkinteger(L, 4);
+	int h = luaL_checkinteger(L, 5);
+	int layer = luaL_optinteger(L, 6, 0);
+	texture_upload_dirty(p->upload, x, y, w, h, layer);
+	return 0;
+}
+
+static int
+limage_clear_layer(lua_State *L) {
+	struct image *p = check_region_image(L);
+	texture_upload_clear(p->upload, luaL_optinteger(L, 2, 0));
+	return 0;
+}
+
+static int
+limage_release(lua_State *L) {
+	struct image *p = (struct image *)luaL_checkudata(L, 1, "SOKOL_IMAGE");
+	texture_upload_delete(p->upload);
+	p->upload = NULL;
+	sg_destroy_image(p->img);
+	p->img.id = SG_INVALID_ID;
+	return 0;
+}
+
 static int
 limage(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	sg_image_desc img = { .usage.dynamic_update = true };
+	if (lua_getfield(L, 1, "render_target") == LUA_TBOOLEAN && lua_toboolean(L, -1)) {
+		img.usage.dynamic_update = false;
+		img.usage.color_attachment = true;
+	}
+	lua_pop(L, 1);
+	int region_update = 0;
+	if (lua_getfield(L, 1, "region_update") == LUA_TBOOLEAN && lua_toboolean(L, -1)) {
+		// image:update() uploads only the rects marked by image:dirty(), they are blitted into the image
+		region_update = 1;
+		img.usage.dynamic_update = false;
+		img.usage.color_attachment = true;
+	}
+	lua_pop(L, 1);
 	if (lua_getfield(L, 1, "width") != LUA_TNUMBER) {
 		return luaL_error(L, "Need .width");
 	}
@@ -386,7 +485,17 @@ limage(lua_State *L) {
 		pixel_size = 4;
 	}
 	lua_pop(L, 1);
-	// todo: type, render_target, num_slices, num_mipmaps, pixel_format, etc
+	int layers = 1;
+	if (lua_getfield(L, 1, "layers") == LUA_TNUMBER) {
+		// 2d texture array, image:update() uploads all the layers (one after another in memory)
+		layers = luaL_checkinteger(L, -1);
+		if (layers <= 0)
+			return luaL_error(L, "Invalid layers %d", layers);
+		img.type = SG_IMAGETYPE_ARRAY;
+		img.num_slices = layers;
+	}
+	lua_pop(L, 1);
+	// todo: num_mipmaps, etc
 	struct image * p = (struct image *)lua_newuserdatauv(L, sizeof(*p), 0);
 	memset(p, 0, sizeof(*p));
 	if (luaL_newmetatable(L, "SOKOL_IMAGE")) {
@@ -394,6 +503,9 @@ limage(lua_State *L) {
 			{ "__index", NULL },
 			{ "__call", limage_ref },
 			{ "update", limage_update },
+			{ "dirty", limage_dirty },
+			{ "clear_layer", limage_clear_layer },
+			{ "release", limage_release },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
@@ -403,7 +515,16 @@ limage(lua_State *L) {
 	}
 	lua_setmetatable(L, -2);
 	p->img = sg_make_image(&img);
-	p->size = img.width * img.height * pixel_size;
+	p->size = img.width * img.height * pixel_size * layers;
+	p->layers = layers;
+	if (region_update) {
+		p->upload = texture_upload_new(p->img, img.width, img.height, layers, img.pixel_format, pixel_size);
+		if (p->upload == NULL) {
+			sg_destroy_image(p->img);
+			p->img.id = SG_INVALID_ID;
+			return luaL_error(L, "Can't update regions of image (%d x %d x %d)", img.width, img.height, layers);
+		}
+	}
 	return 1;
 }
 
@@ -465,14 +586,39 @@ static int
 lsrbuffer_ptr(lua_State *L) {
 	struct sr_buffer *b = (struct sr_buffer *)luaL_checkudata(L, 1, "SOLUNA_SRBUFFER");
 	int sz;
+	stats_set(STATS_SRBUFFER_ENTRY, b->current_n);
 	void * ptr = srbuffer_commit(b, &sz);
 	if (ptr == NULL)
 		return 0;
+	stats_add(STATS_SRBUFFER_UPLOAD, sz);
 	lua_pushlightuserdata(L, ptr);
 	lua_pushinteger(L, sz);
 	return 2;
 }
 
+// hit rate of srbuffer_add since the last call, and the number of lookups
+static int
+lsrbuffer_hitrate(lua_State *L) {
+	struct sr_buffer *b = (struct sr_buffer *)luaL_checkudata(L, 1, "SOLUNA_SRBUFFER");
+	int lookup = b->lookup;
+	if (lookup == 0) {
+		lua_pushnumber(L, 1.0);
+	} else {
+		lua_pushnumber(L, (double)(lookup - b->miss) / lookup);
+	}
+	lua_pushinteger(L, lookup);
+	b->lookup = 0;
+	b->miss = 0;
+	return 2;
+}
+
+static int
+lsrbuffer_release(lua_State *L) {
+	struct sr_buffer *b = (struct sr_buffer *)lua_touserdata(L, 1);
+	srbuffer_release(b);
+	return 0;
+}
+
 static int
 lsrbuffer(lua_State *L) {
 	int n = luaL_checkinteger(L, 1);
@@ -482,8 +628,10 @@ lsrbuffer(lua_State *L) {
 	if (luaL_newmetatable(L, "SOLUNA_SRBUFFER")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
+			{ "__gc", lsrbuffer_release },
 			{ "add", lsrbuffer_add },
 			{ "ptr", lsrbuffer_ptr },
+			{ "hitrate", lsrbuffer_hitrate },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
@@ -506,6 +654,97 @@ struct sprite_object {
 	uint32_t v;
 };
 
+static int
+lstaging_reset(lua_State *L) {
+	struct staging *S = (struct staging *)luaL_checkudata(L, 1, "SOLUNA_STAGING");
+	staging_reset(S);
+	return 0;
+}
+
+// returns ptr, size of the lane, nothing if it's empty
+static int
+lstaging_lane(lua_State *L) {
+	struct staging *S = (struct staging *)luaL_checkudata(L, 1, "SOLUNA_STAGING");
+	int lane = luaL_checkinteger(L, 2);
+	if (lane < 0 || lane >= STAGING_LANE)
+		return luaL_error(L, "Invalid staging lane %d", lane);
+	struct staging_lane *l = &S->lane[lane];
+	if (l->n == 0)
+		return 0;
+	stats_add(STATS_INSTANCE_UPLOAD, 1);
+	lua_pushlightuserdata(L, l->ptr);
+	lua_pushinteger(L, l->n);
+	return 2;
+}
+
+static int
+lstaging_release(lua_State *L) {
+	struct staging *S = (struct staging *)lua_touserdata(L, 1);
+	staging_release(S);
+	return 0;
+}
+
+static int
+lstaging(lua_State *L) {
+	struct staging *S = (struct staging *)lua_newuserdatauv(L, sizeof(*S), 0);
+	staging_init(S);
+	if (luaL_newmetatable(L, "SOLUNA_STAGING")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", lstaging_release },
+			{ "reset", lstaging_reset },
+			{ "lane", lstaging_lane },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+ljobpool_release(lua_State *L) {
+	struct jobpool **pool = (struct jobpool **)lua_touserdata(L, 1);
+	jobpool_delete(*pool);
+	*pool = NULL;
+	return 0;
+}
+
+static int
+ljobpool_threads(lua_State *L) {
+	struct jobpool **pool = (struct jobpool **)luaL_checkudata(L, 1, "SOLUNA_JOBPOOL");
+	lua_pushinteger(L, *pool ? jobpool_threads(*pool) : 0);
+	return 1;
+}
+
+// render.jobpool(threads) : worker threads for parallel instance encode, the calling thread counts as one
+static int
+ljobpool(lua_State *L) {
+	int threads = luaL_checkinteger(L, 1);
+	struct jobpool **pool = (struct jobpool **)lua_newuserdatauv(L, sizeof(*pool), 0);
+	*pool = NULL;
+	if (luaL_newmetatable(L, "SOLUNA_JOBPOOL")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", ljobpool_release },
+			{ "threads", ljobpool_threads },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	*pool = jobpool_new(threads);
+	if (*pool == NULL)
+		return luaL_error(L, "jobpool : Out of memory");
+	return 1;
+}
+
 static int
 lbuffer_size(lua_State *L) {
 	const char * name = luaL_checkstring(L, 1);
@@ -539,6 +778,8 @@ luaopen_render(lua_State *L) {
 		{ "sampler", lsampler },
 		{ "draw", ldraw },
 		{ "srbuffer", lsrbuffer },
+		{ "staging", lstaging },
+		{ "jobpool", ljobpool },
 		{ "buffer_size", lbuffer_size },
 		{ "bindings", lbindings_new },
 		{ "view", lview_new },
@@ -58,18 +58,13 @@ lbindings_set_ioff(lua_State *L) {
 	return 0;
 }
 
-struct view {
-	sg_view view;
-	int type;
-};
-
 static int
 lbindings_set_view(lua_State *L) {
 	sg_bindings *b = get_bindings(L);
 	int index = luaL_checkinteger(L, 2);
 	if (index < 0 || index >= SG_MAX_VIEW_BINDSLOTS)
 		return luaL_error(L, "Invalid view slot %d", index);
-	struct view *v = luaL_checkudata(L, 3, "SOKOL_VIEW");
+	struct soluna_render_view *v = luaL_checkudata(L, 3, "SOKOL_VIEW");
 	b->views[index] = v->view;
 	return 0;
 }
@@ -94,28 +89,25 @@ lbindings_apply(lua_State *L) {
 	return 0;
 }
 
-#define VIEW_TYPE_INVALID 0
-#define VIEW_TYPE_TEXTURE 1
-#define VIEW_TYPE_STORAGE 2
-
 static inline const char *
 view_type_string(int type) {
 	switch (type) {
 	case VIEW_TYPE_TEXTURE : return "texture";
 	case VIEW_TYPE_STORAGE : return "storage";
+	case VIEW_TYPE_ATTACHMENT : return "attachment";
 	default : return "invalid";
 	}
 }
 
 static inline void
-check_view_type(lua_State *L, struct view *v) {
+check_view_type(lua_State *L, struct soluna_render_view *v) {
 	if (v->type != VIEW_TYPE_INVALID)
 		luaL_error(L, "Invalid multi type set : %s", view_type_string(v->type));
 }
 
 static int
 lview_tostring(lua_State *L) {
-	struct view *v = (struct view *)lua_touserdata(L, 1);
+	struct soluna_render_view *v = (struct soluna_render_view *)lua_touserdata(L, 1);
 	const char *s = view_type_string(v->type);
 	lua_pushexternalstring(L, s, strlen(s), NULL, NULL);
 	return 1;
@@ -123,7 +115,7 @@ lview_tostring(lua_State *L) {
 
 static int
 lview_release(lua_State *L) {
-	struct view *v = (struct view *)lua_touserdata(L, 1);
+	struct soluna_render_view *v = (struct soluna_render_view *)lua_touserdata(L, 1);
 	if (v->type != VIEW_TYPE_INVALID) {
 		v->type = VIEW_TYPE_INVALID;
 		sg_destroy_view(v->view);
@@ -136,15 +128,15 @@ lview_new(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TTABLE);
 	struct sg_view_desc desc;
 	memset(&desc, 0 , sizeof(desc));
-	struct view *v = NULL;
+	struct soluna_render_view *v = NULL;
 	if (lua_getfield(L, 1, "label") == LUA_TSTRING) {
-		v = (struct view *)lua_newuserdatauv(L, sizeof(*v), 1);
+		v = (struct soluna_render_view *)lua_newuserdatauv(L, sizeof(*v), 1);
 		lua_insert(L, -2);
 		desc.label = lua_tostring(L, -1);
 		lua_setiuservalue(L, 1, 1);
 	} else {
 		lua_pop(L, 1);
-		v = (struct view *)lua_newuserdatauv(L, sizeof(*v), 0);
+		v = (struct soluna_render_view *)lua_newuserdatauv(L, sizeof(*v), 0);
 	}
 	v->type = VIEW_TYPE_INVALID;
 	if (lua_getfield(L, 1, "texture") == LUA_TUSERDATA) {
@@ -166,6 +158,16 @@ lview_new(lua_State *L) {
 	} else {
 		lua_pop(L, 1);
 	}
+	if (lua_getfield(L, 1, "attachment") == LUA_TUSERDATA) {
+		// color attachment of an offscreen pass, the image is a render target
+		check_view_type(L, v);
+		v->type = VIEW_TYPE_ATTACHMENT;
+		luaL_checkudata(L, -1, "SOKOL_IMAGE");
+		lua_pushlightuserdata(L, &desc.color_attachment.image);
+		lua_call(L, 1, 0);
+	} else {
+		lua_pop(L, 1);
+	}
 	if (v->type == VIEW_TYPE_INVALID)
 		return luaL_error(L, "No view type");
 	v->view = sg_make_view(&desc);
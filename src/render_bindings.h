@@ -8,6 +8,24 @@ struct soluna_render_bindings {
 	sg_bindings bindings;
 };
 
+#define VIEW_TYPE_INVALID 0
+#define VIEW_TYPE_TEXTURE 1
+#define VIEW_TYPE_STORAGE 2
+#define VIEW_TYPE_ATTACHMENT 3
+
+// userdata of "SOKOL_VIEW"
+struct soluna_render_view {
+	sg_view view;
+	int type;
+};
+
+// texel row 0 of a render target is at the bottom (clip y = -1) on GL
+static inline int
+origin_bottom_left(void) {
+	sg_backend backend = sg_query_backend();
+	return backend == SG_BACKEND_GLCORE || backend == SG_BACKEND_GLES3;
+}
+
 #define DRAWFUNC(name) (sg_query_features().draw_base_instance ? name##_ex : name)
 
 #endif
\ No newline at end of file
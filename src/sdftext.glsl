@@ -13,11 +13,13 @@ layout(binding=0) readonly buffer sr_lut {
 };
 
 in vec3 position;
+in vec4 color;
 in uint offset;
 in uint u;
 in uint v;
 
 out vec2 uv;
+out vec4 text_color;
 
 void main() {
 	ivec2 uv_base = ivec2(u >> 16, v >> 16);
@@ -28,6 +30,7 @@ void main() {
 	vec2 pos = ((uv_offset - off) * sr[int(position.z)].m + position.xy) * framesize;
 	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
 	uv = (uv_base + uv_offset) * texsize;
+	text_color = color;
 }
 
 @end
@@ -39,24 +42,17 @@ layout(binding=0) uniform sampler smp;
 layout(binding=1) uniform fs_params {
 	float edge_mask;
 	float dist_multiplier;
-	int color;
-	float unused;
 };
 
 in vec2 uv;
+in vec4 text_color;
 out vec4 frag_color;
 
 void main() {
 	float dis = texture(sampler2D(tex,smp), uv).r;
 	float smoothing = length(fwidth(uv)) * 128.0 * dist_multiplier;
 	float alpha = smoothstep(edge_mask - smoothing, edge_mask + smoothing, dis);
-	float color_alpha = ((color >> 24) & 0xff) / 255.0f;
-	vec4 c = vec4(
-		((color >> 16) & 0xff) / 255.0f,
-		((color >> 8) & 0xff) / 255.0f,
-		((color) & 0xff) / 255.0f,
-		color_alpha * alpha);
-	frag_color = c;
+	frag_color = vec4(text_color.rgb, text_color.a * alpha);
 }
 @end
 
@@ -1,10 +1,15 @@
 local image = require "soluna.image"
 local spritemgr = require "soluna.spritemgr"
 local spritebundle = require "soluna.spritebundle"
+local atlas = require "soluna.atlas"
+local datalist = require "soluna.datalist"
 
-global setmetatable, ipairs, pairs, assert
+global setmetatable, ipairs, pairs, assert, error, string, table
 
 local sprite_bank
+local texture_size
+local atlas_page
+local decode_thread
 
 -- todo: make weak table
 local filecache = setmetatable({ __missing = {}} , { __index = spritebundle.loadimage })
@@ -13,16 +18,73 @@ local S = {}
 
 function S.init(config)
 	sprite_bank = spritemgr.newbank(config.max_sprite, config.texture_size)
+	texture_size = config.texture_size
+	atlas_page = config.atlas_page
+	decode_thread = config.decode_thread
+	if config.atlas_page then
+		-- the atlas texture has atlas_page layers, reuse the least recently used page beyond it
+		sprite_bank:residency(config.atlas_page, config.atlas_keep_frame)
+	end
 	return sprite_bank:ptr()
 end
 
 local bundle = {}
 local sprite = {}
+local baked = {}
+
+-- a baked atlas (see S.bake) : the sprites are placed on its pages as they were baked, nothing is decoded nor packed
+local function load_baked(filename)
+	local obj = atlas.load(filename)
+	local _, size, n = obj:pages()
+	if size ~= texture_size then
+		error(string.format("%s is baked with texture size %d, not %d", filename, size, texture_size))
+	end
+	local first = sprite_bank:pages()
+	if atlas_page and first + n > atlas_page then
+		error(string.format("%s needs %d atlas pages, raise setting atlas_page to %d", filename, n, first + n))
+	end
+	local b = {}
+	local placed = {}
+	for _, s in ipairs(datalist.parse(obj:meta())) do
+		local id = sprite_bank:add(s.w, s.h, s.dx, s.dy)
+		placed[id] = sprite_bank:place(id, first + s.page, s.x, s.y)
+		sprite[id] = s
+		if s.index == 0 then
+			b[s.name] = id
+		else
+			local pack = b[s.name]
+			if not pack then
+				pack = {}
+				b[s.name] = pack
+			end
+			pack[s.index] = id
+		end
+	end
+	-- keep the mapping, the render service uploads the pages from it
+	baked[filename] = { atlas = obj, first = first, n = n, placed = placed }
+	return b
+end
+
+-- returns the mapped pages of a baked atlas, the first layer, the number of pages
+-- and the placements of its sprites (for spritemgr.apply), only once
+function S.baked_pages(filename)
+	local a = baked[filename]
+	if a and not a.uploaded then
+		a.uploaded = true
+		local ptr = a.atlas:pages()
+		local placed = a.placed
+		a.placed = nil
+		return ptr, a.first, a.n, placed, sprite_bank:pages()
+	end
+end
 
 function S.loadbundle(filename)
 	local b = bundle[filename]
-	if not b then
-		local desc = spritebundle.load(filecache, filename)
+	if not b and filename:find "%.atlas$" then
+		b = load_baked(filename)
+		bundle[filename] = b
+	elseif not b then
+		local desc = spritebundle.load(filecache, filename, decode_thread)
 		b = {}
 		for _, item in ipairs(desc) do
 			local n = #item
@@ -49,21 +111,78 @@ function S.loadbundle(filename)
 	return b
 end
 
+-- a new sprite for a cached layer, never packed ; the render service binds it to the render target.
+-- It's not reused with the texid, the handles of a released layer never draw another layer
+function S.layer_sprite(width, height)
+	local id = sprite_bank:add(width, height, 0, 0)
+	sprite_bank:texture(id)
+	return id
+end
+
 -- todo: packing should be out of loader 
+-- returns the rects placed by this pack only (the sprites placed before never move), the pages evicted,
+-- the sprites over budget, the number of pages and the frames to wait before retrying the ones over budget.
+-- Nothing is published to the sprites here, the render service applies it when the atlas is updated.
+-- The evicted sprites are decoded again from filecache when they are packed again.
 function S.pack()
-	local texid, n = sprite_bank:pack()
-
-	local r = sprite_bank:altas(texid)
+	local r, evicted, dropped, pages, retry = sprite_bank:pack()
 	for id,v in pairs(r) do
-		local x = v >> 32
-		local y = v & 0xffffffff
+		local page = v >> 32
+		local x = (v >> 16) & 0xffff
+		local y = v & 0xffff
 		local obj = sprite[id]
 		local c = filecache[obj.filename]
 		local data = image.canvas(c.data, c.w, c.h, obj.cx, obj.cy, obj.cw, obj.ch)
 		local w, h, ptr = image.canvas_size(data)
-		r[id] = { id = id, data = ptr, x = x, y = y, w = w, h = h, stride = c.w * 4, dx = obj.x, dy = obj.y }
+		r[id] = { id = id, data = ptr, page = page, x = x, y = y, w = w, h = h, stride = c.w * 4, dx = obj.x, dy = obj.y }
+	end
+	return r, evicted, dropped, pages, retry
+end
+
+-- bake the sprites of a bundle into an atlas file, soluna.load_sprites(output) loads it without decoding
+-- the images. returns the number of pages
+function S.bake(filename, output)
+	local desc = spritebundle.load(filecache, filename, decode_thread)
+	local list = {}
+	for _, item in ipairs(desc) do
+		local n = #item
+		if n == 0 then
+			list[#list + 1] = { name = item.name, index = 0, obj = item }
+		else
+			for i = 1, n do
+				list[#list + 1] = { name = item.name, index = i, obj = item[i] }
+			end
+		end
+	end
+	-- pack in a bank of its own, the sprites of the running bank are untouched
+	local bank = spritemgr.newbank(#list, texture_size)
+	for _, s in ipairs(list) do
+		local obj = s.obj
+		s.id = bank:add(obj.cw, obj.ch, obj.x, obj.y)
+		bank:touch(s.id)
+	end
+	local r = bank:pack() or {}
+	local pages = bank:pages()
+	local img = image.new(texture_size, texture_size * pages)
+	local canvas = img:canvas()
+	local meta = {}
+	for i, s in ipairs(list) do
+		local v = r[s.id]
+		if not v then
+			error(string.format("Too many sprites in %s to bake", filename))
+		end
+		local page = v >> 32
+		local x = (v >> 16) & 0xffff
+		local y = v & 0xffff
+		local obj = s.obj
+		local c = filecache[obj.filename]
+		local src = image.canvas(c.data, c.w, c.h, obj.cx, obj.cy, obj.cw, obj.ch)
+		image.blit(canvas, src, x, y + page * texture_size)
+		meta[i] = string.format("--\nname : %q\nindex : %d\npage : %d\nx : %d\ny : %d\nw : %d\nh : %d\ndx : %d\ndy : %d\n",
+			s.name, s.index, page, x, y, obj.cw, obj.ch, obj.x, obj.y)
 	end
-	return r
+	atlas.write(output, table.concat(meta), texture_size, pages, img)
+	return pages
 end
 
 function S.write(id, filename)
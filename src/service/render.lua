@@ -3,13 +3,18 @@ local render = require "soluna.render"
 local image = require "soluna.image"
 local embedsource = require "soluna.embedsource"
 local drawmgr = require "soluna.drawmgr"
+local spritemgr = require "soluna.spritemgr"
 local defmat = require "soluna.material.default"
 local textmat = require "soluna.material.text"
 local quadmat = require "soluna.material.quad"
 local maskmat = require "soluna.material.mask"
+local tilemat = require "soluna.material.tilemap"
+local particlemat = require "soluna.material.particle"
+local meshmat = require "soluna.material.mesh"
 local soluna_app = require "soluna.app"
+local stats = require "soluna.stats"
 
-global require, assert, pairs, pcall, ipairs, print
+global require, assert, pairs, pcall, ipairs, print, math, error, string, type
 
 local setting = require "soluna".settings()
 
@@ -17,6 +22,10 @@ local DEFAULT_MAT <const> = 0
 local TEXT_MAT <const> = 1
 local QUAD_MAT <const> = 2
 local MASK_MAT <const> = 3
+local TILEMAP_MAT <const> = 4
+local PARTICLE_MAT <const> = 5
+local MESH_MAT <const> = 6
+local MESH_INDEX <const> = 7	-- staging lane of mesh indices
 
 local font = {} ;  do
 	local mgr = require "soluna.font.manager"
@@ -35,7 +44,15 @@ local font = {} ;  do
 	end
 	
 	function font.submit(img)
-		if fontapi.submit() then
+		local dirty, rect = fontapi.submit()
+		if dirty then
+			if rect then
+				-- only the glyph slots written in this frame
+				local size = fontapi.glyph_size
+				for _, r in ipairs(rect) do
+					img:dirty(r >> 16, r & 0xffff, size, size)
+				end
+			end
 			img:update(texture_ptr)
 		end
 	end
@@ -84,50 +101,16 @@ local batch = {} ; do
 			q[i] = q[i+1]
 		end
 		q[n] = nil
+		if n > 1 then
+			-- the next batch of this queue has been submitted already
+			submit_n = submit_n + 1
+		end
 		return r()
 	end
 end
 
 local STATE
 
-local materials = {
-	[DEFAULT_MAT] = {
-		submit = function(ptr, n)
-			STATE.material:submit(ptr, n)
-		end,
-		draw = function(ptr, n, tex)
-			STATE.bindings:view(1, STATE.views[tex+1])
-			STATE.material:draw(ptr, n, tex)
-		end,
-	},
-	[TEXT_MAT] = {
-		submit = function(ptr, n)
-			STATE.material_text:submit(ptr, n)
-		end,
-		draw = function(ptr, n)
-			STATE.bindings:view(1, STATE.views.font)
-			STATE.material_text:draw(ptr, n)
-		end,
-	},
-	[QUAD_MAT] = {
-		submit = function(ptr, n)
-			STATE.material_quad:submit(ptr, n)
-		end,
-		draw = function(ptr, n)
-			STATE.material_quad:draw(ptr, n)
-		end,
-	},
-	[MASK_MAT] = {
-		submit = function(ptr, n)
-			STATE.material_mask:submit(ptr, n)
-		end,
-		draw = function(ptr, n, tex)
-			STATE.mask_bindings:view(1, STATE.views[tex+1])
-			STATE.material_mask:draw(ptr, n, tex)
-		end,
-	}
-}
-
 
 local S = {}
 
@@ -141,14 +124,268 @@ function S.app(settings)
 	end
 end
 
-local update_image
+-- uploads of the atlas, one per frame (the staging buffer of an image can be updated only once per frame)
+local update_queue = {}
 local function delay_update_image(imgmem)
-	function update_image()
-		STATE.textures[1]:update(imgmem)
-		update_image = nil
+	for _, f in ipairs(update_queue) do
+		if f == imgmem then
+			-- the dirty rects accumulate until it's uploaded
+			return
+		end
+	end
+	update_queue[#update_queue + 1] = imgmem
+end
+
+local function update_image()
+	local f = update_queue[1]
+	if f == nil then
+		return
+	end
+	for i = 1, #update_queue do
+		update_queue[i] = update_queue[i + 1]
+	end
+	if type(f) == "function" then
+		f()
+	else
+		STATE.textures[1]:update(f)
+	end
+end
+
+local function sr_resize(size)
+	local sz = STATE.srbuffer_size
+	while sz < size do
+		sz = sz * 2
+	end
+	local sr_buffer = render.buffer {
+		type = "storage",
+		usage = "dynamic",
+		label = "texquad-scalerot",
+		size = sz,
+	}
+	local view = render.view { storage = sr_buffer }
+	STATE.bindings:view(0, view)
+	STATE.text_bindings:view(0, view)
+	STATE.quad_bindings:view(0, view)
+	STATE.mask_bindings:view(0, view)
+	STATE.srbuffer:release()
+	STATE.srbuffer = sr_buffer
+	STATE.srbuffer_size = sz
+	STATE.views.storage = view
+end
+
+local function bind_buffer(bindings, type, buffer)
+	if type == "index" then
+		bindings:ibuffer(buffer)
+	else
+		bindings:vbuffer(0, buffer)
+	end
+end
+
+-- instance buffers, materials encode into STATE.staging (lane is the material id), one upload per frame
+-- type is "vertex" (default) or "index"
+local function instance_buffer(lane, label, size, bindings, type)
+	type = type or "vertex"
+	local buffer = render.buffer {
+		type = type,
+		usage = "stream",
+		label = label,
+		size = size,
+	}
+	bind_buffer(bindings, type, buffer)
+	local inst = STATE.instance
+	inst[#inst+1] = {
+		lane = lane,
+		label = label,
+		type = type,
+		size = size,
+		buffer = buffer,
+		bindings = bindings,
+	}
+end
+
+local function instance_upload()
+	local staging = STATE.staging
+	for _, inst in ipairs(STATE.instance) do
+		local ptr, size = staging:lane(inst.lane)
+		if ptr then
+			if size > inst.size then
+				-- more instances than draw_instance, grow the buffer
+				local sz = inst.size
+				while sz < size do
+					sz = sz * 2
+				end
+				local buffer = render.buffer {
+					type = inst.type,
+					usage = "stream",
+					label = inst.label,
+					size = sz,
+				}
+				bind_buffer(inst.bindings, inst.type, buffer)
+				inst.buffer:release()
+				inst.buffer = buffer
+				inst.size = sz
+			end
+			inst.buffer:update(ptr, size)
+		end
+	end
+end
+
+-- Cached layers : a recorded stream rendered into an offscreen texture when it is dirty,
+-- and drawn as a sprite (texid LAYER_TEXTURE + slot) in the main pass.
+local LAYER_TEXTURE <const> = 128	-- atlas pages are below (ATLAS_PAGE_MAX)
+local LAYER_MAX <const> = 128
+
+local layer = {}	-- slot -> layer object
+
+local function init_drawmgr(dm, width, height)
+	if setting.viewport_cull then
+		dm:viewport(width, height, setting.cull_margin)
+	end
+	dm:sort(setting.draw_sort)
+	dm:uniform(STATE.uniform)
+	dm:material(DEFAULT_MAT, STATE.material)
+	dm:material(TEXT_MAT, STATE.material_text)
+	dm:material(QUAD_MAT, STATE.material_quad)
+	dm:material(MASK_MAT, STATE.material_mask)
+	dm:material(TILEMAP_MAT, STATE.material_tilemap)
+	dm:material(PARTICLE_MAT, STATE.material_particle)
+	dm:material(MESH_MAT, STATE.material_mesh)
+	dm:texture(0, STATE.views[1])
+	for _, obj in pairs(layer) do
+		dm:texture(obj.texid, obj.view, obj.size, true)
+	end
+end
+
+-- submit the dirty layers before the main drawmgr, returns them in the order to draw
+local function layer_submit()
+	local list = {}
+	for slot = 1, LAYER_MAX do
+		local obj = layer[slot]
+		if obj and obj.dirty and obj.stream then
+			local dm = obj.drawmgr
+			dm:reset()
+			dm:append(obj.stream)
+			dm:submit()
+			list[#list+1] = obj
+		end
+	end
+	return list
+end
+
+local function layer_draw(list)
+	if #list == 0 then
+		return
+	end
+	for i = 1, #list do
+		local obj = list[i]
+		STATE.uniform.framesize = { 2/obj.size, -2/obj.size }
+		obj.pass:begin()
+			obj.drawmgr:draw()
+		obj.pass:finish()
+		obj.dirty = false
+	end
+	STATE.uniform.framesize = { 2/STATE.width, -2/STATE.height }
+end
+
+local SR_PROBE <const> = 120	-- frames in instance mode before probing the lut again
+local SR_MISS <const> = 0.5	-- switch to instance mode when the lut misses more than this
+local SR_LOOKUP <const> = 1024	-- ignore frames with few lookups
+
+local function set_sr_mode(mode)
+	STATE.material:sr_mode(mode)
+	STATE.material_quad:sr_mode(mode)
+	STATE.material_mask:sr_mode(mode)
+	STATE.sr_mode = mode
+end
+
+-- auto sr mode : choose by the hit rate of srbuffer in the last frame
+local function update_sr_mode()
+	local rate, lookup = STATE.srbuffer_mem:hitrate()
+	if STATE.sr_mode == "lut" then
+		if lookup >= SR_LOOKUP and 1 - rate > SR_MISS then
+			set_sr_mode "instance"
+			STATE.sr_probe = SR_PROBE
+		end
+	else
+		STATE.sr_probe = STATE.sr_probe - 1
+		if STATE.sr_probe <= 0 then
+			set_sr_mode "lut"
+		end
+	end
+end
+
+local request_pack
+
+local function pack_done()
+	STATE.packing = false
+	if STATE.pack_again then
+		request_pack()
 	end
 end
 
+-- blit the new placements of the loader's pack into atlas_mem, and upload it in the next frame.
+-- The sprites become resident (spritemgr.apply) in the frame the atlas is updated, never before their pixels.
+-- returns true if the pack is applied later
+local function pack_sprites()
+	local loader = ltask.uniqueservice "loader"
+	local rect, evicted, dropped, pages, retry = ltask.call(loader, "pack")
+
+	-- the pages are stacked vertically in atlas_mem, the same layout as the layers of the texture array
+	local size = setting.texture_size
+	local canvas = STATE.atlas_mem:canvas()
+	local atlas = STATE.textures[1]
+	local n = #evicted
+	for _, page in ipairs(evicted) do
+		image.clear(canvas, 0, page * size, size, size)
+		atlas:clear_layer(page)
+	end
+	-- rect has only the new placements, the sprites blitted before stay where they are
+	local placed = {}
+	for id, v in pairs(rect) do
+		n = n + 1
+		if v.page >= setting.atlas_page then
+			error(string.format("Too many atlas pages (%d), raise setting atlas_page", v.page + 1))
+		end
+		local src = image.canvas(v.data, v.w, v.h, v.stride)
+		image.blit(canvas, src, v.x, v.y + v.page * size)
+		-- upload only this rect of the layer
+		atlas:dirty(v.x, v.y, v.w, v.h, v.page)
+		placed[id] = v.page << 32 | v.x << 16 | v.y
+	end
+	if n == 0 then
+		if #dropped > 0 then
+			spritemgr.apply(STATE.bank_ptr, placed, nil, dropped, pages, retry)
+		end
+		return false
+	end
+	delay_update_image(function()
+		atlas:update(STATE.atlas_mem)
+		spritemgr.apply(STATE.bank_ptr, placed, evicted, dropped, pages, retry)
+		pack_done()
+	end)
+	return true
+end
+
+-- sprites drawn but not in the atlas (evicted), pack them again out of the frame.
+-- One pack at a time : the next one starts after the last one is applied
+function request_pack()
+	if STATE.packing then
+		STATE.pack_again = true
+		return
+	end
+	STATE.packing = true
+	STATE.pack_again = false
+	ltask.fork(function()
+		local ok, deferred = pcall(pack_sprites)
+		if not ok then
+			print("PACK ERR", deferred)
+		end
+		if not ok or not deferred then
+			pack_done()
+		end
+	end)
+end
+
 local function frame(count)
 	local batch_size = setting.batch_size
 
@@ -156,31 +393,43 @@ local function frame(count)
 	local batch_n = #batch
 	batch.wait()
 	soluna_app.context_acquire()
-	if update_image then update_image() end
+	update_image()
 	STATE.drawmgr:reset()
+	STATE.staging:reset()
+	if STATE.sr_auto then
+		update_sr_mode()
+	end
 	STATE.bindings:base(0)
+	STATE.text_bindings:base(0)
 	STATE.quad_bindings:base(0)
 	STATE.mask_bindings:base(0)
+	STATE.mesh_bindings:base(0)
+	local dirty_layers = layer_submit()
 	for i = 1, batch_n do
 		local ptr, size = batch[i][1]()
 		if ptr then
 			STATE.drawmgr:append(ptr, size)
 		end
 	end
-	local draw_n = #STATE.drawmgr
-	for i = 1, draw_n do
-		local mat, ptr, n, tex = STATE.drawmgr(i)
-		local obj = materials[mat]
-		obj.submit(ptr, n)
+	STATE.culled, STATE.primitives = STATE.drawmgr:culled()
+	STATE.draw_calls = #STATE.drawmgr
+	STATE.drawmgr:submit()
+	if STATE.drawmgr:frame() then
+		request_pack()
 	end
-	STATE.srbuffer:update(STATE.srbuffer_mem:ptr())
-	STATE.pass:begin()
-		font.submit(STATE.font_texture)
-		for i = 1, draw_n do
-			local mat, ptr, n, tex = STATE.drawmgr(i)
-			local obj = materials[mat]
-			obj.draw(ptr, n, tex)
+	instance_upload()
+	local sr_ptr, sr_size = STATE.srbuffer_mem:ptr()
+	if sr_ptr then
+		if sr_size > STATE.srbuffer_size then
+			-- srbuffer spills into more pages, grow the storage buffer
+			sr_resize(sr_size)
 		end
+		STATE.srbuffer:update(sr_ptr, sr_size)
+	end
+	font.submit(STATE.font_texture)
+	layer_draw(dirty_layers)
+	STATE.pass:begin()
+		STATE.drawmgr:draw()
 	STATE.pass:finish()
 	soluna_app.context_release()
 end
@@ -191,6 +440,7 @@ function S.frame(count)
 		print("RENDER ERR", err)
 	end
 	render.submit()
+	stats.frame()
 	for i = 1, #batch do
 		local ptr, size, token = batch.consume(i)
 		ltask.wakeup(token)
@@ -198,6 +448,116 @@ function S.frame(count)
 	assert(ok, err)
 end
 
+-- primitives culled by viewport in the last frame, and the total primitives
+function S.culled()
+	return STATE.culled, STATE.primitives
+end
+
+-- draw calls in the last frame
+function S.draw_calls()
+	return STATE.draw_calls
+end
+
+function S.draw_sort(enable)
+	STATE.drawmgr:sort(enable)
+end
+
+-- "lut" : scale/rotation matrices in srbuffer, "instance" : in instance data, "auto" : by srbuffer hit rate
+function S.sr_mode(mode)
+	if mode == "auto" then
+		STATE.sr_auto = true
+		set_sr_mode "lut"
+	else
+		STATE.sr_auto = false
+		set_sr_mode(mode)
+	end
+	STATE.srbuffer_mem:hitrate()	-- reset
+	return STATE.sr_mode
+end
+
+-- returns slot and sprite id of a new cached layer, the size is at most texture_size
+function S.layer_new(width, height)
+	local size = setting.texture_size
+	if width <= 0 or width > size or height <= 0 or height > size then
+		error(string.format("Invalid layer size (%d * %d), max %d", width, height, size))
+	end
+	local slot
+	for i = 1, LAYER_MAX do
+		if not layer[i] then
+			slot = i
+			break
+		end
+	end
+	if not slot then
+		error "Too many cached layers"
+	end
+	local texid = LAYER_TEXTURE + slot - 1
+	-- square, the materials scale the sprite uv by one tex_size (set by drawmgr for this texture)
+	local side = math.max(width, height)
+	soluna_app.context_acquire()
+	local img = render.image {
+		width = side,
+		height = side,
+		render_target = true,
+		layers = 1,	-- the materials sample texture arrays
+		label = "cached-layer",
+	}
+	local obj = {
+		texid = texid,
+		size = side,
+		image = img,
+		view = render.view { texture = img },
+		pass = render.pass {
+			color0 = "transparent",
+			target = render.view { attachment = img },
+		},
+		drawmgr = drawmgr.new(STATE.bank_ptr, setting.draw_instance),
+		dirty = false,
+	}
+	layer[slot] = obj
+	init_drawmgr(obj.drawmgr, width, height)
+	-- the layers can be drawn in the main pass and in the other layers
+	STATE.drawmgr:texture(texid, obj.view, side, true)
+	for _, other in pairs(layer) do
+		if other ~= obj then
+			other.drawmgr:texture(texid, obj.view, side, true)
+		end
+	end
+	soluna_app.context_release()
+	local loader = ltask.uniqueservice "loader"
+	local sprite = ltask.call(loader, "layer_sprite", width, height)
+	spritemgr.texture(STATE.bank_ptr, sprite, texid, width, height)
+	obj.sprite = sprite
+	return slot, sprite
+end
+
+-- set the content (a recorded batch segment as string), and redraw the layer in the next frame
+function S.layer_update(slot, stream)
+	local obj = assert(layer[slot], "Invalid layer")
+	obj.stream = stream
+	obj.dirty = true
+end
+
+-- redraw the layer in the next frame with the same content
+function S.layer_dirty(slot)
+	local obj = assert(layer[slot], "Invalid layer")
+	obj.dirty = true
+end
+
+function S.layer_release(slot)
+	local obj = assert(layer[slot], "Invalid layer")
+	layer[slot] = nil
+	-- the sprite is not resident any more, the primitives drawing it are skipped
+	spritemgr.texture(STATE.bank_ptr, obj.sprite)
+	soluna_app.context_acquire()
+	STATE.drawmgr:texture(obj.texid, nil)
+	for _, other in pairs(layer) do
+		other.drawmgr:texture(obj.texid, nil)
+	end
+	obj.image:release()
+	soluna_app.context_release()
+end
+
 S.register_batch = assert(batch.register)
 S.submit_batch = assert(batch.submit)
 
@@ -222,18 +582,28 @@ function S.quit()
 	font.shutdown()
 end
 
+-- the pages of a baked atlas are mapped by the loader, upload them as whole layers,
+-- and place its sprites in the same frame
+local function upload_baked(ptr, first, n, placed, pages)
+	local size = setting.texture_size
+	delay_update_image(function()
+		local atlas = STATE.textures[1]
+		for page = first, first + n - 1 do
+			atlas:dirty(0, 0, size, size, page)
+		end
+		atlas:update(ptr, first, n)
+		spritemgr.apply(STATE.bank_ptr, placed, nil, nil, pages)
+	end)
+end
+
 function S.load_sprites(name)
 	local loader = ltask.uniqueservice "loader"
 	local spr = ltask.call(loader, "loadbundle", name)
-	local rect = ltask.call(loader, "pack")
-
-	local imgmem = image.new(setting.texture_size, setting.texture_size)
-	local canvas = imgmem:canvas()
-	for id, v in pairs(rect) do
-		local src = image.canvas(v.data, v.w, v.h, v.stride)
-		image.blit(canvas, src, v.x, v.y)
+	local ptr, first, n, placed, pages = ltask.call(loader, "baked_pages", name)
+	if ptr then
+		upload_baked(ptr, first, n, placed, pages)
 	end
-	delay_update_image(imgmem)
+	request_pack()
 end
 
 function S.init(arg)
@@ -242,17 +612,19 @@ function S.init(arg)
 
 	local texture_size = setting.texture_size
 
+	-- sprite atlas : all the pages in one texture array, the layer index is in the instance data
+	local atlas_page = setting.atlas_page
+	if atlas_page <= 0 or atlas_page > LAYER_TEXTURE then
+		error(string.format("Invalid atlas_page %d", atlas_page))
+	end
 	local img = render.image {
 		width = texture_size,
 		height = texture_size,
+		layers = atlas_page,
+		region_update = true,
+		label = "sprite-atlas",
 	}
 	
-	local inst_buffer = render.buffer {
-		type = "vertex",
-		usage = "stream",
-		label = "texquad-instance",
-		size = defmat.instance_size * setting.draw_instance,	-- textmat.instance_size is the same
-	}
 	local sr_buffer = render.buffer {
 		type = "storage",
 		usage = "dynamic",
@@ -266,6 +638,7 @@ function S.init(arg)
 		width = font.texture_size,
 		height = font.texture_size,
 		pixel_format = "R8",
+		region_update = true,
 	}
 	local views = {
 		[1] = render.view { texture = img },
@@ -279,55 +652,89 @@ function S.init(arg)
 		},
 		default_sampler = render.sampler { label = "texquad-sampler" },
 		textures = { img } ,
+		atlas_mem = image.new(texture_size, texture_size * atlas_page),
 		font_texture = font_texture,
 		views = views,
+		staging = render.staging(),
+		instance = {},
 	}
+	if setting.encode_thread > 1 then
+		-- default material splits large draw elements across these threads
+		STATE.jobpool = render.jobpool(setting.encode_thread)
+	end
 	local bindings = render.bindings()
-	bindings:vbuffer(0, inst_buffer)
+	instance_buffer(DEFAULT_MAT, "texquad-instance",
+		math.max(defmat.instance_size, defmat.instance_sr_size) * setting.draw_instance, bindings)
 	bindings:view(0, views.storage)
 	bindings:view(1, views[1])
 	bindings:sampler(0, STATE.default_sampler)
 	
-	STATE.inst = assert(inst_buffer)
+	local text_bindings = render.bindings()
+	instance_buffer(TEXT_MAT, "text-instance", textmat.instance_size * setting.draw_instance, text_bindings)
+	text_bindings:view(0, views.storage)
+	text_bindings:view(1, views.font)
+	text_bindings:sampler(0, STATE.default_sampler)
+
 	STATE.srbuffer = assert(sr_buffer)
+	STATE.srbuffer_size = render.buffer_size("srbuffer", setting.srbuffer_size)
 
 	STATE.srbuffer_mem = render.srbuffer(setting.srbuffer_size)
 	STATE.bindings = bindings
+	STATE.text_bindings = text_bindings
 
 	do
-		STATE.quad_inst = render.buffer {
-			type = "vertex",
-			usage = "stream",
-			label = "quad-instance",
-			size = quadmat.instance_size * setting.draw_instance,
-		}
-
 		local quadbind = render.bindings()
-		quadbind:vbuffer(0, STATE.quad_inst)
+		instance_buffer(QUAD_MAT, "quad-instance",
+			math.max(quadmat.instance_size, quadmat.instance_sr_size) * setting.draw_instance, quadbind)
 		quadbind:view(0, views.storage)
 
 		STATE.quad_bindings = quadbind
 	end
 	
 	do
-		STATE.mask_inst = render.buffer {
-			type = "vertex",
-			usage = "stream",
-			label = "mask-instance",
-			size = maskmat.instance_size * setting.draw_instance,
-		}
-
 		local maskbind = render.bindings()
-
-		maskbind:vbuffer(0, STATE.mask_inst)
+		instance_buffer(MASK_MAT, "mask-instance",
+			math.max(maskmat.instance_size, maskmat.instance_sr_size) * setting.draw_instance, maskbind)
 		maskbind:view(0, views.storage)
 		maskbind:view(1, views[1])
 		maskbind:sampler(0, STATE.default_sampler)
 		 		
 		STATE.mask_bindings = maskbind
 	end
+
+	do
+		-- tile rects of each layer are in storage buffers owned by the material, no instance buffer
+		local tilebind = render.bindings()
+		tilebind:sampler(0, STATE.default_sampler)
+
+		STATE.tilemap_bindings = tilebind
+	end
+
+	do
+		-- particles are computed from gl_InstanceIndex, no instance buffer
+		local particlebind = render.bindings()
+		particlebind:sampler(0, STATE.default_sampler)
+
+		STATE.particle_bindings = particlebind
+	end
+
+	do
+		-- vertices and indices of all meshes in this frame, base counts indices
+		local meshbind = render.bindings()
+		instance_buffer(MESH_MAT, "mesh-vertex", meshmat.vertex_size * setting.draw_instance, meshbind)
+		instance_buffer(MESH_INDEX, "mesh-index", 4 * setting.draw_instance, meshbind, "index")
+		meshbind:sampler(0, STATE.default_sampler)
+
+		STATE.mesh_bindings = meshbind
+	end
 	
 	STATE.drawmgr = drawmgr.new(arg.bank_ptr, setting.draw_instance)
+	STATE.bank_ptr = arg.bank_ptr
+	STATE.width = arg.width
+	STATE.height = arg.height
+	STATE.culled = 0
+	STATE.primitives = 0
+	STATE.draw_calls = 0
 	
 	STATE.uniform = render.uniform {
 		12,	-- size
@@ -345,15 +752,18 @@ function S.init(arg)
 	STATE.uniform.tex_size = 1/texture_size
 
 	STATE.material = defmat.new {
-		inst_buffer = STATE.inst,
+		staging = STATE.staging,
+		lane = DEFAULT_MAT,
 		bindings = STATE.bindings,
 		uniform = STATE.uniform,
 		sr_buffer = STATE.srbuffer_mem,
 		sprite_bank = arg.bank_ptr,
+		jobpool = STATE.jobpool,
 	}
 
 	STATE.material_mask = maskmat.new {
-		inst_buffer = STATE.mask_inst,
+		staging = STATE.staging,
+		lane = MASK_MAT,
 		bindings = STATE.mask_bindings,
 		uniform = STATE.uniform,
 		sr_buffer = STATE.srbuffer_mem,
@@ -361,24 +771,52 @@ function S.init(arg)
 	}
 	
 	STATE.material_text = textmat.normal {
-		inst_buffer = STATE.inst,
-		bindings = STATE.bindings,
+		staging = STATE.staging,
+		lane = TEXT_MAT,
+		bindings = STATE.text_bindings,
 		uniform = STATE.uniform,
 		sr_buffer = STATE.srbuffer_mem,
 		font_manager = font.cobj,
 	}
 
 	STATE.material_quad = quadmat.new {
-		inst_buffer = STATE.quad_inst,
+		staging = STATE.staging,
+		lane = QUAD_MAT,
 		bindings = STATE.quad_bindings,
 		uniform = STATE.uniform,
 		sr_buffer = STATE.srbuffer_mem,
 	}
+
+	STATE.material_tilemap = tilemat.new {
+		bindings = STATE.tilemap_bindings,
+		uniform = STATE.uniform,
+		sprite_bank = arg.bank_ptr,
+	}
+	STATE.material_particle = particlemat.new {
+		bindings = STATE.particle_bindings,
+		uniform = STATE.uniform,
+		sprite_bank = arg.bank_ptr,
+	}
+	STATE.material_mesh = meshmat.new {
+		staging = STATE.staging,
+		lane = MESH_MAT,
+		index_lane = MESH_INDEX,
+		bindings = STATE.mesh_bindings,
+		uniform = STATE.uniform,
+		sprite_bank = arg.bank_ptr,
+	}
+	init_drawmgr(STATE.drawmgr, arg.width, arg.height)
+	S.sr_mode(setting.sr_mode)
 	soluna_app.context_release()
 end
 
 function S.resize(w, h)
+	STATE.width = w
+	STATE.height = h
 	STATE.uniform.framesize = { 2/w, -2/h }
+	if setting.viewport_cull then
+		STATE.drawmgr:viewport(w, h, setting.cull_margin)
+	end
 end
 
 return S
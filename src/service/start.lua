@@ -72,6 +72,9 @@ local function init(arg)
 	arg.app.bank_ptr = ltask.call(loader, "init", {
 		max_sprite = setting.sprite_max,
 		texture_size = setting.texture_size,
+		atlas_page = setting.atlas_page,
+		atlas_keep_frame = setting.atlas_keep_frame,
+		decode_thread = setting.decode_thread,
 	})
 	
 	local entry = setting.entry
@@ -93,7 +96,9 @@ local function init(arg)
 			pre_size = nil
 		end
 		
-		local batch = spritemgr.newbatch()
+		-- batch is buffered, the logic fills the next buffer while render consumes the previous one
+		local depth = setting.frame_pipeline
+		local batch = spritemgr.newbatch(depth)
 		cleanup:add(function()
 			batch:release()
 		end)
@@ -125,15 +130,50 @@ local function init(arg)
 		
 		local batch_id = ltask.call(render, "register_batch", ltask.self())
 
-		local function frame(count)
+		local traceback = debug.traceback
+		local pending = 0	-- submitted batches not rendered yet
+
+		local function logic(count)
 			batch:reset()
 			frame_cb(count)
 			ltask.send(render, "submit_batch", batch_id, batch:ptr())
+			pending = pending + 1
+		end
+
+		local function frame(count)
+			if pending == 0 then
+				-- the first frame (or frame_pipeline = 1) runs the logic and renders it serially, so it's presented
+				logic(count)
+				ltask.call(render, "frame", count)
+				pending = pending - 1
+				-- fill the pipeline with the same batch, the next frames render it again while the logic runs
+				for _ = 2, depth do
+					ltask.send(render, "submit_batch", batch_id, batch:ptr())
+					pending = pending + 1
+				end
+				return
+			end
+			-- render the previous batch while running the logic of this frame
+			local done, err, token
+			ltask.fork(function()
+				local ok, msg = xpcall(logic, traceback, count)
+				done = true
+				err = not ok and msg
+				if token then
+					ltask.wakeup(token)
+				end
+			end)
 			ltask.call(render, "frame", count)
+			pending = pending - 1
+			if not done then
+				token = ltask.current_token()
+				ltask.wait()
+			end
+			if err then
+				error(err)
+			end
 		end
 		
-		local traceback = debug.traceback
-		
 		function app.frame(count)
 			local ok, err = xpcall(frame, traceback, count)
 			event.trigger(ev.frame)
@@ -0,0 +1,107 @@
+#ifndef soluna_snapshot_h
+#define soluna_snapshot_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// Immutable data shared by the service which builds it and the render service.
+// The owner (a userdata) publishes a new snapshot into its slot when the data is changed, and never changes
+// a published one. A primitive in the batch stream refers to (slot, serial) instead of the userdata,
+// the render service holds a reference of the snapshot while reading it.
+// A collected owner clears its slot, its primitives get no snapshot.
+
+struct snapshot {
+	atomic_int ref;
+	// data follows
+};
+
+struct snapshot_slot {
+	atomic_flag lock;
+	uint32_t serial;	// 0 : unused
+	struct snapshot *data;
+};
+
+static inline void
+snapshot_lock(struct snapshot_slot *s) {
+	while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire)) {}
+}
+
+static inline void
+snapshot_unlock(struct snapshot_slot *s) {
+	atomic_flag_clear_explicit(&s->lock, memory_order_release);
+}
+
+// sz includes struct snapshot, the reference is owned by the caller
+static inline struct snapshot *
+snapshot_new(size_t sz) {
+	struct snapshot *s = (struct snapshot *)malloc(sz);
+	if (s)
+		atomic_init(&s->ref, 1);
+	return s;
+}
+
+static inline void
+snapshot_release(struct snapshot *s) {
+	if (s && atomic_fetch_sub_explicit(&s->ref, 1, memory_order_acq_rel) == 1)
+		free(s);
+}
+
+// the current snapshot of (slot, serial) with a new reference, NULL if the owner is collected
+static inline struct snapshot *
+snapshot_acquire(struct snapshot_slot *slots, int max, uint32_t slot, uint32_t serial) {
+	if (slot >= (uint32_t)max || serial == 0)
+		return NULL;
+	struct snapshot_slot *s = &slots[slot];
+	struct snapshot *data = NULL;
+	snapshot_lock(s);
+	if (s->serial == serial && s->data) {
+		data = s->data;
+		atomic_fetch_add_explicit(&data->ref, 1, memory_order_relaxed);
+	}
+	snapshot_unlock(s);
+	return data;
+}
+
+// replace the snapshot of the slot, the slot takes the reference of data
+static inline void
+snapshot_publish(struct snapshot_slot *s, struct snapshot *data) {
+	snapshot_lock(s);
+	struct snapshot *old = s->data;
+	s->data = data;
+	snapshot_unlock(s);
+	snapshot_release(old);
+}
+
+// an unused slot for serial (not 0), -1 if all are used. *next is the round robin hint
+static inline int
+snapshot_slot_alloc(struct snapshot_slot *slots, int max, atomic_int *next, uint32_t serial) {
+	int start = atomic_fetch_add(next, 1);
+	int i;
+	for (i=0;i<max;i++) {
+		int slot = (int)((unsigned)(start + i) % (unsigned)max);
+		struct snapshot_slot *s = &slots[slot];
+		snapshot_lock(s);
+		if (s->serial == 0) {
+			s->serial = serial;
+			s->data = NULL;
+			snapshot_unlock(s);
+			return slot;
+		}
+		snapshot_unlock(s);
+	}
+	return -1;
+}
+
+// the render service may still hold a reference of the snapshot, it's freed after that
+static inline void
+snapshot_slot_free(struct snapshot_slot *s) {
+	snapshot_lock(s);
+	struct snapshot *old = s->data;
+	s->data = NULL;
+	s->serial = 0;
+	snapshot_unlock(s);
+	snapshot_release(old);
+}
+
+#endif
@@ -78,6 +78,22 @@ sprite_set_sr(struct draw_primitive *p, float scale, float rot) {
 	p->sr = convert_scale_(scale) << 12 | convert_rot_(rot);
 }
 
+// decode sr for the instance sr mode (scale and rotation in instance data)
+static inline void
+sprite_sr_decode(uint32_t sr, float *scale, float *rot) {
+	uint32_t scale_fix = sr >> 12;
+	float s = 1.0f;
+	if (scale_fix != 0) {
+		if (scale_fix >= 0xff000) {
+			s = (float)(scale_fix & 0xfff) * (1.0f / 4096.0f);
+		} else {
+			s = (float)scale_fix * (1.0f / 256.0f) + 1.0f;
+		}
+	}
+	*scale = s;
+	*rot = (float)(sr & 0xfff) * (3.1415927f / 2048.0f);
+}
+
 static inline void
 sprite_apply_scale(struct draw_primitive *p, uint32_t scale_fix12) {
 	uint32_t scale_fix = p->sr >> 12;
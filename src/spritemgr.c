@@ -2,6 +2,8 @@
 #include "sprite_submit.h"
 #include "batch.h"
 #include "transform.h"
+#include "material_util.h"
+#include "stats.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -9,9 +11,10 @@
 #include <lauxlib.h>
 
 #define DEFAULT_TEXTURE_SIZE 4096
+#define DEFAULT_KEEP_FRAME 600
 #define INVALID_TEXTUREID 0xffff
-
-#define MAX_NODE 8192
+#define NO_PAGE 0xff
+#define EXTERNAL_PAGE 0xfe	// bound to an external texture, never packed
 
 #define STB_RECT_PACK_IMPLEMENTATION
 #include "stb/stb_rect_pack.h"
@@ -50,89 +53,287 @@ lbank_touch(lua_State *L) {
 	return 0;
 }
 
+// skyline state of each atlas page, kept across bank:pack() so placed sprites never move
+struct atlas_page {
+	stbrp_context ctx;
+	stbrp_node node[1];	// texture_size nodes
+};
+
+struct atlas_packer {
+	int n;
+	int fixed;	// pages [0, fixed) are baked (bank:place), never packed into nor evicted
+	int max_page;	// budget, reuse the least recently used page beyond it
+	int keep_frame;	// a page is reused only if its sprites are untouched for keep_frame frames
+	struct atlas_page *page[ATLAS_PAGE_MAX];
+	// page of each sprite placed by pack() or place(), NO_PAGE : not placed, EXTERNAL_PAGE : see bank:texture().
+	// The packer never writes the sprite rects, they are shared with the render service (see spritemgr.apply)
+	uint8_t page_of[1];
+};
+
 static int
-pack_sprite(struct sprite_bank *b, stbrp_context *ctx, stbrp_node *tmp, stbrp_rect *srect, int from, int reserved, int *reserved_n) {
-	int current_frame = b->current_frame;
-	int last_texid = b->texture_n;
-	
-	stbrp_init_target(ctx, b->texture_size, b->texture_size, tmp, MAX_NODE);
+lpacker_gc(lua_State *L) {
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, 1);
+	int i;
+	for (i=0;i<P->n;i++) {
+		free(P->page[i]);
+		P->page[i] = NULL;
+	}
+	P->n = 0;
+	return 0;
+}
+
+static struct atlas_page *
+new_page(struct atlas_packer *P, int texture_size) {
+	if (P->n >= ATLAS_PAGE_MAX)
+		return NULL;
+	struct atlas_page *page = (struct atlas_page *)malloc(sizeof(*page) + (texture_size - 1) * sizeof(stbrp_node));
+	if (page == NULL)
+		return NULL;
+	stbrp_init_target(&page->ctx, texture_size, texture_size, page->node, texture_size);
+	P->page[P->n++] = page;
+	return page;
+}
+
+// place srect[0, n) into the page, returns the number of rects left (moved to the front).
+// the placements are added into the table at index placed
+static int
+pack_page(lua_State *L, struct atlas_packer *P, int placed, int texid, stbrp_rect *srect, int n) {
+	stbrp_pack_rects(&P->page[texid]->ctx, srect, n);
+	int i;
+	int left = 0;
+	for (i=0;i<n;i++) {
+		stbrp_rect * sr = &srect[i];
+		if (sr->was_packed) {
+			P->page_of[sr->id] = texid;
+			uint64_t v = (uint64_t)texid << 32 | (uint64_t)sr->x << 16 | sr->y;
+			lua_pushinteger(L, v);
+			lua_rawseti(L, placed, sr->id + 1);
+		} else {
+			srect[left++] = *sr;
+		}
+	}
+	return left;
+}
+
+// frames since a sprite of each page is touched
+static void
+page_age(struct sprite_bank *b, struct atlas_packer *P, uint16_t age[ATLAS_PAGE_MAX]) {
+	uint16_t current = b->current_frame;
+	int i;
+	for (i=0;i<P->n;i++) {
+		age[i] = 0xffff;
+	}
+	for (i=0;i<b->n;i++) {
+		int p = P->page_of[i];
+		if (p < P->n) {
+			uint16_t a = current - b->rect[i].frame;
+			if (a < age[p])
+				age[p] = a;
+		}
+	}
+}
+
+// frames to wait before a page can be evicted, when the budget is reached
+static int
+retry_wait(struct sprite_bank *b, struct atlas_packer *P) {
+	uint16_t age[ATLAS_PAGE_MAX];
+	page_age(b, P, age);
+	int wait = P->keep_frame;
+	int i;
+	for (i=P->fixed;i<P->n;i++) {
+		int w = P->keep_frame - age[i];
+		if (w < wait)
+			wait = w;
+	}
+	return wait < 1 ? 1 : wait;
+}
+
+// evict all the sprites of the least recently used page, and reset its skyline.
+// returns the page, or -1 if every page is busy or touched in the last keep_frame frames
+static int
+evict_page(struct sprite_bank *b, struct atlas_packer *P, const uint8_t *busy) {
+	uint16_t age[ATLAS_PAGE_MAX];
+	page_age(b, P, age);
+	int i;
+	int page = -1;
+	int oldest = P->keep_frame - 1;
+	for (i=P->fixed;i<P->n;i++) {
+		if (!busy[i] && age[i] > oldest) {
+			oldest = age[i];
+			page = i;
+		}
+	}
+	if (page < 0)
+		return -1;
+	for (i=0;i<b->n;i++) {
+		if (P->page_of[i] == page)
+			P->page_of[i] = NO_PAGE;
+	}
+	struct atlas_page *p = P->page[page];
+	stbrp_init_target(&p->ctx, b->texture_size, b->texture_size, p->node, b->texture_size);
+	stats_add(STATS_ATLAS_EVICT, 1);
+	return page;
+}
+
+// bank:pack() places the sprites touched since the last pack, the sprites already placed never move.
+// returns the new placements { [id] = texid << 32 | x << 16 | y }, the list of pages evicted (to be cleared),
+// the list of sprites over budget, the number of pages in use and the frames to wait before packing the ones over budget again.
+// Nothing is changed in the sprite rects, publish the result with spritemgr.apply() after the pixels are uploaded
+static int
+lbank_pack(lua_State *L) {
+	struct sprite_bank *b = (struct sprite_bank *)luaL_checkudata(L, 1, "SOLUNA_SPRITEBANK");
+	lua_settop(L, 1);
+	lua_getiuservalue(L, 1, 1);
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	stbrp_rect * srect = malloc(sizeof(*srect) * b->n);
+	if (srect == NULL)
+		return luaL_error(L, "pack : Out of memory");
+	int n = 0;
 	int i;
-	int rect_i = reserved;
-	for (i=from;i<b->n;i++) {
+	for (i=0;i<b->n;i++) {
 		struct sprite_rect *rect = &b->rect[i];
-		if ((rect->texid == 0 || rect->texid == last_texid) && rect->frame == current_frame) {
-			stbrp_rect * sr = &srect[rect_i++];
+		// skip the ones placed but not applied yet
+		if (rect->texid == PENDING_TEXTUREID && P->page_of[i] == NO_PAGE) {
+			stbrp_rect * sr = &srect[n++];
 			sr->id = i;
 			// reserve 1 pixel border
 			sr->w = (rect->u + 1) & 0xffff;
 			sr->h = (rect->v + 1) & 0xffff;
 		}
 	}
-	if (stbrp_pack_rects(ctx, srect, rect_i)) {
-		// succ
-		int j;
-		for (j=0;j<rect_i;j++) {
-			stbrp_rect * sr = &srect[j];
-			struct sprite_rect *rect = &b->rect[sr->id];
-			rect->u = sr->x << 16 | (sr->w - 1);
-			rect->v = sr->y << 16 | (sr->h - 1);
-			rect->texid = last_texid;
-		}
-		*reserved_n = 0;
-	} else {
-		// pack a part
-		int j;
-		int n = 0;
-		for (j=0;j<rect_i;j++) {
-			stbrp_rect * sr = &srect[j];
-			struct sprite_rect *rect = &b->rect[sr->id];
-			if (sr->was_packed) {
-				rect->u = sr->x << 16 | (sr->w - 1);
-				rect->v = sr->y << 16 | (sr->h - 1);
-				rect->texid = last_texid;
-			} else {
-				stbrp_rect * tmp = &srect[n];
-				tmp->w = sr->w;
-				tmp->h = sr->h;
-				tmp->id = sr->id;
-				++n;
+	uint8_t busy[ATLAS_PAGE_MAX];	// pages placed in this pack, never evicted
+	memset(busy, 0, sizeof(busy));
+	lua_createtable(L, 0, n);	// 2 : placements
+	lua_newtable(L);	// 3 : evicted pages
+	lua_newtable(L);	// 4 : sprites over budget
+	// first fit into the pages in use
+	int texid;
+	for (texid = P->fixed; texid < P->n && n > 0; texid++) {
+		int left = pack_page(L, P, 2, texid, srect, n);
+		if (left < n)
+			busy[texid] = 1;
+		n = left;
+	}
+	// then open new pages, or reuse the least recently used one when the budget is reached
+	while (n > 0) {
+		if (P->n < P->max_page) {
+			if (new_page(P, b->texture_size) == NULL) {
+				free(srect);
+				return luaL_error(L, "pack : Out of memory");
 			}
+			texid = P->n - 1;
+		} else {
+			texid = evict_page(b, P, busy);
+			if (texid < 0) {
+				// over budget, the rest stay pending until a page ages out (see spritemgr.apply)
+				int j;
+				for (j=0;j<n;j++) {
+					lua_pushinteger(L, srect[j].id + 1);
+					lua_rawseti(L, 4, j + 1);
+				}
+				break;
+			}
+			lua_pushinteger(L, texid);
+			lua_rawseti(L, 3, lua_rawlen(L, 3) + 1);
+		}
+		busy[texid] = 1;
+		int left = pack_page(L, P, 2, texid, srect, n);
+		if (left == n) {
+			stbrp_rect sr = srect[0];
+			free(srect);
+			return luaL_error(L, "Sprite %d (%d * %d) is larger than the atlas page", sr.id + 1, sr.w - 1, sr.h - 1);
 		}
-		*reserved_n = n;
+		n = left;
 	}
-	return i;
+	free(srect);
+	stats_add(STATS_ATLAS_REPACK, 1);
+	lua_pushinteger(L, P->n);
+	lua_pushinteger(L, lua_rawlen(L, 4) > 0 ? retry_wait(b, P) : 0);
+	return 5;
 }
 
+// bank:texture(id) reserves the sprite for an external texture (a render target), it's never packed into the atlas.
+// The render service binds it with spritemgr.texture()
 static int
-lbank_pack(lua_State *L) {
+lbank_texture(lua_State *L) {
 	struct sprite_bank *b = (struct sprite_bank *)luaL_checkudata(L, 1, "SOLUNA_SPRITEBANK");
-	if (b->texture_ready) {
-		++b->current_frame;
-		return 0;
-	}
+	int id = luaL_checkinteger(L, 2) - 1;
+	if (id < 0 || id >= b->n)
+		return luaL_error(L, "Invalid sprite id %d", id + 1);
+	lua_getiuservalue(L, 1, 1);
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, -1);
+	if (P->page_of[id] != NO_PAGE && P->page_of[id] != EXTERNAL_PAGE)
+		return luaL_error(L, "Sprite %d is in the atlas", id + 1);
+	P->page_of[id] = EXTERNAL_PAGE;
+	return 0;
+}
 
-	stbrp_context ctx;
-	stbrp_node tmp[MAX_NODE];
-	stbrp_rect * rect = malloc(sizeof(*rect) * b->n);
-
-	int texture = b->texture_n;
-	int from = 0;
-	int reserved = 0;
-	for (;;) {
-		from = pack_sprite(b, &ctx, tmp, rect, from, reserved, &reserved);
-		if (reserved == 0 && from >= b->n) {
-			break;
-		}
-		++b->texture_n;
+// bank:residency(max_page [, keep_frame]) sets the atlas budget.
+// Beyond max_page pages, pack() reuses the least recently used page whose sprites are untouched for keep_frame frames,
+// the evicted sprites are packed again when they are touched (drawn), the ones over budget when a page ages out.
+static int
+lbank_residency(lua_State *L) {
+	luaL_checkudata(L, 1, "SOLUNA_SPRITEBANK");
+	int max_page = luaL_checkinteger(L, 2);
+	int keep_frame = luaL_optinteger(L, 3, DEFAULT_KEEP_FRAME);
+	if (max_page <= 0 || max_page > ATLAS_PAGE_MAX)
+		return luaL_error(L, "Invalid max page %d", max_page);
+	// frame stamps are 16 bits
+	if (keep_frame <= 0 || keep_frame > 0x7fff)
+		return luaL_error(L, "Invalid keep frame %d", keep_frame);
+	lua_getiuservalue(L, 1, 1);
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, -1);
+	P->max_page = max_page;
+	P->keep_frame = keep_frame;
+	return 0;
+}
+
+// bank:place(id, page, x, y) reserves (x, y) of a baked page for the sprite, returns the placement
+// (page << 32 | x << 16 | y) for spritemgr.apply(), after the page is uploaded. Limits :
+// the pages of baked atlases come before the packed ones, so load baked atlases before the first bank:pack(),
+// and the baked pages count in the budget (setting atlas_page, see bank:residency)
+static int
+lbank_place(lua_State *L) {
+	struct sprite_bank *b = (struct sprite_bank *)luaL_checkudata(L, 1, "SOLUNA_SPRITEBANK");
+	int id = luaL_checkinteger(L, 2) - 1;
+	if (id < 0 || id >= b->n)
+		return luaL_error(L, "Invalid sprite id %d", id);
+	int page = luaL_checkinteger(L, 3);
+	int x = luaL_checkinteger(L, 4);
+	int y = luaL_checkinteger(L, 5);
+	lua_getiuservalue(L, 1, 1);
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (page < 0)
+		return luaL_error(L, "Invalid page %d", page);
+	if (page >= P->max_page)
+		return luaL_error(L, "Too many atlas pages (%d) for baked sprites, raise setting atlas_page", page + 1);
+	if (page >= P->fixed) {
+		if (P->n > P->fixed)
+			return luaL_error(L, "Load baked atlases before the first packed bundle (%d pages packed)", P->n - P->fixed);
+		P->fixed = P->n = page + 1;
 	}
-	free(rect);
-	b->texture_ready = 1;
-	
-	lua_pushinteger(L, texture);
-	lua_pushinteger(L, b->texture_n - texture + 1);
+	struct sprite_rect *r = &b->rect[id];
+	int w = r->u & 0xffff;
+	int h = r->v & 0xffff;
+	if (x < 0 || y < 0 || x + w > b->texture_size || y + h > b->texture_size)
+		return luaL_error(L, "Invalid sprite rect (%d, %d, %d, %d)", x, y, w, h);
+	P->page_of[id] = page;
+	uint64_t v = (uint64_t)page << 32 | (uint64_t)x << 16 | y;
+	lua_pushinteger(L, v);
+	return 1;
+}
 
-	++b->current_frame;
-	return 2;
+// returns the atlas pages in use (baked and packed)
+static int
+lbank_pages(lua_State *L) {
+	luaL_checkudata(L, 1, "SOLUNA_SPRITEBANK");
+	lua_getiuservalue(L, 1, 1);
+	struct atlas_packer *P = (struct atlas_packer *)lua_touserdata(L, -1);
+	lua_pushinteger(L, P->n);
+	return 1;
 }
 
 static int
@@ -165,20 +366,29 @@ static int
 lsprite_newbank(lua_State *L) {
 	int cap = luaL_checkinteger(L, 1);
 	int texture_size = luaL_optinteger(L, 2, DEFAULT_TEXTURE_SIZE);
-	struct sprite_bank *b = (struct sprite_bank *)lua_newuserdatauv(L, sizeof(*b) + (cap-1) * sizeof(b->rect[0]), 0);
+	struct sprite_bank *b = (struct sprite_bank *)lua_newuserdatauv(L, sizeof(*b) + (cap-1) * sizeof(b->rect[0]), 1);
 	b->n = 0;
 	b->cap = cap;
 	b->texture_size = texture_size;
 	b->texture_n = 0;
 	b->current_frame = 0;
+	b->pack_version = 0;
 	b->texture_ready = 0;
+	b->retry = 0;
+	b->retry_frame = 0;
+	b->evict_version = 0;
+	memset(b->page_evict, 0, sizeof(b->page_evict));
 	
 	if (luaL_newmetatable(L, "SOLUNA_SPRITEBANK")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
 			{ "add", lbank_add },
 			{ "touch", lbank_touch },
+			{ "texture", lbank_texture },
 			{ "pack", lbank_pack },
+			{ "residency", lbank_residency },
+			{ "place", lbank_place },
+			{ "pages", lbank_pages },
 			{ "altas", lbank_altas },
 			{ "ptr", lbank_ptr },
 			{ NULL, NULL },
@@ -189,6 +399,18 @@ lsprite_newbank(lua_State *L) {
 		lua_setfield(L, -2, "__index");
 	}
 	lua_setmetatable(L, -2);
+
+	struct atlas_packer *P = (struct atlas_packer *)lua_newuserdatauv(L, sizeof(*P) + cap - 1, 0);
+	memset(P, 0, sizeof(*P));
+	memset(P->page_of, NO_PAGE, cap);
+	P->max_page = ATLAS_PAGE_MAX;
+	P->keep_frame = DEFAULT_KEEP_FRAME;
+	if (luaL_newmetatable(L, "SOLUNA_ATLAS_PACKER")) {
+		lua_pushcfunction(L, lpacker_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_setiuservalue(L, -2, 1);
 	
 	return 1;
 }
@@ -200,20 +422,40 @@ struct layer {
 	float y;
 };
 
+#define MAX_PIPELINE 4
+
 struct batch {
 	int n;
+	int depth;
+	int current;
 	int layer;
 	int layer_cap;
+	int record_from;	// -1 : not recording
+	int record_layer;
 	struct transform trans;
+	struct transform record_trans;
 	struct draw_batch *b;
 	struct layer *stack;
+	struct draw_batch *buffer[MAX_PIPELINE];
+};
+
+struct batch_segment {
+	int n;
+	struct draw_primitive stream[1];
 };
 
 static int
 lbatch_reset(lua_State *L) {
 	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
+	if (b->b == NULL)
+		return luaL_error(L, "Batch released");
+	// switch to the next buffer, the previous ones may still be in the render pipeline
+	b->current = (b->current + 1) % b->depth;
+	b->b = b->buffer[b->current];
 	b->n = 0;
 	b->layer = 0;
+	b->record_from = -1;
+	b->record_layer = 0;
 	sprite_transform_identity(&b->trans);
 	return 0;
 }
@@ -222,8 +464,11 @@ static int
 lbatch_release(lua_State *L) {
 	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
 	b->n = 0;
-	b->n = 0;
-	batch_delete(b->b);
+	int i;
+	for (i=0;i<b->depth;i++) {
+		batch_delete(b->buffer[i]);
+		b->buffer[i] = NULL;
+	}
 	b->b = NULL;
 	return 0;
 }
@@ -325,13 +570,65 @@ lbatch_add(lua_State *L) {
 	float x = luaL_optnumber(L, 3, 0);
 	float y = luaL_optnumber(L, 4, 0);
 	
+	sprite_transform_stream(p, n, 2, to_fixpoint_(x), to_fixpoint_(y), &b->trans);
+	return 0;
+}
+
+struct sprite_record {
+	int32_t sprite;
+	float x;
+	float y;
+	float scale;
+	float rot;
+};
+
+static int
+lbatch_add_array(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
+	const struct sprite_record *rec;
+	size_t sz;
+	switch (lua_type(L, 2)) {
+	case LUA_TSTRING:
+		rec = (const struct sprite_record *)lua_tolstring(L, 2, &sz);
+		break;
+	case LUA_TUSERDATA:
+		rec = (const struct sprite_record *)lua_touserdata(L, 2);
+		sz = lua_rawlen(L, 2);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		rec = (const struct sprite_record *)lua_touserdata(L, 2);
+		sz = (size_t)luaL_checkinteger(L, 3) * sizeof(struct sprite_record);
+		break;
+	default:
+		return luaL_error(L, "Invalid type %s", lua_typename(L, lua_type(L, 2)));
+	}
+	int count = sz / sizeof(struct sprite_record);
+	if (lua_isinteger(L, 3)) {
+		int n = lua_tointeger(L, 3);
+		if (n < 0 || n > count)
+			return luaL_error(L, "Invalid sprite count %d (max %d)", n, count);
+		count = n;
+	}
+	if (count == 0)
+		return 0;
+	int n = b->n;
+	struct draw_primitive * p = batch_reserve(b->b, n + count);
+	if (p == NULL)
+		return luaL_error(L, "batch_add_array : Out of memory n = %d count = %d", n, count);
+	p += n;
 	int i;
-	
-	for (i=0;i<n;i++) {
-		sprite_apply_xy(p, x, y);
-		sprite_transform_apply(p, &b->trans);
-		p+=2;
+	for (i=0;i<count;i++) {
+		const struct sprite_record *r = &rec[i];
+		if (r->sprite <= 0)
+			return luaL_error(L, "Invalid sprite id %d at %d", r->sprite, i + 1);
+		if (!(r->scale >= 0))
+			return luaL_error(L, "Invalid sprite scale %f at %d", r->scale, i + 1);
+		p[i].sprite = r->sprite;
+		sprite_set_xy(&p[i], r->x, r->y);
+		sprite_set_sr(&p[i], r->scale, r->rot);
 	}
+	sprite_transform_stream(p, count, 1, 0, 0, &b->trans);
+	b->n = n + count;
 	return 0;
 }
 
@@ -351,10 +648,10 @@ lbatch_ptr(lua_State *L) {
 
 static void
 layer_close(lua_State *L, struct batch *b) {
-	if (b->layer <= 0)
+	if (b->layer <= b->record_layer)
 		luaL_error(L, "none layer to close");
-	if (b->layer == 1) {
-		b->layer = 0;
+	if (b->layer == b->record_layer + 1) {
+		b->layer = b->record_layer;
 		sprite_transform_identity(&b->trans);
 	} else {
 		--b->layer;
@@ -443,7 +740,7 @@ lbatch_layer(lua_State *L) {
 	}
 	if (new_layer->s == 0)
 		luaL_error(L, "Scale can't be 0");
-	if (b->layer > 1) {
+	if (b->layer > b->record_layer + 1) {
 		layer_merge(new_layer, new_layer-1);
 	}
 	sprite_transform_set(&b->trans, new_layer->s, new_layer->r, new_layer->x, new_layer->y);
@@ -471,15 +768,133 @@ lbatch_point(lua_State *L) {
 	return 2;
 }
 
+// primitives in a batch are mixed : sprite takes 1 slot, material takes 2 slots
+static void
+transform_segment(struct draw_primitive *p, int n, int32_t dx, int32_t dy, struct transform *t) {
+	int i = 0;
+	while (i < n) {
+		int from = i;
+		if (p[i].sprite > 0) {
+			do ++i; while (i < n && p[i].sprite > 0);
+			sprite_transform_stream(&p[from], i - from, 1, dx, dy, t);
+		} else if (p[i].sprite == -MATERIAL_ZKEY) {
+			i += 2;
+		} else {
+			do i += 2; while (i < n && p[i].sprite <= 0 && p[i].sprite != -MATERIAL_ZKEY);
+			sprite_transform_stream(&p[from], (i - from) / 2, 2, dx, dy, t);
+		}
+	}
+}
+
+// batch:zkey(z) : the following primitives use z as the sort key, see drawmgr:sort()
+static int
+lbatch_zkey(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
+	int z = luaL_checkinteger(L, 2);
+	int n = b->n;
+	struct draw_primitive * p = batch_reserve(b->b, n + 2);
+	if (p == NULL)
+		return luaL_error(L, "batch_zkey : Out of memory, n = %d", n);
+	p += n;
+	p[0].x = z;
+	p[0].y = 0;
+	p[0].sr = 0;
+	p[0].sprite = -MATERIAL_ZKEY;
+	memset(&p[1], 0, sizeof(p[1]));
+	b->n = n + 2;
+	return 0;
+}
+
+static int
+lbatch_record(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
+	if (b->record_from < 0) {
+		// begin recording, primitives are recorded in local space
+		b->record_from = b->n;
+		b->record_layer = b->layer;
+		b->record_trans = b->trans;
+		sprite_transform_identity(&b->trans);
+		return 0;
+	}
+	if (b->layer != b->record_layer)
+		return luaL_error(L, "Unclosed layer in record (%d)", b->layer - b->record_layer);
+	int from = b->record_from;
+	int n = b->n - from;
+	struct batch_segment *seg = (struct batch_segment *)lua_newuserdatauv(L, sizeof(*seg) + (n - 1) * sizeof(seg->stream[0]), 0);
+	seg->n = n;
+	if (n > 0) {
+		struct draw_primitive *p = batch_reserve(b->b, 0);
+		memcpy(seg->stream, p + from, n * sizeof(seg->stream[0]));
+	}
+	// recorded primitives are not drawn, use replay
+	b->n = from;
+	b->trans = b->record_trans;
+	b->record_from = -1;
+	b->record_layer = 0;
+	luaL_setmetatable(L, "SOLUNA_BATCH_SEGMENT");
+	return 1;
+}
+
+static int
+lbatch_replay(lua_State *L) {
+	struct batch *b = (struct batch *)luaL_checkudata(L, 1, "SOLUNA_BATCH");
+	struct batch_segment *seg = (struct batch_segment *)luaL_checkudata(L, 2, "SOLUNA_BATCH_SEGMENT");
+	float x = luaL_optnumber(L, 3, 0);
+	float y = luaL_optnumber(L, 4, 0);
+	int n = b->n;
+	if (seg->n == 0)
+		return 0;
+	struct draw_primitive * p = batch_reserve(b->b, n + seg->n);
+	if (p == NULL)
+		return luaL_error(L, "batch_replay : Out of memory n = %d count = %d", n, seg->n);
+	p += n;
+	memcpy(p, seg->stream, seg->n * sizeof(seg->stream[0]));
+	b->n = n + seg->n;
+	transform_segment(p, seg->n, to_fixpoint_(x), to_fixpoint_(y), &b->trans);
+	return 0;
+}
+
+static int
+lbatch_segment_len(lua_State *L) {
+	struct batch_segment *seg = (struct batch_segment *)lua_touserdata(L, 1);
+	lua_pushinteger(L, seg->n);
+	return 1;
+}
+
+// segment:data() returns the stream as a string, to send it to the render service
+static int
+lbatch_segment_data(lua_State *L) {
+	struct batch_segment *seg = (struct batch_segment *)luaL_checkudata(L, 1, "SOLUNA_BATCH_SEGMENT");
+	lua_pushlstring(L, (const char *)seg->stream, seg->n * sizeof(seg->stream[0]));
+	return 1;
+}
+
 static int
 lsprite_newbatch(lua_State *L) {
+	int depth = luaL_optinteger(L, 1, 1);
+	if (depth < 1 || depth > MAX_PIPELINE)
+		return luaL_error(L, "Invalid batch pipeline depth %d (1-%d)", depth, MAX_PIPELINE);
 	struct batch *b = (struct batch *)lua_newuserdatauv(L, sizeof(*b), 1);
 	b->n = 0;
-	b->b = batch_new(0);
-	if (b->b == NULL)
-		return luaL_error(L, "sprite_newbatch : Out of memory");
+	b->depth = depth;
+	b->current = 0;
+	int i;
+	for (i=0;i<MAX_PIPELINE;i++) {
+		b->buffer[i] = NULL;
+	}
+	for (i=0;i<depth;i++) {
+		b->buffer[i] = batch_new(0);
+		if (b->buffer[i] == NULL) {
+			while (--i >= 0)
+				batch_delete(b->buffer[i]);
+			return luaL_error(L, "sprite_newbatch : Out of memory");
+		}
+	}
+	b->b = b->buffer[0];
 	b->layer = 0;
 	b->layer_cap = 0;
+	b->record_from = -1;
+	b->record_layer = 0;
 	b->stack = NULL;
 	sprite_transform_identity(&b->trans);
 		
@@ -488,10 +903,14 @@ lsprite_newbatch(lua_State *L) {
 			{ "__index", NULL },
 			{ "reset", lbatch_reset },
 			{ "add", lbatch_add },
+			{ "add_array", lbatch_add_array },
 			{ "ptr", lbatch_ptr },
 			{ "release", lbatch_release },
 			{ "layer", lbatch_layer },
 			{ "point", lbatch_point },
+			{ "zkey", lbatch_zkey },
+			{ "record", lbatch_record },
+			{ "replay", lbatch_replay },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
@@ -504,15 +923,127 @@ lsprite_newbatch(lua_State *L) {
 	return 1;
 }
 
+static void
+apply_evict(struct sprite_bank *b, int page) {
+	int i;
+	for (i=0;i<b->n;i++) {
+		struct sprite_rect *rect = &b->rect[i];
+		if (rect->texid == page) {
+			// not resident, sprite_touch() makes it pending again
+			rect->texid = INVALID_TEXTUREID;
+			rect->u &= 0xffff;
+			rect->v &= 0xffff;
+		}
+	}
+}
+
+// spritemgr.apply(bank_ptr, placed [, evicted, dropped, pages, retry]) publishes the result of bank:pack() (or bank:place())
+// to the sprite rects. Call it in the render service, in the frame the atlas texture is updated with their pixels
+static int
+lsprite_apply(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	struct sprite_bank *b = (struct sprite_bank *)lua_touserdata(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int i, n;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		n = lua_rawlen(L, 3);
+		if (n > 0)
+			++b->evict_version;
+		for (i=1;i<=n;i++) {
+			lua_rawgeti(L, 3, i);
+			int page = (int)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (page < 0 || page >= ATLAS_PAGE_MAX)
+				return luaL_error(L, "Invalid page %d", page);
+			apply_evict(b, page);
+			b->page_evict[page] = b->evict_version;
+		}
+	}
+	lua_pushnil(L);
+	while (lua_next(L, 2) != 0) {
+		int id = (int)lua_tointeger(L, -2) - 1;
+		uint64_t v = (uint64_t)luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+		if (id < 0 || id >= b->n)
+			return luaL_error(L, "Invalid sprite id %d", id + 1);
+		struct sprite_rect *rect = &b->rect[id];
+		rect->u = (uint32_t)((v >> 16) & 0xffff) << 16 | (rect->u & 0xffff);
+		rect->v = (uint32_t)(v & 0xffff) << 16 | (rect->v & 0xffff);
+		rect->texid = (uint16_t)(v >> 32);
+	}
+	// the sprites over budget stay pending (so touching them doesn't request a pack every frame),
+	// drawmgr:frame() requests the next pack after retry frames, when a page may age out
+	int retry = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_rawlen(L, 4) > 0)
+			retry = (int)luaL_optinteger(L, 6, 1);
+	}
+	if (retry > 0) {
+		b->retry = 1;
+		b->retry_frame = b->current_frame + (uint16_t)(retry > 0x7fff ? 0x7fff : retry);
+	} else {
+		b->retry = 0;
+	}
+	if (!lua_isnoneornil(L, 5))
+		b->texture_n = (uint16_t)luaL_checkinteger(L, 5);
+	++b->pack_version;
+	return 0;
+}
+
+// spritemgr.texture(bank_ptr, id [, texid, w, h]) binds the sprite reserved by bank:texture() to an external texture
+// (texid >= ATLAS_PAGE_MAX), the sprite covers (0, 0, w, h) of it. Without texid, the sprite is unbound (not resident).
+// Call it in the render service
+static int
+lsprite_texture(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	struct sprite_bank *b = (struct sprite_bank *)lua_touserdata(L, 1);
+	int id = luaL_checkinteger(L, 2) - 1;
+	if (id < 0 || id >= b->n)
+		return luaL_error(L, "Invalid sprite id %d", id + 1);
+	struct sprite_rect *r = &b->rect[id];
+	if (lua_isnoneornil(L, 3)) {
+		r->texid = INVALID_TEXTUREID;
+		r->u &= 0xffff;
+		r->v &= 0xffff;
+		return 0;
+	}
+	int texid = luaL_checkinteger(L, 3);
+	if (texid < ATLAS_PAGE_MAX || texid >= PENDING_TEXTUREID)
+		return luaL_error(L, "Invalid texture id %d", texid);
+	int w = luaL_optinteger(L, 4, r->u & 0xffff);
+	int h = luaL_optinteger(L, 5, r->v & 0xffff);
+	if (w <= 0 || w > 0xffff || h <= 0 || h > 0xffff)
+		return luaL_error(L, "Invalid sprite size (%d * %d)", w, h);
+	r->texid = texid;
+	r->u = w;
+	r->v = h;
+	return 0;
+}
+
 int
 luaopen_spritemgr(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
 		{ "newbank", lsprite_newbank },
+		{ "apply", lsprite_apply },
+		{ "texture", lsprite_texture },
 		{ "newbatch", lsprite_newbatch },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
+	if (luaL_newmetatable(L, "SOLUNA_BATCH_SEGMENT")) {
+		lua_pushcfunction(L, lbatch_segment_len);
+		lua_setfield(L, -2, "__len");
+		luaL_Reg l[] = {
+			{ "data", lbatch_segment_data },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
 	sprite_transform_init();
 	return 1;
 }
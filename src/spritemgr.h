@@ -5,6 +5,10 @@
 #include <assert.h>
 
 #define INVALID_TEXTUREID 0xffff
+#define PENDING_TEXTUREID 0xfffe	// touched, waiting for bank:pack() and spritemgr.apply()
+// texid below ATLAS_PAGE_MAX are pages (layers) of the atlas texture array,
+// others are external textures (render targets), see bank:texture()
+#define ATLAS_PAGE_MAX 128
 
 struct sprite_rect {
 	uint16_t texid;
@@ -18,9 +22,14 @@ struct sprite_bank {
 	int n;
 	int cap;
 	int texture_size;
-	int texture_ready;
-	uint16_t texture_n;
+	int texture_ready;	// 0 : some sprites are pending, drawmgr:frame() requests a pack
+	uint16_t texture_n;	// atlas pages in use
 	uint16_t current_frame;
+	uint32_t pack_version;	// bumps when new rects are placed
+	int retry;	// some sprites are over budget, pack them again at retry_frame
+	uint16_t retry_frame;
+	uint32_t evict_version;	// bumps when atlas pages are evicted
+	uint32_t page_evict[ATLAS_PAGE_MAX];	// evict_version of the last eviction of each page
 	struct sprite_rect rect[1];
 };
 
@@ -31,12 +40,28 @@ sprite_touch(struct sprite_bank *b, int id) {
 	uint16_t f = b->current_frame;
 	rect->frame = f;
 	if (rect->texid == INVALID_TEXTUREID) {
-		rect->texid = 0;
-		b->texture_ready = 0;
-	} else if (rect->texid == 0) {
+		rect->texid = PENDING_TEXTUREID;
 		b->texture_ready = 0;
 	}
 	return rect;
 }
 
+// placed in the atlas (or bound to an external texture), not evicted nor pending
+static inline int
+sprite_resident(const struct sprite_rect *rect) {
+	return rect->texid < PENDING_TEXTUREID;
+}
+
+// all atlas pages are one texture, so sprites on different pages can be drawn in one call
+static inline int
+sprite_texture(int texid) {
+	return texid < ATLAS_PAGE_MAX ? 0 : texid;
+}
+
+// layer index in the texture array, external textures have only one layer
+static inline int
+sprite_page(int texid) {
+	return texid < ATLAS_PAGE_MAX ? texid : 0;
+}
+
 #endif
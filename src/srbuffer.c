@@ -1,6 +1,8 @@
 #include "srbuffer.h"
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 static inline int
 pow2(int n) {
@@ -16,12 +18,63 @@ srbuffer_size(int n) {
 	struct sr_buffer *dummy = NULL;
 	n = pow2(n);
 	size_t sz = sizeof(*dummy->frame) +
-		sizeof(*dummy->cache) +
+		sizeof(*dummy->hash) * 2 +
 		sizeof(*dummy->key) +
 		sizeof(*dummy->data);
 	return sizeof(*dummy) + sz * n;
 }
 
+#define HASH_EMPTY 0xffffffff
+
+static inline uint32_t
+hash_key(uint32_t v) {
+	v ^= v >> 16;
+	v *= 0x7feb352d;
+	v ^= v >> 15;
+	v *= 0x846ca68b;
+	v ^= v >> 16;
+	return v;
+}
+
+// The hash table (size cap * 2) maps key to slot, linear probing.
+// Returns the position of key v, or the empty position to insert it.
+static inline int
+hash_find(struct sr_buffer *SR, uint32_t v) {
+	uint32_t mask = SR->cap * 2 - 1;
+	uint32_t h = hash_key(v) & mask;
+	uint32_t slot;
+	while ((slot = SR->hash[h]) != HASH_EMPTY) {
+		if (SR->key[slot] == v)
+			break;
+		h = (h + 1) & mask;
+	}
+	return h;
+}
+
+// backward shift deletion, no tombstones
+static void
+hash_remove(struct sr_buffer *SR, uint32_t pos) {
+	uint32_t mask = SR->cap * 2 - 1;
+	uint32_t *hash = SR->hash;
+	uint32_t i = pos;
+	uint32_t j = pos;
+	for (;;) {
+		hash[i] = HASH_EMPTY;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (hash[j] == HASH_EMPTY)
+				return;
+			uint32_t k = hash_key(SR->key[hash[j]]) & mask;
+			// keep hash[j] if its home k is cyclically in (i, j]
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		hash[i] = hash[j];
+		i = j;
+	}
+}
+
 void
 srbuffer_init(struct sr_buffer *SR, int n) {
 	n = pow2(n);
@@ -30,71 +83,42 @@ srbuffer_init(struct sr_buffer *SR, int n) {
 	ptr += n * sizeof(SR->data[0]);
 	SR->key = (uint32_t *)ptr;
 	ptr += n * sizeof(SR->key[0]);
-	SR->cache = (uint16_t *)ptr;
-	ptr += n * sizeof(SR->cache[0]);
+	SR->hash = (uint32_t *)ptr;
+	ptr += n * 2 * sizeof(SR->hash[0]);
 	SR->frame = ptr;
+	memset(SR->hash, 0xff, n * 2 * sizeof(SR->hash[0]));
 
 	SR->cap = n;
+	SR->spill_n = 0;
+	SR->spill_cap = 0;
+	SR->spill_key = NULL;
+	SR->spill_hash = NULL;
 	SR->n = 1;
-	SR->dirty = 1;
+	SR->reuse = 1;
+	SR->lookup = 0;
+	SR->miss = 0;
+	SR->dirty_from = 0;
+	SR->dirty_to = 1;
 	SR->current_frame = 0;
 	SR->current_n = 1;
 	SR->frame[0] = 0;
 	SR->key[0] = 0;
-	SR->cache[0] = 0;
+	SR->hash[hash_find(SR, 0)] = 0;
 	float *v = SR->data[0].v;
 	v[0] = 1.0f; v[1] = 0;
 	v[2] = 0; v[3] = 1.0f;
 }
 
-int
-srbuffer_add(struct sr_buffer *SR, uint32_t v) {
-	int index = v % (SR->cap - 1);
-	int slot = SR->cache[index];
-	if (slot < SR->n && v == SR->key[slot]) {
-		if (SR->frame[slot] != SR->current_frame) {
-			SR->frame[slot] = SR->current_frame;
-			++SR->current_n;
-		}
-		return slot;
-	}
-	if (SR->n >= SR->cap) {
-		int i;
-		for (i=1;i<SR->cap;i++) {
-			if (SR->key[i] == v) {
-				SR->cache[index] = i;
-				SR->frame[index] = SR->current_frame;
-				return i;
-			}
-		}
-		return -1;	// full
-	}
-	int new_slot = 1;
-	if (SR->current_n * 2 < SR->n) {
-		// find an exist slot
-		slot = v % SR->n;
-		int i;
-		for (i=0;i<SR->n;i++) {
-			if (SR->frame[slot] != SR->current_frame) {
-				SR->frame[slot] = SR->current_frame;
-				++SR->current_n;
-				new_slot = 0;
-				break;
-			}
-			++slot;
-			if (slot >= SR->n)
-				slot -= SR->n;
-		}
-	}
-	if (new_slot) {
-		slot = SR->n++;
-		SR->frame[slot] = SR->current_frame;
-		++SR->current_n;
-	}
-	SR->dirty = 1;
-	SR->cache[index] = slot;
-	SR->key[slot] = v;
-	float *mat = SR->data[slot].v;
+static inline void
+mark_dirty(struct sr_buffer *SR, int slot) {
+	if (slot < SR->dirty_from)
+		SR->dirty_from = slot;
+	if (slot >= SR->dirty_to)
+		SR->dirty_to = slot + 1;
+}
+
+static void
+set_mat(float *mat, uint32_t v) {
 	uint32_t scale_fix = v >> 12;
 	float scale = 1.0f;
 	if (scale_fix != 0) {
@@ -116,23 +140,259 @@ srbuffer_add(struct sr_buffer *SR, uint32_t v) {
 		mat[0] = cosr; mat[1] = -sinr;
 		mat[2] = sinr; mat[3] = cosr;
 	}
+}
+
+static int
+spill_grow(struct sr_buffer *SR) {
+	// spill pages grow by power of 2, keep the size of hash is power of 2
+	int cap = SR->spill_cap ? SR->spill_cap * 2 : SR->cap;
+	struct sr_mat *inline_data = (struct sr_mat *)(SR + 1);
+	struct sr_mat *data;
+	if (SR->data == inline_data) {
+		data = (struct sr_mat *)malloc((SR->cap + cap) * sizeof(*data));
+		if (data == NULL)
+			return 0;
+		memcpy(data, SR->data, SR->cap * sizeof(*data));
+	} else {
+		data = (struct sr_mat *)realloc(SR->data, (SR->cap + cap) * sizeof(*data));
+		if (data == NULL)
+			return 0;
+	}
+	SR->data = data;
+	uint32_t *key = (uint32_t *)realloc(SR->spill_key, cap * sizeof(*key));
+	if (key == NULL)
+		return 0;
+	SR->spill_key = key;
+	int *hash = (int *)realloc(SR->spill_hash, cap * 2 * sizeof(*hash));
+	if (hash == NULL)
+		return 0;
+	SR->spill_hash = hash;
+	SR->spill_cap = cap;
+	// rehash, size of hash is cap * 2 (power of 2)
+	unsigned mask = cap * 2 - 1;
+	memset(hash, 0xff, cap * 2 * sizeof(*hash));
+	int i;
+	for (i=0;i<SR->spill_n;i++) {
+		unsigned h = hash_key(key[i]) & mask;
+		while (hash[h] >= 0)
+			h = (h + 1) & mask;
+		hash[h] = i;
+	}
+	return 1;
+}
+
+// The main page is full, put new keys into spill pages of this frame
+static int
+spill_add(struct sr_buffer *SR, uint32_t v) {
+	if (SR->spill_cap > 0) {
+		unsigned mask = SR->spill_cap * 2 - 1;
+		unsigned h = hash_key(v) & mask;
+		int index;
+		while ((index = SR->spill_hash[h]) >= 0) {
+			if (SR->spill_key[index] == v)
+				return SR->cap + index;
+			h = (h + 1) & mask;
+		}
+	}
+	if (SR->spill_n >= SR->spill_cap) {
+		if (!spill_grow(SR))
+			return -1;	// out of memory
+	}
+	int index = SR->spill_n++;
+	unsigned mask = SR->spill_cap * 2 - 1;
+	unsigned h = hash_key(v) & mask;
+	while (SR->spill_hash[h] >= 0)
+		h = (h + 1) & mask;
+	SR->spill_hash[h] = index;
+	SR->spill_key[index] = v;
+	set_mat(SR->data[SR->cap + index].v, v);
+	++SR->miss;
+	mark_dirty(SR, SR->cap + index);
+	return SR->cap + index;
+}
+
+// Find a slot not used in current frame, SR->reuse is a cursor sweeping the slots
+static int
+find_stale_slot(struct sr_buffer *SR) {
+	int slot = SR->reuse;
+	int i;
+	for (i=0;i<SR->n;i++) {
+		if (slot >= SR->n)
+			slot = 1;
+		if (SR->frame[slot] != SR->current_frame) {
+			SR->reuse = slot + 1;
+			return slot;
+		}
+		++slot;
+	}
+	return -1;
+}
+
+int
+srbuffer_add(struct sr_buffer *SR, uint32_t v) {
+	++SR->lookup;
+	int pos = hash_find(SR, v);
+	uint32_t slot = SR->hash[pos];
+	if (slot != HASH_EMPTY) {
+		if (SR->frame[slot] != SR->current_frame) {
+			SR->frame[slot] = SR->current_frame;
+			++SR->current_n;
+		}
+		return slot;
+	}
+	if (SR->current_n * 2 < SR->n || SR->n >= SR->cap) {
+		// reuse a slot of earlier frames
+		int stale = SR->current_n < SR->n ? find_stale_slot(SR) : -1;
+		if (stale < 0) {
+			if (SR->n >= SR->cap) {
+				// all the slots are used in this frame
+				return spill_add(SR, v);
+			}
+			slot = SR->n++;
+		} else {
+			slot = stale;
+			hash_remove(SR, hash_find(SR, SR->key[slot]));
+			pos = hash_find(SR, v);
+		}
+	} else {
+		slot = SR->n++;
+	}
+	SR->frame[slot] = SR->current_frame;
+	++SR->current_n;
+	mark_dirty(SR, slot);
+	SR->hash[pos] = slot;
+	SR->key[slot] = v;
+	set_mat(SR->data[slot].v, v);
+	++SR->miss;
 	return slot;
 }
 
+// Drop the slots at the tail not used in this frame, they don't need upload
+static void
+trim_tail(struct sr_buffer *SR) {
+	int n = SR->n;
+	while (n > 1 && SR->frame[n-1] != SR->current_frame) {
+		--n;
+		hash_remove(SR, hash_find(SR, SR->key[n]));
+	}
+	SR->n = n;
+	if (SR->reuse > n)
+		SR->reuse = 1;
+}
+
+static inline void
+next_frame(struct sr_buffer *SR) {
+	SR->current_n = 1;
+	++SR->current_frame;
+	SR->frame[0] = SR->current_frame;
+}
+
+// Returns the span to upload, or NULL when no slot was written in this frame (only cached slots are used).
+// sg_update_buffer replaces the whole buffer (D3D11 discards it, Metal rotates in-flight copies),
+// so the span always starts from slot 0 ; it ends at the last live slot instead of the high water mark.
 void *
 srbuffer_commit(struct sr_buffer *SR, int *sz) {
-	if (SR->dirty) {
-		*sz = SR->n * sizeof(SR->data[0]);
-		SR->dirty = 0;
-		SR->current_n = 1;
-		++SR->current_frame;
-		SR->frame[0] = SR->current_frame;
+	if (SR->dirty_to > SR->dirty_from) {
+		if (SR->spill_n > 0) {
+			*sz = (SR->cap + SR->spill_n) * sizeof(SR->data[0]);
+			SR->spill_n = 0;
+			memset(SR->spill_hash, 0xff, SR->spill_cap * 2 * sizeof(SR->spill_hash[0]));
+		} else {
+			trim_tail(SR);
+			*sz = SR->n * sizeof(SR->data[0]);
+		}
+		SR->dirty_from = INT_MAX;
+		SR->dirty_to = 0;
+		next_frame(SR);
 		return SR->data;
 	}
 	*sz = 0;
+	next_frame(SR);
 	return NULL;
 }
 
+void
+srbuffer_release(struct sr_buffer *SR) {
+	if (SR->data != (struct sr_mat *)(SR + 1)) {
+		free(SR->data);
+		SR->data = (struct sr_mat *)(SR + 1);
+	}
+	free(SR->spill_key);
+	SR->spill_key = NULL;
+	free(SR->spill_hash);
+	SR->spill_hash = NULL;
+	SR->spill_n = 0;
+	SR->spill_cap = 0;
+}
+
+void
+srshard_init(struct sr_shard *S) {
+	S->n = 0;
+	S->cap = 0;
+	S->key = NULL;
+	S->hash = NULL;
+	S->remap = NULL;
+}
+
+void
+srshard_release(struct sr_shard *S) {
+	free(S->key);
+	free(S->hash);
+	free(S->remap);
+	srshard_init(S);
+}
+
+int
+srshard_reserve(struct sr_shard *S, int n) {
+	S->n = 0;
+	if (n > S->cap) {
+		int cap = pow2(n);
+		uint32_t *key = (uint32_t *)realloc(S->key, cap * sizeof(*key));
+		if (key == NULL)
+			return 0;
+		S->key = key;
+		int *hash = (int *)realloc(S->hash, cap * 2 * sizeof(*hash));
+		if (hash == NULL)
+			return 0;
+		S->hash = hash;
+		int *remap = (int *)realloc(S->remap, cap * sizeof(*remap));
+		if (remap == NULL)
+			return 0;
+		S->remap = remap;
+		S->cap = cap;
+	}
+	memset(S->hash, 0xff, S->cap * 2 * sizeof(S->hash[0]));
+	return 1;
+}
+
+int
+srshard_add(struct sr_shard *S, uint32_t v) {
+	unsigned mask = S->cap * 2 - 1;
+	unsigned h = hash_key(v) & mask;
+	int index;
+	while ((index = S->hash[h]) >= 0) {
+		if (S->key[index] == v)
+			return index;
+		h = (h + 1) & mask;
+	}
+	index = S->n++;
+	S->hash[h] = index;
+	S->key[index] = v;
+	return index;
+}
+
+int
+srshard_merge(struct sr_shard *S, struct sr_buffer *SR) {
+	int i;
+	for (i=0;i<S->n;i++) {
+		int index = srbuffer_add(SR, S->key[i]);
+		if (index < 0)
+			return 0;
+		S->remap[i] = index;
+	}
+	return 1;
+}
+
 #ifdef TEST_SRBUFFER_MAIN
 
 #include <stdio.h>
@@ -173,8 +433,210 @@ test_sr(float x, float y, float scale, float rot) {
 	printf("[%f,%f / %f,%f] =(%x)=> [%f,%f]\n", x, y, scale, rot, v, ox, oy);
 }
 
+static void
+test_spill() {
+	const int cap = 64;
+	const int keys = 1000;
+	struct sr_buffer *SR = (struct sr_buffer *)malloc(srbuffer_size(cap));
+	srbuffer_init(SR, cap);
+	int frame;
+	for (frame=0;frame<3;frame++) {
+		int i;
+		for (i=0;i<keys;i++) {
+			uint32_t v = (i + frame) << 12 | (i & 0xfff);
+			int index = srbuffer_add(SR, v);
+			assert(index >= 0 && srbuffer_add(SR, v) == index);
+			float mat[4];
+			set_mat(mat, v);
+			assert(memcmp(mat, SR->data[index].v, sizeof(mat)) == 0);
+		}
+		int sz;
+		srbuffer_commit(SR, &sz);
+		printf("frame %d : %d keys, upload %d entries\n", frame, keys, sz / (int)sizeof(SR->data[0]));
+	}
+	srbuffer_release(SR);
+	free(SR);
+}
+
+#include <time.h>
+
+static double
+bench_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// distinct keys per frame, 1/4 of them change every frame
+static void
+bench(int cap, int keys) {
+	const int frames = 16;
+	struct sr_buffer *SR = (struct sr_buffer *)malloc(srbuffer_size(cap));
+	srbuffer_init(SR, cap);
+	int frame, i;
+	double t = bench_time();
+	for (frame=0;frame<frames;frame++) {
+		uint32_t base = frame * (keys / 4);
+		for (i=0;i<keys;i++) {
+			uint32_t k = base + i;
+			uint32_t v = (k / 4096 + 1) << 12 | (k % 4096);
+			int index = srbuffer_add(SR, v);
+			assert(index >= 0);
+		}
+		int sz;
+		srbuffer_commit(SR, &sz);
+	}
+	t = bench_time() - t;
+	printf("cap %d keys %6d : %.2f ns per add\n", cap, keys, t * 1e9 / ((double)frames * keys));
+	srbuffer_release(SR);
+	free(SR);
+}
+
+static void
+test_upload() {
+	struct sr_buffer *SR = (struct sr_buffer *)malloc(srbuffer_size(1024));
+	srbuffer_init(SR, 1024);
+	int i, sz;
+	// spike : 1000 keys
+	for (i=1;i<=1000;i++)
+		srbuffer_add(SR, i << 12);
+	assert(srbuffer_commit(SR, &sz) != NULL && sz == 1001 * sizeof(SR->data[0]));
+	// only cached keys, no upload
+	for (i=1;i<=1000;i++)
+		srbuffer_add(SR, i << 12);
+	assert(srbuffer_commit(SR, &sz) == NULL && sz == 0);
+	// 10 live keys and a new one, the stale tail is not uploaded
+	for (i=1;i<=10;i++)
+		srbuffer_add(SR, i << 12);
+	srbuffer_add(SR, 2000 << 12);
+	assert(srbuffer_commit(SR, &sz) != NULL);
+	printf("upload after spike : %d entries\n", sz / (int)sizeof(SR->data[0]));
+	assert(sz <= 12 * sizeof(SR->data[0]));
+	srbuffer_release(SR);
+	free(SR);
+}
+
+// sprite_sr_decode in the instance sr mode must match the matrix in srbuffer
+static void
+test_decode() {
+	uint32_t keys[] = { 0, 0x100 << 12, 0xff800 << 12 | 0x400, 0x1234 << 12 | 0x7ff, 0xfefff << 12 | 0xfff };
+	int i;
+	for (i=0;i<sizeof(keys)/sizeof(keys[0]);i++) {
+		float mat[4];
+		float scale, rot;
+		set_mat(mat, keys[i]);
+		sprite_sr_decode(keys[i], &scale, &rot);
+		float c = cosf(rot) * scale;
+		float s = sinf(rot) * scale;
+		assert(fabsf(mat[0] - c) <= 1e-4f * scale && fabsf(mat[1] + s) <= 1e-4f * scale);
+		assert(fabsf(mat[2] - s) <= 1e-4f * scale && fabsf(mat[3] - c) <= 1e-4f * scale);
+	}
+}
+
+static volatile float bench_sink;
+
+// lut mode (srbuffer_add) vs instance mode (sprite_sr_decode), n instances share `distinct` keys
+static void
+bench_mode(int n, int distinct) {
+	const int frames = 16;
+	struct sr_buffer *SR = (struct sr_buffer *)malloc(srbuffer_size(0x10000));
+	srbuffer_init(SR, 0x10000);
+	int frame, i;
+	int upload = 0;
+	double t = bench_time();
+	for (frame=0;frame<frames;frame++) {
+		uint32_t base = frame * 7;
+		for (i=0;i<n;i++) {
+			uint32_t k = base + i % distinct;
+			int index = srbuffer_add(SR, (k / 4096 + 1) << 12 | (k % 4096));
+			assert(index >= 0);
+		}
+		int sz;
+		srbuffer_commit(SR, &sz);
+		upload += sz;
+	}
+	double lut = bench_time() - t;
+	float sum = 0;
+	t = bench_time();
+	for (frame=0;frame<frames;frame++) {
+		uint32_t base = frame * 7;
+		for (i=0;i<n;i++) {
+			uint32_t k = base + i % distinct;
+			float scale, rot;
+			sprite_sr_decode((k / 4096 + 1) << 12 | (k % 4096), &scale, &rot);
+			sum += scale + rot;
+		}
+	}
+	double inst = bench_time() - t;
+	// lut : 4 bytes sr_index per instance + matrices uploaded ; instance : 8 bytes scale/rot per instance
+	bench_sink = sum;
+	printf("%6d instances %6d distinct sr : lut %.2f ns %d bytes, instance %.2f ns %d bytes\n",
+		n, distinct,
+		lut * 1e9 / ((double)frames * n), n * 4 + upload / frames,
+		inst * 1e9 / ((double)frames * n), n * 8);
+	srbuffer_release(SR);
+	free(SR);
+}
+
+// sharded adds must leave srbuffer in the same state as serial adds
+static void
+test_shard() {
+	const int n = 20000;
+	const int shards = 4;
+	uint32_t *keys = (uint32_t *)malloc(n * sizeof(uint32_t));
+	int *serial = (int *)malloc(n * sizeof(int));
+	int i;
+	for (i=0;i<n;i++) {
+		keys[i] = ((i * 7919) % 3000 + 1) << 12 | (i % 17);
+	}
+	struct sr_buffer *A = (struct sr_buffer *)malloc(srbuffer_size(0x10000));
+	struct sr_buffer *B = (struct sr_buffer *)malloc(srbuffer_size(0x10000));
+	srbuffer_init(A, 0x10000);
+	srbuffer_init(B, 0x10000);
+	for (i=0;i<n;i++)
+		serial[i] = srbuffer_add(A, keys[i]);
+	struct sr_shard shard[4];
+	int s;
+	int *local = (int *)malloc(n * sizeof(int));
+	for (s=0;s<shards;s++) {
+		int from = n * s / shards;
+		int to = n * (s+1) / shards;
+		srshard_init(&shard[s]);
+		assert(srshard_reserve(&shard[s], to - from));
+		for (i=from;i<to;i++)
+			local[i] = srshard_add(&shard[s], keys[i]);
+	}
+	for (s=0;s<shards;s++) {
+		assert(srshard_merge(&shard[s], B));
+		int from = n * s / shards;
+		int to = n * (s+1) / shards;
+		for (i=from;i<to;i++)
+			assert(shard[s].remap[local[i]] == serial[i]);
+		srshard_release(&shard[s]);
+	}
+	assert(A->n == B->n && memcmp(A->key, B->key, A->n * sizeof(uint32_t)) == 0);
+	free(local);
+	free(serial);
+	free(keys);
+	srbuffer_release(A);
+	srbuffer_release(B);
+	free(A);
+	free(B);
+}
+
 int
 main() {
+	test_decode();
+	test_shard();
+	test_upload();
+	bench_mode(50000, 16);
+	bench_mode(50000, 1000);
+	bench_mode(50000, 50000);
+	bench(0x10000, 10000);
+	bench(0x10000, 50000);
+	bench(0x10000, 100000);
+	bench(0x10000, 200000);
+	test_spill();
 	test_rot(100, 100, 45);
 	test_rot(100, 0, 90);
 	test_sr(100, 0, 1.5, 30);
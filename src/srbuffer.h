@@ -12,17 +12,44 @@ struct sr_buffer {
 	int n;
 	int cap;
 	int current_n;
-	uint8_t dirty;
+	int spill_n;	// entries in spill pages (after cap) of this frame
+	int spill_cap;
+	int dirty_from;	// range of slots written in this frame
+	int dirty_to;
 	uint8_t current_frame;
 	uint8_t *frame;
-	uint16_t *cache;
+	int reuse;
+	int lookup;	// srbuffer_add calls, reset by the user
+	int miss;	// new matrices computed
 	uint32_t *key;
-	struct sr_mat *data;
+	uint32_t *hash;
+	uint32_t *spill_key;
+	int *spill_hash;
+	struct sr_mat *data;	// cap + spill_cap
+};
+
+// Per-thread shard for parallel encode : keys are deduplicated locally (local index),
+// then merged into srbuffer in shard order, the same order as a serial encode.
+struct sr_shard {
+	int n;
+	int cap;
+	uint32_t *key;
+	int *hash;	// cap * 2
+	int *remap;	// local index -> srbuffer index, after srshard_merge
 };
 
 size_t srbuffer_size(int n);
 void srbuffer_init(struct sr_buffer *SR, int n);
 int srbuffer_add(struct sr_buffer *SR, uint32_t sr);
 void * srbuffer_commit(struct sr_buffer *SR, int *sz);
+void srbuffer_release(struct sr_buffer *SR);
+
+void srshard_init(struct sr_shard *S);
+void srshard_release(struct sr_shard *S);
+// clear the shard for up to n keys, returns 0 if out of memory
+int srshard_reserve(struct sr_shard *S, int n);
+int srshard_add(struct sr_shard *S, uint32_t sr);
+// returns 0 if srbuffer is out of memory
+int srshard_merge(struct sr_shard *S, struct sr_buffer *SR);
 
 #endif
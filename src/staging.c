@@ -0,0 +1,151 @@
+#include "staging.h"
+#include <stdlib.h>
+#include <string.h>
+
+void
+staging_init(struct staging *S) {
+	memset(S, 0, sizeof(*S));
+}
+
+void
+staging_release(struct staging *S) {
+	int i;
+	for (i=0;i<STAGING_LANE;i++) {
+		free(S->lane[i].ptr);
+	}
+	memset(S, 0, sizeof(*S));
+}
+
+void
+staging_reset(struct staging *S) {
+	int i;
+	for (i=0;i<STAGING_LANE;i++) {
+		S->lane[i].n = 0;
+	}
+}
+
+void *
+staging_reserve(struct staging *S, int lane, size_t sz) {
+	struct staging_lane *L = &S->lane[lane];
+	size_t size = L->n + sz;
+	if (size > L->cap) {
+		size_t cap = L->cap ? L->cap : 64 * 1024;
+		while (cap < size)
+			cap *= 2;
+		uint8_t *ptr = (uint8_t *)realloc(L->ptr, cap);
+		if (ptr == NULL)
+			return NULL;
+		L->ptr = ptr;
+		L->cap = cap;
+	}
+	return L->ptr + L->n;
+}
+
+#ifdef TEST_STAGING_MAIN
+
+#include <stdio.h>
+#include <time.h>
+
+#define BATCHN 4096
+
+struct inst_object {
+	float x, y;
+	float sr_index;
+	uint32_t offset;
+	uint32_t u;
+	uint32_t v;
+};
+
+static double
+bench_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void
+encode(struct inst_object *inst, int i) {
+	inst->x = (float)i;
+	inst->y = (float)(i * 3);
+	inst->sr_index = (float)(i & 0xff);
+	inst->offset = i * 7;
+	inst->u = i * 11;
+	inst->v = i * 13;
+}
+
+// stand-in for the driver copy of sg_append_buffer / sg_update_buffer
+static uint8_t gpu[200000 * sizeof(struct inst_object)];
+static size_t gpu_n;
+
+static void
+upload(const void *ptr, size_t sz) {
+	memcpy(gpu + gpu_n, ptr, sz);
+	gpu_n += sz;
+}
+
+// old path : encode chunks of BATCHN on the stack, one append per chunk
+static int
+bench_stack(int n) {
+	struct inst_object tmp[BATCHN];
+	int i, j;
+	int uploads = 0;
+	gpu_n = 0;
+	for (i=0;i<n;i+=BATCHN) {
+		int count = n - i;
+		if (count > BATCHN)
+			count = BATCHN;
+		for (j=0;j<count;j++)
+			encode(&tmp[j], i + j);
+		upload(tmp, count * sizeof(tmp[0]));
+		++uploads;
+	}
+	return uploads;
+}
+
+static void
+bench(int n, int submit) {
+	const int frames = 64;
+	struct staging S;
+	staging_init(&S);
+	int f, uploads_stack = 0, uploads_staging = 0;
+	double t = bench_time();
+	for (f=0;f<frames;f++) {
+		int k;
+		for (k=0;k<submit;k++)
+			uploads_stack += bench_stack(n / submit);
+	}
+	double t_stack = bench_time() - t;
+	t = bench_time();
+	for (f=0;f<frames;f++) {
+		staging_reset(&S);
+		int k;
+		for (k=0;k<submit;k++) {
+			// submits of one frame accumulate in the lane, it grows past the initial capacity
+			struct inst_object *inst = (struct inst_object *)staging_reserve(&S, 0, n / submit * sizeof(*inst));
+			int i;
+			for (i=0;i<n/submit;i++)
+				encode(&inst[i], i);
+			staging_commit(&S, 0, n / submit * sizeof(*inst));
+		}
+		gpu_n = 0;
+		upload(S.lane[0].ptr, S.lane[0].n);
+		++uploads_staging;
+	}
+	double t_staging = bench_time() - t;
+	printf("%6d instances in %3d submits : stack %.2f ms %d uploads, staging %.2f ms %d upload\n",
+		n, submit,
+		t_stack * 1000 / frames, uploads_stack / frames,
+		t_staging * 1000 / frames, uploads_staging / frames);
+	staging_release(&S);
+}
+
+int
+main() {
+	bench(10000, 1);
+	bench(50000, 1);
+	bench(200000, 1);
+	bench(50000, 100);
+	return 0;
+}
+
+#endif
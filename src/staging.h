@@ -0,0 +1,34 @@
+#ifndef soluna_staging_h
+#define soluna_staging_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-frame staging arena for instance data.
+// Each instance buffer has its own lane, materials encode into it directly,
+// and every lane is uploaded once per frame.
+
+#define STAGING_LANE 16
+
+struct staging_lane {
+	uint8_t *ptr;
+	size_t n;
+	size_t cap;
+};
+
+struct staging {
+	struct staging_lane lane[STAGING_LANE];
+};
+
+void staging_init(struct staging *S);
+void staging_release(struct staging *S);
+void staging_reset(struct staging *S);
+// returns the space for sz bytes at the end of the lane, NULL if out of memory
+void * staging_reserve(struct staging *S, int lane, size_t sz);
+// sz bytes written after staging_reserve
+static inline void
+staging_commit(struct staging *S, int lane, size_t sz) {
+	S->lane[lane].n += sz;
+}
+
+#endif
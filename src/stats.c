@@ -0,0 +1,131 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define STATS_HISTORY 120
+
+struct stats_history {
+	atomic_flag lock;
+	int frame;
+	int n;
+	int value[STATS_HISTORY][STATS_COUNT];
+};
+
+static const char * stats_name[STATS_COUNT] = {
+	"primitive",
+	"draw_element",
+	"culled",
+	"instance",
+	"srbuffer_entry",
+	"srbuffer_upload",
+	"font_miss",
+	"atlas_repack",
+	"draw_call",
+	"instance_upload",
+	"tile_upload",
+	"particle",
+	"offscreen_pass",
+	"sprite_miss",
+	"atlas_evict",
+	"texture_upload",
+};
+
+static atomic_int g_current[STATS_COUNT];
+static struct stats_history g_history = { ATOMIC_FLAG_INIT };
+
+void
+stats_add(int id, int n) {
+	atomic_fetch_add_explicit(&g_current[id], n, memory_order_relaxed);
+}
+
+void
+stats_set(int id, int n) {
+	atomic_store_explicit(&g_current[id], n, memory_order_relaxed);
+}
+
+static inline void
+history_lock(struct stats_history *h) {
+	while (atomic_flag_test_and_set_explicit(&h->lock, memory_order_acquire)) {}
+}
+
+static inline void
+history_unlock(struct stats_history *h) {
+	atomic_flag_clear_explicit(&h->lock, memory_order_release);
+}
+
+// Called once per frame by the render service, move current counters into history
+static int
+lstats_frame(lua_State *L) {
+	int v[STATS_COUNT];
+	int i;
+	for (i=0;i<STATS_COUNT;i++) {
+		v[i] = atomic_exchange_explicit(&g_current[i], 0, memory_order_relaxed);
+	}
+	struct stats_history *h = &g_history;
+	history_lock(h);
+	memcpy(h->value[h->frame % STATS_HISTORY], v, sizeof(v));
+	++h->frame;
+	if (h->n < STATS_HISTORY)
+		++h->n;
+	history_unlock(h);
+	return 0;
+}
+
+// returns { frame = n, [name] = { last, min, avg, max } } over the last frames
+static int
+lstats_get(lua_State *L) {
+	struct stats_history *h = &g_history;
+	struct stats_history tmp;
+	history_lock(h);
+	tmp.frame = h->frame;
+	tmp.n = h->n;
+	memcpy(tmp.value, h->value, sizeof(tmp.value));
+	history_unlock(h);
+
+	lua_createtable(L, 0, STATS_COUNT + 1);
+	lua_pushinteger(L, tmp.frame);
+	lua_setfield(L, -2, "frame");
+	if (tmp.n == 0)
+		return 1;
+	int last = (tmp.frame - 1) % STATS_HISTORY;
+	int i, j;
+	for (i=0;i<STATS_COUNT;i++) {
+		int minv = tmp.value[last][i];
+		int maxv = minv;
+		lua_Integer sum = 0;
+		for (j=0;j<tmp.n;j++) {
+			int v = tmp.value[j][i];
+			if (v < minv)
+				minv = v;
+			if (v > maxv)
+				maxv = v;
+			sum += v;
+		}
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, tmp.value[last][i]);
+		lua_setfield(L, -2, "last");
+		lua_pushinteger(L, minv);
+		lua_setfield(L, -2, "min");
+		lua_pushnumber(L, (lua_Number)sum / tmp.n);
+		lua_setfield(L, -2, "avg");
+		lua_pushinteger(L, maxv);
+		lua_setfield(L, -2, "max");
+		lua_setfield(L, -2, stats_name[i]);
+	}
+	return 1;
+}
+
+int
+luaopen_soluna_stats(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "frame", lstats_frame },
+		{ "get", lstats_get },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
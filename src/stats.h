@@ -0,0 +1,29 @@
+#ifndef soluna_stats_h
+#define soluna_stats_h
+
+// Per-frame render counters, published by the render service via soluna.stats
+
+enum soluna_stats_id {
+	STATS_PRIMITIVE,
+	STATS_DRAW_ELEMENT,
+	STATS_CULLED,
+	STATS_INSTANCE,
+	STATS_SRBUFFER_ENTRY,
+	STATS_SRBUFFER_UPLOAD,
+	STATS_FONT_MISS,
+	STATS_ATLAS_REPACK,
+	STATS_DRAW_CALL,
+	STATS_INSTANCE_UPLOAD,
+	STATS_TILE_UPLOAD,
+	STATS_PARTICLE,
+	STATS_OFFSCREEN_PASS,
+	STATS_SPRITE_MISS,
+	STATS_ATLAS_EVICT,
+	STATS_TEXTURE_UPLOAD,
+	STATS_COUNT,
+};
+
+void stats_add(int id, int n);
+void stats_set(int id, int n);
+
+#endif
@@ -16,8 +16,9 @@ in vec3 position;
 in uint offset;
 in uint u;
 in uint v;
+in uint page;
 
-out vec2 uv;
+out vec3 uv;	// z is the layer of the atlas
 
 void main() {
 	ivec2 uv_base = ivec2(u >> 16, v >> 16);
@@ -27,21 +28,61 @@ void main() {
 	vec2 uv_offset = vec2(u2[gl_VertexIndex & 1] , v2[gl_VertexIndex >> 1]);
 	vec2 pos = ((uv_offset - off) * sr[int(position.z)].m + position.xy) * framesize;
 	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
-	uv = (uv_base + uv_offset) * texsize;
+	vec2 st = (uv_base + uv_offset) * abs(texsize);
+	// negative texsize : a render target on GL, flip v
+	uv = vec3(st.x, texsize < 0.0f ? 1.0f - st.y : st.y, page);
 }
 
 @end
 
 @fs fs
-layout(binding=1) uniform texture2D tex;
+layout(binding=1) uniform texture2DArray tex;
 layout(binding=0) uniform sampler smp;
 
-in vec2 uv;
+in vec3 uv;
 out vec4 frag_color;
 
 void main() {
-	frag_color = texture(sampler2D(tex,smp), uv);
+	frag_color = texture(sampler2DArray(tex,smp), uv);
 }
 @end
 
-@program texquad vs fs
\ No newline at end of file
+@program texquad vs fs
+
+@vs vs_sr
+// scale and rotation in instance data, without sr_lut
+layout(binding=0) uniform vs_params {
+	vec2 framesize;
+	float texsize;
+};
+
+mat2 sr_matrix(float scale, float rot) {
+	float c = cos(rot) * scale;
+	float s = sin(rot) * scale;
+	return mat2(c, -s, s, c);
+}
+
+in vec4 position;	// x, y, scale, rot
+in uint offset;
+in uint u;
+in uint v;
+in uint page;
+
+out vec3 uv;	// z is the layer of the atlas
+
+void main() {
+	ivec2 uv_base = ivec2(u >> 16, v >> 16);
+	ivec2 u2 = ivec2(0 , u & 0xffff);
+	ivec2 v2 = ivec2(0 , v & 0xffff);
+	ivec2 off = ivec2(offset >> 16 , offset & 0xffff) - 0x8000;
+	vec2 uv_offset = vec2(u2[gl_VertexIndex & 1] , v2[gl_VertexIndex >> 1]);
+	vec2 pos = ((uv_offset - off) * sr_matrix(position.z, position.w) + position.xy) * framesize;
+	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
+	vec2 st = (uv_base + uv_offset) * abs(texsize);
+	// negative texsize : a render target on GL, flip v
+	uv = vec3(st.x, texsize < 0.0f ? 1.0f - st.y : st.y, page);
+}
+
+@end
+
+@program texquad_sr vs_sr fs
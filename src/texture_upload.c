@@ -0,0 +1,338 @@
+#include "texture_upload.h"
+#include "blit.glsl.h"
+#include "render_bindings.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define UPLOAD_RECT_MAX 1024
+#define UPLOAD_LAYER_MAX 128
+#define UPLOAD_MIN_BUFFER (64 * 1024)
+
+struct upload_rect {
+	uint16_t x, y, w, h;
+	int layer;
+};
+
+struct texture_upload {
+	sg_image img;
+	sg_pixel_format format;
+	int width;
+	int height;
+	int layers;
+	int pixel_size;
+	int rect_n;
+	sg_pipeline pip;
+	sg_buffer buffer;
+	sg_view buffer_view;
+	size_t buffer_cap;
+	uint8_t *staging;
+	size_t staging_cap;
+	uint8_t full[UPLOAD_LAYER_MAX];	// upload the whole layer
+	uint8_t clear[UPLOAD_LAYER_MAX];
+	sg_view target[UPLOAD_LAYER_MAX];	// attachment view of each layer, created on demand
+	struct upload_rect rect[UPLOAD_RECT_MAX];
+};
+
+static sg_shader g_shader;
+
+static sg_pipeline
+make_pipeline(sg_pixel_format format) {
+	if (g_shader.id == SG_INVALID_ID) {
+		g_shader = sg_make_shader(blit_shader_desc(sg_query_backend()));
+		if (sg_query_shader_state(g_shader) != SG_RESOURCESTATE_VALID) {
+			fprintf(stderr, "failed to create shader for texture upload\n");
+		}
+	}
+	return sg_make_pipeline(&(sg_pipeline_desc) {
+		.shader = g_shader,
+		.colors[0].pixel_format = format,
+		.depth.pixel_format = SG_PIXELFORMAT_NONE,
+		.sample_count = 1,
+		.primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
+		.label = "texture-upload-pipeline",
+	});
+}
+
+struct texture_upload *
+texture_upload_new(sg_image img, int width, int height, int layers, sg_pixel_format format, int pixel_size) {
+	if (layers <= 0 || layers > UPLOAD_LAYER_MAX || width > 0xffff || height > 0xffff)
+		return NULL;
+	struct texture_upload *U = (struct texture_upload *)malloc(sizeof(*U));
+	if (U == NULL)
+		return NULL;
+	memset(U, 0, sizeof(*U));
+	U->img = img;
+	U->format = format;
+	U->width = width;
+	U->height = height;
+	U->layers = layers;
+	U->pixel_size = pixel_size;
+	U->pip = make_pipeline(format);
+	// the content of a new attachment is undefined
+	memset(U->clear, 1, layers);
+	return U;
+}
+
+void
+texture_upload_delete(struct texture_upload *U) {
+	if (U == NULL)
+		return;
+	int i;
+	for (i=0;i<U->layers;i++) {
+		if (U->target[i].id != SG_INVALID_ID)
+			sg_destroy_view(U->target[i]);
+	}
+	if (U->buffer.id != SG_INVALID_ID) {
+		sg_destroy_view(U->buffer_view);
+		sg_destroy_buffer(U->buffer);
+	}
+	sg_destroy_pipeline(U->pip);
+	free(U->staging);
+	free(U);
+}
+
+void
+texture_upload_dirty(struct texture_upload *U, int x, int y, int w, int h, int layer) {
+	if (layer < 0 || layer >= U->layers)
+		return;
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > U->width)
+		w = U->width - x;
+	if (y + h > U->height)
+		h = U->height - y;
+	if (w <= 0 || h <= 0 || U->full[layer])
+		return;
+	int i;
+	for (i=0;i<U->rect_n;i++) {
+		struct upload_rect *r = &U->rect[i];
+		if (r->layer == layer && x >= r->x && y >= r->y && x + w <= r->x + r->w && y + h <= r->y + r->h)
+			return;
+	}
+	if (U->rect_n >= UPLOAD_RECT_MAX) {
+		// too many rects, upload this layer as a whole
+		U->full[layer] = 1;
+		return;
+	}
+	struct upload_rect *r = &U->rect[U->rect_n++];
+	r->x = x;
+	r->y = y;
+	r->w = w;
+	r->h = h;
+	r->layer = layer;
+}
+
+void
+texture_upload_clear(struct texture_upload *U, int layer) {
+	if (layer >= 0 && layer < U->layers)
+		U->clear[layer] = 1;
+}
+
+static uint8_t *
+reserve_staging(struct texture_upload *U, size_t sz) {
+	if (sz > U->staging_cap) {
+		size_t cap = U->staging_cap ? U->staging_cap : UPLOAD_MIN_BUFFER;
+		while (cap < sz)
+			cap *= 2;
+		uint8_t *ptr = (uint8_t *)realloc(U->staging, cap);
+		if (ptr == NULL)
+			return NULL;
+		U->staging = ptr;
+		U->staging_cap = cap;
+	}
+	return U->staging;
+}
+
+static int
+prepare_buffer(struct texture_upload *U, size_t sz) {
+	if (sz <= U->buffer_cap)
+		return 1;
+	if (U->buffer.id != SG_INVALID_ID) {
+		sg_destroy_view(U->buffer_view);
+		sg_destroy_buffer(U->buffer);
+	}
+	size_t cap = U->buffer_cap ? U->buffer_cap : UPLOAD_MIN_BUFFER;
+	while (cap < sz)
+		cap *= 2;
+	U->buffer = sg_make_buffer(&(sg_buffer_desc) {
+		.size = cap,
+		.usage = { .storage_buffer = true, .dynamic_update = true },
+		.label = "texture-upload",
+	});
+	U->buffer_view = sg_make_view(&(sg_view_desc) {
+		.storage_buffer.buffer = U->buffer,
+		.label = "texture-upload",
+	});
+	U->buffer_cap = cap;
+	return sg_query_buffer_state(U->buffer) == SG_RESOURCESTATE_VALID;
+}
+
+static inline size_t
+rect_pitch(struct texture_upload *U, int w) {
+	// rows are 4 bytes aligned
+	return ((size_t)w * U->pixel_size + 3) & ~(size_t)3;
+}
+
+// layout of the staging buffer : the rows of every rect, then 4 words per rect sorted by layer
+static size_t
+pack_rects(struct texture_upload *U, const uint8_t *data, int first, struct upload_rect *rect, int n, size_t *rect_offset) {
+	size_t sz = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		sz += rect_pitch(U, rect[i].w) * rect[i].h;
+	}
+	*rect_offset = sz;
+	uint8_t *out = reserve_staging(U, sz + n * 4 * sizeof(uint32_t));
+	if (out == NULL)
+		return 0;
+	uint32_t *desc = (uint32_t *)(out + sz);
+	size_t layer_size = (size_t)U->width * U->height * U->pixel_size;
+	size_t stride = (size_t)U->width * U->pixel_size;
+	size_t offset = 0;
+	for (i=0;i<n;i++) {
+		struct upload_rect *r = &rect[i];
+		size_t pitch = rect_pitch(U, r->w);
+		const uint8_t *src = data + (r->layer - first) * layer_size + r->y * stride + r->x * U->pixel_size;
+		uint8_t *dst = out + offset;
+		int y;
+		for (y=0;y<r->h;y++) {
+			memcpy(dst, src, r->w * U->pixel_size);
+			src += stride;
+			dst += pitch;
+		}
+		desc[0] = (uint32_t)r->x << 16 | r->y;
+		desc[1] = (uint32_t)r->w << 16 | r->h;
+		desc[2] = (uint32_t)offset;
+		desc[3] = (uint32_t)pitch;
+		desc += 4;
+		offset += pitch * r->h;
+	}
+	return sz + n * 4 * sizeof(uint32_t);
+}
+
+static int
+layer_compar(const void *a, const void *b) {
+	const struct upload_rect *ra = (const struct upload_rect *)a;
+	const struct upload_rect *rb = (const struct upload_rect *)b;
+	return ra->layer - rb->layer;
+}
+
+static sg_view
+layer_target(struct texture_upload *U, int layer) {
+	if (U->target[layer].id == SG_INVALID_ID) {
+		U->target[layer] = sg_make_view(&(sg_view_desc) {
+			.color_attachment = { .image = U->img, .slice = layer },
+			.label = "texture-upload-target",
+		});
+	}
+	return U->target[layer];
+}
+
+size_t
+texture_upload_commit(struct texture_upload *U, const void *data, int first, int n) {
+	if (first < 0)
+		first = 0;
+	if (first + n > U->layers)
+		n = U->layers - first;
+	int last = first + n;
+	int i;
+	// the rects of the other layers are kept for another commit
+	struct upload_rect *rect = (struct upload_rect *)malloc(sizeof(struct upload_rect) * (U->rect_n + n));
+	if (rect == NULL)
+		return 0;
+	int rect_n = 0;
+	int keep_n = 0;
+	for (i=0;i<U->rect_n;i++) {
+		struct upload_rect *r = &U->rect[i];
+		if (r->layer < first || r->layer >= last)
+			U->rect[keep_n++] = *r;
+		else if (!U->full[r->layer])	// whole layers replace their rects
+			rect[rect_n++] = *r;
+	}
+	for (i=first;i<last;i++) {
+		if (U->full[i]) {
+			struct upload_rect *r = &rect[rect_n++];
+			r->x = 0;
+			r->y = 0;
+			r->w = U->width;
+			r->h = U->height;
+			r->layer = i;
+		}
+	}
+	qsort(rect, rect_n, sizeof(rect[0]), layer_compar);
+
+	size_t rect_offset = 0;
+	size_t sz = rect_n > 0 ? pack_rects(U, (const uint8_t *)data, first, rect, rect_n, &rect_offset) : 0;
+	if (rect_n > 0 && (sz == 0 || !prepare_buffer(U, sz))) {
+		// out of memory, keep the rects for the next commit
+		for (i=0;i<rect_n && keep_n < UPLOAD_RECT_MAX;i++) {
+			if (!U->full[rect[i].layer])
+				U->rect[keep_n++] = rect[i];
+		}
+		U->rect_n = keep_n;
+		free(rect);
+		return 0;
+	}
+	if (sz > 0)
+		sg_update_buffer(U->buffer, &(sg_range) { U->staging, sz });
+
+	vs_params_t u;
+	u.target[0] = 2.0f / U->width;
+	if (origin_bottom_left()) {
+		// texel row 0 is at the bottom (clip y = -1) of a GL render target
+		u.target[1] = 2.0f / U->height;
+		u.target[2] = -1.0f;
+	} else {
+		u.target[1] = -2.0f / U->height;
+		u.target[2] = 1.0f;
+	}
+	u.target[3] = 0;
+	u.info[1] = U->pixel_size;
+	u.info[2] = 0;
+	u.info[3] = 0;
+	int layer;
+	int from = 0;
+	for (layer = first; layer < last; layer++) {
+		int to = from;
+		while (to < rect_n && rect[to].layer == layer)
+			++to;
+		if (to == from && !U->clear[layer])
+			continue;
+		sg_pass_action action = {
+			.colors[0] = {
+				.load_action = U->clear[layer] ? SG_LOADACTION_CLEAR : SG_LOADACTION_LOAD,
+				.store_action = SG_STOREACTION_STORE,
+				.clear_value = { 0, 0, 0, 0 },
+			},
+		};
+		sg_begin_pass(&(sg_pass) {
+			.action = action,
+			.attachments.colors[0] = layer_target(U, layer),
+			.label = "texture-upload",
+		});
+		if (to > from) {
+			sg_bindings bind = { .views[VIEW_pixels] = U->buffer_view };
+			sg_apply_pipeline(U->pip);
+			sg_apply_bindings(&bind);
+			u.info[0] = (int)(rect_offset / sizeof(uint32_t)) + from * 4;
+			sg_apply_uniforms(UB_vs_params, &(sg_range){ &u, sizeof(u) });
+			sg_draw(0, 4, to - from);
+		}
+		sg_end_pass();
+		U->clear[layer] = 0;
+		U->full[layer] = 0;
+		from = to;
+	}
+	free(rect);
+	U->rect_n = keep_n;
+	return sz;
+}
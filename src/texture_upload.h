@@ -0,0 +1,22 @@
+#ifndef soluna_texture_upload_h
+#define soluna_texture_upload_h
+
+#include <stddef.h>
+#include "sokol/sokol_gfx.h"
+
+// Region updates of an image (a color attachment, all the layers of a texture array).
+// sokol can only replace a whole dynamic image, so the dirty rects are packed into a storage buffer
+// (only their bytes are uploaded) and drawn into the image by a blit pass per layer.
+
+struct texture_upload;
+
+struct texture_upload * texture_upload_new(sg_image img, int width, int height, int layers, sg_pixel_format format, int pixel_size);
+void texture_upload_delete(struct texture_upload *U);
+void texture_upload_dirty(struct texture_upload *U, int x, int y, int w, int h, int layer);
+// the layer is cleared (transparent) before the dirty rects of it are drawn
+void texture_upload_clear(struct texture_upload *U, int layer);
+// data holds the layers [first, first + n) one after another, the dirty rects of the other layers are kept.
+// Call it outside passes, at most once per frame. returns the bytes uploaded
+size_t texture_upload_commit(struct texture_upload *U, const void *data, int first, int n);
+
+#endif
@@ -0,0 +1,54 @@
+@vs vs
+layout(binding=0) uniform vs_params {
+	vec4 frame;	// framesize.xy, texsize
+	vec4 origin;	// x, y, tile width, tile height
+	vec4 sr;	// scale/rot matrix
+	ivec4 layer;	// width, first tile
+};
+
+struct tile_rect {
+	uint offset;
+	uint u;
+	uint v;
+	uint page;
+};
+
+// the sprite rect of each tile, an empty tile has zero size
+layout(binding=0) readonly buffer tiles {
+	tile_rect tile[];
+};
+
+out vec3 uv;	// z is the layer of the atlas
+
+void main() {
+	int index = gl_InstanceIndex + layer.y;
+	tile_rect t = tile[index];
+	ivec2 cell = ivec2(index % layer.x, index / layer.x);
+	ivec2 uv_base = ivec2(t.u >> 16, t.v >> 16);
+	ivec2 u2 = ivec2(0 , t.u & 0xffff);
+	ivec2 v2 = ivec2(0 , t.v & 0xffff);
+	ivec2 off = ivec2(t.offset >> 16 , t.offset & 0xffff) - 0x8000;
+	vec2 uv_offset = vec2(u2[gl_VertexIndex & 1] , v2[gl_VertexIndex >> 1]);
+	vec2 local = vec2(cell) * origin.zw + uv_offset - off;
+	vec2 pos = (local * mat2(sr) + origin.xy) * frame.xy;
+	gl_Position = vec4(pos.x - 1.0f, pos.y + 1.0f, 0, 1);
+	vec2 st = (uv_base + uv_offset) * abs(frame.z);
+	// negative texsize : a render target on GL, flip v
+	uv = vec3(st.x, frame.z < 0.0f ? 1.0f - st.y : st.y, t.page);
+}
+
+@end
+
+@fs fs
+layout(binding=1) uniform texture2DArray tex;
+layout(binding=0) uniform sampler smp;
+
+in vec3 uv;
+out vec4 frag_color;
+
+void main() {
+	frag_color = texture(sampler2DArray(tex,smp), uv);
+}
+@end
+
+@program tilemap vs fs
@@ -63,6 +63,256 @@ sprite_transform_apply(struct draw_primitive *p, struct transform * t) {
 	p->y = (int32_t)y + t->y;
 }
 
+// Transform n primitives (every stride slot) at once, (dx, dy) is added to each primitive before transform.
+// The result is the same as sprite_apply_xy() + sprite_transform_apply() for each primitive.
+
+static inline void
+stream_sr(struct draw_primitive *p, const struct transform *t) {
+	if (t->r != 0) {
+		int r = p->sr & 0xfff;
+		r = (r + t->r) % 4096;
+		p->sr = (p->sr & ~0xfff) | r;
+	}
+	if (t->s != 0x1000) {
+		sprite_apply_scale(p, t->s);
+	}
+}
+
+static void
+stream_scalar(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	int i;
+	for (i=0;i<n;i++) {
+		p->x += dx;
+		p->y += dy;
+		sprite_transform_apply(p, t);
+		p += stride;
+	}
+}
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+// (x * s) for int64 lanes, only low 64 bits are needed
+static inline __m256i
+mul64x32_avx2(__m256i x, __m256i s, int neg) {
+	__m256i lo = _mm256_mul_epu32(x, s);
+	__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), s);
+	if (neg)
+		hi = _mm256_sub_epi32(hi, x);
+	return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+static inline __m256i
+srai64_avx2(__m256i v, int n) {
+	__m256i sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+	return _mm256_or_si256(_mm256_srli_epi64(v, n), _mm256_slli_epi64(sign, 64 - n));
+}
+
+static int
+stream_simd(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	int rot = t->r != 0;
+	int scale = t->s != 0x1000;
+	int sin = 0, cos = 0;
+	if (rot)
+		sincos_lut(t->r, &sin, &cos);
+	const __m128i d = _mm_setr_epi32(dx, dy, dx, dy);
+	const __m128i trans = _mm_setr_epi32(t->x, t->y, t->x, t->y);
+	const __m256i vcos = _mm256_set1_epi64x(cos);
+	const __m256i vsin = _mm256_setr_epi64x(-sin, sin, -sin, sin);
+	const __m256i vs = _mm256_set1_epi64x((uint32_t)t->s);
+	const __m256i lo32 = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	int i;
+	for (i=0;i+1<n;i+=2) {
+		struct draw_primitive *p0 = p;
+		struct draw_primitive *p1 = p + stride;
+		__m128i xy = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p0), _mm_loadl_epi64((const __m128i *)p1));
+		xy = _mm_add_epi32(xy, d);
+		if (rot || scale) {
+			// x0, y0, x1, y1 as int64
+			__m256i v = _mm256_cvtepi32_epi64(xy);
+			if (rot) {
+				__m256i a = _mm256_mul_epi32(v, vcos);
+				__m256i b = _mm256_mul_epi32(_mm256_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)), vsin);
+				v = _mm256_add_epi64(a, b);
+				if (scale)
+					v = srai64_avx2(v, 24);
+				else
+					v = _mm256_srli_epi64(v, 24);
+			}
+			if (scale) {
+				v = mul64x32_avx2(v, vs, t->s < 0);
+				v = _mm256_srli_epi64(v, 12);
+			}
+			xy = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, lo32));
+		}
+		xy = _mm_add_epi32(xy, trans);
+		_mm_storel_epi64((__m128i *)p0, xy);
+		_mm_storel_epi64((__m128i *)p1, _mm_unpackhi_epi64(xy, xy));
+		stream_sr(p0, t);
+		stream_sr(p1, t);
+		p = p1 + stride;
+	}
+	if (i < n)
+		stream_scalar(p, 1, stride, dx, dy, t);
+	return 1;
+}
+
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+// signed (a * b) for the low 32 bits of each 64bit lane
+static inline __m128i
+mul32x32_sse2(__m128i a, __m128i b) {
+	__m128i p = _mm_mul_epu32(a, b);
+	__m128i corr = _mm_add_epi32(
+		_mm_and_si128(_mm_srai_epi32(a, 31), b),
+		_mm_and_si128(_mm_srai_epi32(b, 31), a));
+	return _mm_sub_epi64(p, _mm_slli_epi64(corr, 32));
+}
+
+// (x * s) for int64 lanes, only low 64 bits are needed
+static inline __m128i
+mul64x32_sse2(__m128i x, __m128i s, int neg) {
+	__m128i lo = _mm_mul_epu32(x, s);
+	__m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), s);
+	if (neg)
+		hi = _mm_sub_epi32(hi, x);
+	return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static inline __m128i
+srai64_sse2(__m128i v, int n) {
+	__m128i sign = _mm_shuffle_epi32(_mm_srai_epi32(v, 31), _MM_SHUFFLE(3,3,1,1));
+	return _mm_or_si128(_mm_srli_epi64(v, n), _mm_slli_epi64(sign, 64 - n));
+}
+
+static int
+stream_simd(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	int rot = t->r != 0;
+	int scale = t->s != 0x1000;
+	int sin = 0, cos = 0;
+	if (rot)
+		sincos_lut(t->r, &sin, &cos);
+	const __m128i d = _mm_setr_epi32(dx, dy, 0, 0);
+	const __m128i trans = _mm_setr_epi32(t->x, t->y, 0, 0);
+	const __m128i vcos = _mm_setr_epi32(cos, 0, cos, 0);
+	const __m128i vsin = _mm_setr_epi32(-sin, 0, sin, 0);
+	const __m128i vs = _mm_setr_epi32(t->s, 0, t->s, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		__m128i xy = _mm_add_epi32(_mm_loadl_epi64((const __m128i *)p), d);
+		if (rot || scale) {
+			__m128i v;
+			if (rot) {
+				// x, y in the low 32 bits of each lane
+				v = _mm_unpacklo_epi32(xy, xy);
+				__m128i a = mul32x32_sse2(v, vcos);
+				__m128i b = mul32x32_sse2(_mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)), vsin);
+				v = _mm_add_epi64(a, b);
+				if (scale)
+					v = srai64_sse2(v, 24);
+				else
+					v = _mm_srli_epi64(v, 24);
+			} else {
+				// sign extend x, y to int64
+				v = _mm_unpacklo_epi32(xy, _mm_srai_epi32(xy, 31));
+			}
+			if (scale) {
+				v = mul64x32_sse2(v, vs, t->s < 0);
+				v = _mm_srli_epi64(v, 12);
+			}
+			xy = _mm_shuffle_epi32(v, _MM_SHUFFLE(3,3,2,0));
+		}
+		xy = _mm_add_epi32(xy, trans);
+		_mm_storel_epi64((__m128i *)p, xy);
+		stream_sr(p, t);
+		p += stride;
+	}
+	return 1;
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+static int
+stream_simd(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	int rot = t->r != 0;
+	int scale = t->s != 0x1000;
+	int sin = 0, cos = 0;
+	if (rot)
+		sincos_lut(t->r, &sin, &cos);
+	const int32_t d_[2] = { dx, dy };
+	const int32_t trans_[2] = { t->x, t->y };
+	const int32_t sin_[2] = { -sin, sin };
+	const int32x2_t d = vld1_s32(d_);
+	const int32x2_t trans = vld1_s32(trans_);
+	const int32x2_t vsin = vld1_s32(sin_);
+	const uint32x2_t vs = vdup_n_u32((uint32_t)t->s);
+	int i;
+	for (i=0;i<n;i++) {
+		int32x2_t xy = vadd_s32(vld1_s32(&p->x), d);
+		if (rot || scale) {
+			int64x2_t v;
+			if (rot) {
+				v = vaddq_s64(vmull_n_s32(xy, cos), vmull_s32(vrev64_s32(xy), vsin));
+				v = vshrq_n_s64(v, 24);
+			} else {
+				v = vmovl_s32(xy);
+			}
+			if (scale) {
+				uint64x2_t x = vreinterpretq_u64_s64(v);
+				uint32x2_t xl = vmovn_u64(x);
+				uint32x2_t hi = vmul_u32(vshrn_n_u64(x, 32), vs);
+				if (t->s < 0)
+					hi = vsub_u32(hi, xl);
+				x = vaddq_u64(vmull_u32(xl, vs), vshll_n_u32(hi, 32));
+				v = vshrq_n_s64(vreinterpretq_s64_u64(x), 12);
+			}
+			xy = vmovn_s64(v);
+		}
+		vst1_s32(&p->x, vadd_s32(xy, trans));
+		stream_sr(p, t);
+		p += stride;
+	}
+	return 1;
+}
+
+#else
+
+static int
+stream_simd(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	return 0;
+}
+
+#endif
+
+void
+sprite_transform_stream(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	if (n <= 0)
+		return;
+	if (t->r == 0 && t->s == 0x1000) {
+		// translate only
+		int32_t x = dx + t->x;
+		int32_t y = dy + t->y;
+		if (x == 0 && y == 0)
+			return;
+		int i;
+		for (i=0;i<n;i++) {
+			p->x += x;
+			p->y += y;
+			p += stride;
+		}
+		return;
+	}
+	// negative rotation is out of the range of sin_lut, leave it to the scalar path
+	if (t->r < 0 || !stream_simd(p, n, stride, dx, dy, t)) {
+		stream_scalar(p, n, stride, dx, dy, t);
+	}
+}
+
 void
 sprite_transform_set(struct transform *t, float s, float r, float x, float y) {
 	t->s = (int32_t)(s * 4096);
@@ -105,3 +355,83 @@ sprite_transform_point(const struct transform *t, int *x, int *y) {
 	*x = (int)ox;
 	*y = (int)oy;
 }
+
+#ifdef TEST_TRANSFORM_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define N 200000
+#define ROUND 50
+
+static void
+fill(struct draw_primitive *p, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		p[i].x = (rand() % 8192 - 4096) * 256 + rand() % 256;
+		p[i].y = (rand() % 8192 - 4096) * 256 + rand() % 256;
+		p[i].sr = rand() % 2 ? 0 : (uint32_t)rand();
+		p[i].sprite = i + 1;
+	}
+}
+
+static void
+reference(struct draw_primitive *p, int n, int stride, int32_t dx, int32_t dy, struct transform *t) {
+	int i;
+	for (i=0;i<n;i++) {
+		p->x += dx;
+		p->y += dy;
+		sprite_transform_apply(p, t);
+		p += stride;
+	}
+}
+
+static double
+bench(struct draw_primitive *p, int n, int stride, struct transform *t, int stream) {
+	clock_t c = clock();
+	int i;
+	for (i=0;i<ROUND;i++) {
+		if (stream)
+			sprite_transform_stream(p, n, stride, 256, -256, t);
+		else
+			reference(p, n, stride, 256, -256, t);
+	}
+	return (double)(clock() - c) / CLOCKS_PER_SEC / ((double)ROUND * n) * 1e9;
+}
+
+static void
+test(const char *name, float s, float r, float x, float y, int stride) {
+	static struct draw_primitive a[N * 2], b[N * 2];
+	struct transform t;
+	sprite_transform_set(&t, s, r, x, y);
+	int n = N;
+	fill(a, n * stride);
+	memcpy(b, a, sizeof(a[0]) * n * stride);
+	reference(a, n, stride, 256, -256, &t);
+	sprite_transform_stream(b, n, stride, 256, -256, &t);
+	if (memcmp(a, b, sizeof(a[0]) * n * stride) != 0) {
+		printf("%s (stride %d) : MISMATCH\n", name, stride);
+		exit(1);
+	}
+	double ref = bench(a, n, stride, &t, 0);
+	double stream = bench(b, n, stride, &t, 1);
+	printf("%-10s stride %d : scalar %.2f ns stream %.2f ns\n", name, stride, ref, stream);
+}
+
+int
+main() {
+	sprite_transform_init();
+	int stride;
+	for (stride = 1; stride <= 2; stride++) {
+		test("translate", 1, 0, 100, 200, stride);
+		test("rot", 1, 0.7f, 100, 200, stride);
+		test("scale", 2.5f, 0, 100, 200, stride);
+		test("srt", 0.3f, 2.1f, -100, 50, stride);
+		test("negscale", -1.5f, 1.1f, 10, 20, stride);
+	}
+	return 0;
+}
+
+#endif
@@ -17,6 +17,40 @@ fopen_utf8(const char *filename, const char *mode) {
 	return _wfopen(filenameW, modeW);
 }
 
+// map the whole file read only, returns NULL if failed
+void *
+map_file_utf8(const char *filename, size_t *sz) {
+	WCHAR filenameW[FILENAME_MAX + 0x200 + 1];
+	int n = MultiByteToWideChar(CP_UTF8,0,(const char*)filename,-1,filenameW,FILENAME_MAX + 0x200);
+	if (n == 0)
+		return NULL;
+	HANDLE f = CreateFileW(filenameW, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(f, &size) || size.QuadPart == 0) {
+		CloseHandle(f);
+		return NULL;
+	}
+	HANDLE m = CreateFileMappingW(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(f);
+	if (m == NULL)
+		return NULL;
+	// the view keeps the mapping alive
+	void *ptr = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(m);
+	if (ptr == NULL)
+		return NULL;
+	*sz = (size_t)size.QuadPart;
+	return ptr;
+}
+
+void
+unmap_file(void *ptr, size_t sz) {
+	(void)sz;
+	UnmapViewOfFile(ptr);
+}
+
 #else
 
 FILE *
@@ -24,4 +58,32 @@ fopen_utf8(const char *filename, const char *mode) {
 	return fopen(filename, mode);
 }
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+void *
+map_file_utf8(const char *filename, size_t *sz) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	*sz = (size_t)st.st_size;
+	return ptr;
+}
+
+void
+unmap_file(void *ptr, size_t sz) {
+	munmap(ptr, sz);
+}
+
 #endif
\ No newline at end of file
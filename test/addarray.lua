@@ -0,0 +1,65 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/addarray.lua
+-- Compare batch:add_array with one batch:add per sprite
+local soluna = require "soluna"
+local ltask = require "ltask"
+
+soluna.set_window_title "soluna add_array benchmark"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local N <const> = 50000
+local ROUND <const> = 120
+
+local pos = {}
+local records = {}
+for i = 1, N do
+	local x = math.random(0, args.width)
+	local y = math.random(0, args.height)
+	local scale = 0.5 + math.random() * 0.5
+	local rot = math.random() * math.pi * 2
+	pos[i] = { x = x, y = y }
+	-- sprite id, x, y, scale, rot
+	records[i] = string.pack("<i4ffff", sprites.avatar, x, y, scale, rot)
+end
+records = table.concat(records)
+
+local function add_each()
+	local id = sprites.avatar
+	for i = 1, N do
+		local p = pos[i]
+		batch:add(id, p.x, p.y)
+	end
+end
+
+local function add_array()
+	batch:add_array(records, N)
+end
+
+local mode = { add_each, add_array }
+local name = { "add", "add_array" }
+local total = { 0, 0 }
+local current = 1
+local frame_n = 0
+
+local callback = {}
+
+function callback.frame(count)
+	local f = mode[current]
+	local t = ltask.counter()
+	batch:layer(0.5, args.width / 4, args.height / 4)
+	f()
+	batch:layer()
+	total[current] = total[current] + ltask.counter() - t
+	frame_n = frame_n + 1
+	if frame_n == ROUND then
+		print(string.format("%s : %.2f ns per sprite", name[current], total[current] / (ROUND * N) * 1e9))
+		total[current] = 0
+		frame_n = 0
+		current = current % #mode + 1
+	end
+end
+
+return callback
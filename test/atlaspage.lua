@@ -0,0 +1,28 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/atlaspage.lua texture_size=512 atlas_page=4
+-- The bundle spills into one atlas page per sprite, the sprites are still drawn in one draw call
+local soluna = require "soluna"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna atlas pages"
+local sprites = soluna.load_sprites "asset/atlaspage.dl"
+
+local args = ...
+local batch = args.batch
+
+local names = { "a1", "a2", "a3", "a4" }
+
+local callback = {}
+
+function callback.frame(count)
+	for i, name in ipairs(names) do
+		batch:add(sprites[name], i * args.width / 5, args.height / 2 + 128)
+	end
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d sprites : %d draw elements, %d draw calls",
+			#names, s.draw_element.last, s.draw_call.last))
+	end
+end
+
+return callback
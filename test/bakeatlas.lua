@@ -0,0 +1,30 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/bakeatlas.lua texture_size=512 atlas_page=4
+-- Bake asset/atlaspage.dl into atlaspage.atlas, then load the baked atlas (mapped, no png decoding)
+local soluna = require "soluna"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna baked atlas"
+local pages = soluna.bake_sprites("asset/atlaspage.dl", "atlaspage.atlas")
+print(string.format("Baked %d pages into atlaspage.atlas", pages))
+local sprites = soluna.load_sprites "atlaspage.atlas"
+
+local args = ...
+local batch = args.batch
+
+local names = { "a1", "a2", "a3", "a4" }
+
+local callback = {}
+
+function callback.frame(count)
+	for i, name in ipairs(names) do
+		batch:add(sprites[name], i * args.width / 5, args.height / 2 + 128)
+	end
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d sprites : %d draw calls, %d bytes uploaded",
+			#names, s.draw_call.last, s.texture_upload.max))
+	end
+end
+
+return callback
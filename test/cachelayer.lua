@@ -0,0 +1,47 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/cachelayer.lua
+-- A static background of 20000 sprites cached in an offscreen layer, drawn as one sprite.
+-- Press space to rebuild the background.
+local soluna = require "soluna"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna cache layer"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local N <const> = 20000
+
+local background = soluna.cache_layer(args.width, args.height)
+
+local function build()
+	batch:record()
+	for i = 1, N do
+		batch:add(sprites.avatar, math.random(0, args.width), math.random(0, args.height))
+	end
+	background:update(batch:record())
+end
+
+build()
+
+local callback = {}
+
+function callback.key(keycode, state)
+	if keycode == 32 and state == 1 then
+		build()
+	end
+end
+
+function callback.frame(count)
+	batch:add(background.sprite, 0, 0)
+	-- a moving sprite over the cached layer
+	batch:add(sprites.avatar, count % args.width, args.height // 2)
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d cached sprites : %d primitives, %d draw calls, max %d offscreen passes per frame",
+			N, s.primitive.last, s.draw_call.last, s.offscreen_pass.max))
+	end
+end
+
+return callback
@@ -0,0 +1,54 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/chatlog.lua
+-- A chat log with color tags, print the draw calls per frame
+local soluna = require "soluna"
+local ltask = require "ltask"
+local mattext = require "soluna.material.text"
+local font = require "soluna.font"
+local stats = require "soluna.stats"
+
+local function font_init()
+	local sysfont = require "soluna.font.system"
+	font.import(assert(sysfont.ttfdata "微软雅黑"))
+	return font.name ""
+end
+
+soluna.set_window_title "soluna chat log"
+
+local args = ...
+local batch = args.batch
+local fontid = font_init()
+local fontcobj = font.cobj()
+
+local LINES <const> = 24
+local WIDTH <const> = 800
+local HEIGHT <const> = 28
+
+local names = { "[FF4040]Alice[n]", "[40FF40]Bob[n]", "[4080FF]Carol[n]", "[FFFF40]Dave[n]" }
+local words = { "hello", "[FF8000]gold[n]", "quest", "[00FFFF]potion[n]", "ready", "[FF00FF]rare[n]", "go" }
+
+-- size 20; color white; alignment left
+local block = mattext.block(fontcobj, fontid, 20, 0xffffff, "LT")
+
+local lines = {}
+for i = 1, LINES do
+	local msg = { names[i % #names + 1], ":" }
+	for j = 1, 6 do
+		msg[#msg+1] = words[(i * 7 + j) % #words + 1]
+	end
+	lines[i] = block(table.concat(msg, " "), WIDTH, HEIGHT)
+end
+
+local callback = {}
+
+function callback.frame(count)
+	for i = 1, LINES do
+		batch:add(lines[i], 16, 16 + (i - 1) * HEIGHT)
+	end
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d lines : %d draw calls, %d draw elements", LINES, s.draw_call.last, s.draw_element.last))
+	end
+end
+
+return callback
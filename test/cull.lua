@@ -0,0 +1,50 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/cull.lua
+-- bin/soluna.exe entry=test/cull.lua viewport_cull=false
+-- A scrolling world larger than the window, most sprites are off-screen
+local soluna = require "soluna"
+local ltask = require "ltask"
+
+soluna.set_window_title "soluna viewport cull"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local render = ltask.uniqueservice "render"
+
+local N <const> = 50000
+local WORLD_W <const> = args.width * 3
+local WORLD_H <const> = args.height * 3
+
+local pos = {}
+for i = 1, N do
+	pos[i] = {
+		x = math.random(0, WORLD_W),
+		y = math.random(0, WORLD_H),
+		r = math.random() * math.pi * 2,
+	}
+end
+
+local callback = {}
+
+function callback.frame(count)
+	local t = count * 0.005
+	local cx = (WORLD_W - args.width) * (0.5 + 0.5 * math.sin(t))
+	local cy = (WORLD_H - args.height) * (0.5 + 0.5 * math.cos(t))
+	local id = sprites.avatar
+	batch:layer(-cx, -cy)
+	for i = 1, N do
+		local p = pos[i]
+		batch:layer(0.5, p.r, p.x, p.y)
+		batch:add(id)
+		batch:layer()
+	end
+	batch:layer()
+	if count % 120 == 0 then
+		local culled, total = ltask.call(render, "culled")
+		print(string.format("culled %d / %d", culled, total))
+	end
+end
+
+return callback
@@ -0,0 +1,52 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/decode.lua decode_thread=8
+-- Load a bundle of 500 png files with one decode thread and with decode_thread threads
+local soluna = require "soluna"
+local ltask = require "ltask"
+local lfs = require "soluna.lfs"
+local file = require "soluna.file"
+local image = require "soluna.image"
+local spritebundle = require "soluna.spritebundle"
+
+soluna.set_window_title "soluna png decode"
+
+local COUNT <const> = 500
+local dir = "decode_bench"
+
+-- write COUNT copies of avatar.png (slightly different pixels, so nothing can be shared) and a bundle of them
+local function make_bundle()
+	lfs.mkdir(dir)
+	local content, w, h = image.load(file.load "asset/avatar.png")
+	local bundle = {}
+	for i = 1, COUNT do
+		local img = image.new(w, h, content)
+		local c = img:canvas()
+		image.clear(c, i % w, 0, 1, 1)
+		local name = string.format("s%03d.png", i)
+		img:write(dir .. "/" .. name)
+		bundle[i] = string.format("--\nname : s%d\nfilename : %s\nx : -0.5\ny : -1\n", i, name)
+	end
+	local f = assert(io.open(dir .. "/bundle.dl", "wb"))
+	f:write(table.concat(bundle))
+	f:close()
+end
+
+local function load_time(threads)
+	local filecache = setmetatable({ __missing = {} }, { __index = spritebundle.loadimage })
+	local t = ltask.counter()
+	spritebundle.load(filecache, dir .. "/bundle.dl", threads)
+	return ltask.counter() - t
+end
+
+make_bundle()
+local threads = soluna.settings().decode_thread
+local t1 = load_time(1)
+local tn = load_time(threads)
+print(string.format("%d images : 1 thread %.3fs, %d threads %.3fs (x%.2f)", COUNT, t1, threads, tn, t1 / tn))
+
+local callback = {}
+
+function callback.frame(count)
+end
+
+return callback
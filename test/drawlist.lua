@@ -0,0 +1,51 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/drawlist.lua
+-- Many small draw elements (interleaved sprites and quads), print frame time and draw calls
+local soluna = require "soluna"
+local ltask = require "ltask"
+local matquad = require "soluna.material.quad"
+
+soluna.set_window_title "soluna draw list"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local render = ltask.uniqueservice "render"
+
+local N <const> = 5000
+local ROUND <const> = 120
+
+local objs = {}
+for i = 1, N do
+	objs[i] = {
+		x = math.random(0, args.width),
+		y = math.random(0, args.height),
+	}
+end
+
+local quad = matquad.quad(32, 8, 0x40000000)
+local frame_n = 0
+local last
+
+local callback = {}
+
+function callback.frame(count)
+	local id = sprites.avatar
+	for i = 1, N do
+		local o = objs[i]
+		batch:add(quad, o.x, o.y + 24)
+		batch:add(id, o.x, o.y)
+	end
+	frame_n = frame_n + 1
+	if frame_n == 1 then
+		last = ltask.counter()
+	elseif frame_n == ROUND then
+		local t = ltask.counter() - last
+		local draw_calls = ltask.call(render, "draw_calls")
+		print(string.format("%d draw calls : %.2f ms per frame", draw_calls, t / (ROUND - 1) * 1000))
+		frame_n = 0
+	end
+end
+
+return callback
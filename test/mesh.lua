@@ -0,0 +1,63 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/mesh.lua
+-- Deformed sprite grids and a vector fan, meshes sharing a texture are drawn in one indexed draw
+local soluna = require "soluna"
+local mesh = require "soluna.material.mesh"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna mesh"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local GRID <const> = 8
+local SIZE <const> = 128
+local N <const> = 50
+
+-- a (GRID+1)^2 vertex grid over the sprite
+local function grid()
+	local v, idx = {}, {}
+	for y = 0, GRID do
+		for x = 0, GRID do
+			local u, t = x / GRID, y / GRID
+			table.move({ u * SIZE, t * SIZE, u, t, 0xffffffff }, 1, 5, #v + 1, v)
+		end
+	end
+	for y = 0, GRID - 1 do
+		for x = 0, GRID - 1 do
+			local i = y * (GRID + 1) + x
+			table.move({ i, i + 1, i + GRID + 1, i + 1, i + GRID + 2, i + GRID + 1 }, 1, 6, #idx + 1, idx)
+		end
+	end
+	return mesh.shape(v, idx)
+end
+
+local shapes = {}
+for i = 1, N do
+	shapes[i] = { shape = grid(), x = math.random(0, args.width - SIZE), y = math.random(0, args.height - SIZE), phase = i }
+end
+
+local callback = {}
+
+function callback.frame(count)
+	local t = count / 30
+	local id = sprites.avatar
+	for i = 1, N do
+		local s = shapes[i]
+		local shape = s.shape
+		for y = 0, GRID do
+			for x = 0, GRID do
+				local wave = math.sin(t + s.phase + y * 0.8) * 6
+				shape:vertex(y * (GRID + 1) + x, x / GRID * SIZE + wave, y / GRID * SIZE)
+			end
+		end
+		batch:add(shape:primitive(id), s.x, s.y)
+	end
+	if count % 120 == 0 then
+		local st = stats.get()
+		print(string.format("%d meshes : %d vertices, %d draw calls", N, st.instance.last, st.draw_call.last))
+	end
+end
+
+return callback
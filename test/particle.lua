@@ -0,0 +1,53 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/particle.lua
+-- 100 emitters of 2000 particles each, 100 primitives per frame instead of 200k sprites
+local soluna = require "soluna"
+local ltask = require "ltask"
+local particle = require "soluna.material.particle"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna particle"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local N <const> = 100
+local COUNT <const> = 2000
+
+local fountain = particle.emitter {
+	lifetime = 2,
+	speed = { 100, 300 },
+	angle = { -120, -60 },
+	gravity = { 0, 200 },
+	scale = { 0.3, 0.05 },
+	spin = 180,
+}
+
+local emitters = {}
+for i = 1, N do
+	emitters[i] = {
+		x = math.random(0, args.width),
+		y = math.random(0, args.height),
+		start = ltask.counter() - math.random() * 2,
+		seed = i,
+	}
+end
+
+local callback = {}
+
+function callback.frame(count)
+	local now = ltask.counter()
+	local id = sprites.avatar
+	for i = 1, N do
+		local e = emitters[i]
+		batch:add(fountain:primitive(id, COUNT, now - e.start, e.seed), e.x, e.y)
+	end
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d emitters : %d particles, %d primitives, %d draw calls",
+			N, s.particle.last, s.primitive.last, s.draw_call.last))
+	end
+end
+
+return callback
@@ -0,0 +1,78 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/pipeline.lua frame_pipeline=1
+-- bin/soluna.exe entry=test/pipeline.lua frame_pipeline=2
+-- A CPU heavy scene, compare the frame time with different pipeline depth
+local soluna = require "soluna"
+local ltask = require "ltask"
+
+local setting = soluna.settings()
+soluna.set_window_title "soluna pipeline benchmark"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local N <const> = 20000
+local ROUND <const> = 120
+
+local objs = {}
+for i = 1, N do
+	objs[i] = {
+		x = math.random(0, args.width),
+		y = math.random(0, args.height),
+		vx = math.random() * 4 - 2,
+		vy = math.random() * 4 - 2,
+	}
+end
+
+-- burn some cpu in game logic
+local function update()
+	local w, h = args.width, args.height
+	for i = 1, N do
+		local o = objs[i]
+		local x, y = o.x + o.vx, o.y + o.vy
+		if x < 0 or x > w then
+			o.vx = -o.vx
+		end
+		if y < 0 or y > h then
+			o.vy = -o.vy
+		end
+		o.x, o.y = x, y
+		local d = math.sqrt(o.vx * o.vx + o.vy * o.vy)
+		o.r = math.atan(o.vy, o.vx) + d
+	end
+end
+
+local callback = {}
+
+local last
+local frame_time = 0
+local logic_time = 0
+local frame_n = 0
+
+function callback.frame(count)
+	local t = ltask.counter()
+	if last then
+		frame_time = frame_time + t - last
+	end
+	last = t
+	update()
+	local id = sprites.avatar
+	for i = 1, N do
+		local o = objs[i]
+		batch:layer(0.25, o.r, o.x, o.y)
+		batch:add(id)
+		batch:layer()
+	end
+	logic_time = logic_time + ltask.counter() - t
+	frame_n = frame_n + 1
+	if frame_n == ROUND then
+		print(string.format("pipeline %d : frame %.2f ms, logic %.2f ms",
+			setting.frame_pipeline, frame_time / ROUND * 1000, logic_time / ROUND * 1000))
+		frame_time = 0
+		logic_time = 0
+		frame_n = 0
+	end
+end
+
+return callback
@@ -0,0 +1,36 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/record.lua
+-- Record a group of sprites once, then replay it many times
+local soluna = require "soluna"
+
+soluna.set_window_title "soluna record/replay"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+batch:record()
+for i = 0, 7 do
+	local r = i * math.pi / 4
+	batch:layer(r)
+	batch:add(sprites.avatar, 64, 0)
+	batch:layer()
+end
+local ring = batch:record()
+print("ring primitives :", #ring)
+
+local callback = {}
+
+function callback.frame(count)
+	local rot = count * 0.02
+	for y = 1, 4 do
+		for x = 1, 6 do
+			batch:layer(0.25, rot * ((x + y) % 2 * 2 - 1), x * 150, y * 150)
+			batch:replay(ring)
+			batch:layer()
+		end
+	end
+	batch:replay(ring, args.width - 100, args.height - 100)
+end
+
+return callback
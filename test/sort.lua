@@ -0,0 +1,52 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/sort.lua
+-- Interleaved sprites and quads, compare draw calls with and without draw sort
+local soluna = require "soluna"
+local ltask = require "ltask"
+local matquad = require "soluna.material.quad"
+
+soluna.set_window_title "soluna draw sort"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local render = ltask.uniqueservice "render"
+
+local N <const> = 1000
+local ROUND <const> = 120
+
+local objs = {}
+for i = 1, N do
+	objs[i] = {
+		x = math.random(0, args.width),
+		y = math.random(0, args.height),
+	}
+end
+
+local sort = false
+local frame_n = 0
+
+local callback = {}
+
+function callback.frame(count)
+	local id = sprites.avatar
+	for i = 1, N do
+		local o = objs[i]
+		-- order between objects doesn't matter, only keep the shadow under the sprite
+		batch:zkey(0)
+		batch:add(matquad.quad(32, 8, 0x40000000), o.x, o.y + 24)
+		batch:zkey(1)
+		batch:add(id, o.x, o.y)
+	end
+	frame_n = frame_n + 1
+	if frame_n == ROUND then
+		local draw_calls = ltask.call(render, "draw_calls")
+		print(string.format("sort %s : %d draw calls", sort, draw_calls))
+		sort = not sort
+		ltask.call(render, "draw_sort", sort)
+		frame_n = 0
+	end
+end
+
+return callback
@@ -3,25 +3,38 @@ local spritemgr = require "soluna.spritemgr"
 -- texture size = 128
 local bank = spritemgr.newbank(65536, 128)
 
-local ids = {
+local function pack(ids)
+	for _, id in ipairs(ids) do
+		bank:touch(id)
+	end
+	local r, evicted, dropped, pages = bank:pack()
+	-- publish the placements to the sprites (the render service does it after the atlas upload)
+	spritemgr.apply(bank:ptr(), r, evicted, dropped, pages)
+	for k,v in pairs(r) do
+		r[k] = { page = v >> 32, x = (v >> 16) & 0xffff, y = v & 0xffff }
+	end
+	return r
+end
+
+local r = pack {
 	bank:add(32, 16),
 	bank:add(64, 32),
 	bank:add(96, 96),
 	bank:add(96, 96),
 }
+print_r("First", r)
 
-for _, id in ipairs(ids) do
-	bank:touch(id)
-end
-
-local texid, n = bank:pack()
-print("Pack",n,"from",texid)
+-- only the new sprites are placed, into the free space left in the pages
+r = pack {
+	bank:add(16, 16),
+	bank:add(24, 8),
+}
+print_r("Second", r)
 
-for i = 1, n do
-	local r = bank:altas(texid + i - 1)
-	for k,v in pairs(r) do
-		r[k] = { x = v >> 32, y = v & 0xffffffff }
+for page = 0, 2 do
+	local p = bank:altas(page)
+	for k,v in pairs(p) do
+		p[k] = { x = v >> 32, y = v & 0xffffffff }
 	end
-	print_r(i, r)
+	print_r(page, p)
 end
-
@@ -0,0 +1,68 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/srmode.lua
+-- Compare scale/rotation in srbuffer (lut) with scale/rotation in instance data
+local soluna = require "soluna"
+local ltask = require "ltask"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna sr mode benchmark"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local render = ltask.uniqueservice "render"
+
+local N <const> = 50000
+local ROUND <const> = 120
+
+-- distinct : number of different scale/rotation pairs
+local function records(distinct)
+	local r = {}
+	for i = 1, N do
+		local k = i % distinct
+		local scale = 0.5 + (k % 64) / 128
+		local rot = (k // 64) * 0.001
+		-- sprite id, x, y, scale, rot
+		r[i] = string.pack("<i4ffff", sprites.avatar, math.random(0, args.width), math.random(0, args.height), scale, rot)
+	end
+	return table.concat(r)
+end
+
+local scene = {
+	{ name = "shared", records = records(16) },
+	{ name = "unique", records = records(N) },
+}
+local mode = { "lut", "instance", "auto" }
+
+local current_scene = 1
+local current_mode = 1
+local frame_n = 0
+local last
+
+ltask.call(render, "sr_mode", mode[current_mode])
+
+local callback = {}
+
+function callback.frame(count)
+	batch:add_array(scene[current_scene].records, N)
+	frame_n = frame_n + 1
+	if frame_n == 1 then
+		last = ltask.counter()
+	elseif frame_n == ROUND then
+		local t = ltask.counter() - last
+		local s = stats.get()
+		print(string.format("%s sr, %-8s : %.2f ms per frame, instance %d, srbuffer upload %.0f bytes",
+			scene[current_scene].name, mode[current_mode],
+			t / (ROUND - 1) * 1000, s.instance.last, s.srbuffer_upload.avg))
+		frame_n = 0
+		current_mode = current_mode + 1
+		if current_mode > #mode then
+			current_mode = 1
+			current_scene = current_scene % #scene + 1
+		end
+		ltask.call(render, "sr_mode", mode[current_mode])
+	end
+end
+
+return callback
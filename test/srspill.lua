@@ -0,0 +1,28 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/srspill.lua srbuffer_size=4096
+-- More distinct scale/rotation pairs than srbuffer_size, srbuffer spills into more pages
+local soluna = require "soluna"
+
+soluna.set_window_title "soluna srbuffer spill"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local N <const> = 20000
+
+local callback = {}
+
+function callback.frame(count)
+	local id = sprites.avatar
+	local w, h = args.width, args.height
+	for i = 1, N do
+		local scale = 0.2 + (i % 97) * 0.01
+		local rot = (i + count) * 0.001
+		batch:layer(scale, rot, (i * 37) % w, (i * 91) % h)
+		batch:add(id)
+		batch:layer()
+	end
+end
+
+return callback
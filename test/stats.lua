@@ -0,0 +1,36 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/stats.lua
+-- Print the per-frame render statistics (last/min/avg/max of recent frames)
+local soluna = require "soluna"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna stats"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local callback = {}
+
+local function dump()
+	local s = stats.get()
+	print("frame", s.frame)
+	for _, name in ipairs { "primitive", "draw_element", "culled", "instance", "srbuffer_entry", "srbuffer_upload", "font_miss", "atlas_repack", "draw_call", "instance_upload", "tile_upload", "particle", "offscreen_pass", "sprite_miss", "atlas_evict", "texture_upload" } do
+		local v = s[name]
+		if v then
+			print(string.format("\t%-16s last %6d min %6d avg %9.1f max %6d", name, v.last, v.min, v.avg, v.max))
+		end
+	end
+end
+
+function callback.frame(count)
+	local n = count % 1000
+	for i = 1, n do
+		batch:add(sprites.avatar, (i * 37) % args.width, (i * 91) % args.height)
+	end
+	if count % 120 == 0 then
+		dump()
+	end
+end
+
+return callback
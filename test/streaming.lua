@@ -0,0 +1,35 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/streaming.lua texture_size=512 atlas_page=2 atlas_keep_frame=60
+-- Four sprites, one atlas page each, with a budget of two pages : the pair drawn changes every 3 seconds,
+-- the pages of the pair not drawn are evicted and reused, evicted sprites are uploaded again on demand
+local soluna = require "soluna"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna atlas streaming"
+local sprites = soluna.load_sprites "asset/atlaspage.dl"
+
+local args = ...
+local batch = args.batch
+
+local pairs_list = {
+	{ "a1", "a2" },
+	{ "a3", "a4" },
+	{ "a2", "a3" },
+}
+
+local callback = {}
+
+function callback.frame(count)
+	local names = pairs_list[(count // 180) % #pairs_list + 1]
+	for i, name in ipairs(names) do
+		batch:add(sprites[name], i * args.width / 3, args.height / 2 + 128)
+	end
+	if count % 60 == 0 then
+		local s = stats.get()
+		-- max of the recent frames
+		print(string.format("%s %s : %d sprite miss, %d pages evicted",
+			names[1], names[2], s.sprite_miss.max, s.atlas_evict.max))
+	end
+end
+
+return callback
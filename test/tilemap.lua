@@ -0,0 +1,45 @@
+-- To run this sample :
+-- bin/soluna.exe entry=test/tilemap.lua
+-- A 256x256 tile layer drawn by one primitive, scrolling, a few tiles change every second
+local soluna = require "soluna"
+local tilemap = require "soluna.material.tilemap"
+local stats = require "soluna.stats"
+
+soluna.set_window_title "soluna tilemap"
+local sprites = soluna.load_sprites "asset/sprites.dl"
+
+local args = ...
+local batch = args.batch
+
+local W <const> = 256
+local H <const> = 256
+local TILE <const> = 32
+
+local layer = tilemap.layer(W, H, TILE, TILE)
+for y = 0, H - 1 do
+	for x = 0, W - 1 do
+		if (x + y) % 3 ~= 0 then
+			layer:set(x, y, sprites.avatar)
+		end
+	end
+end
+
+local callback = {}
+
+function callback.frame(count)
+	if count % 60 == 0 then
+		for i = 1, 8 do
+			local x, y = math.random(0, W - 1), math.random(0, H - 1)
+			layer:set(x, y, layer:get(x, y) == nil and sprites.avatar or nil)
+		end
+	end
+	local scroll = count % (H * TILE - args.height)
+	batch:add(layer:primitive(), 0, -scroll)
+	if count % 120 == 0 then
+		local s = stats.get()
+		print(string.format("%d tiles : %d primitives, %d draw calls, %d tiles uploaded",
+			W * H, s.primitive.last, s.draw_call.last, s.tile_upload.last))
+	end
+end
+
+return callback